@@ -156,3 +156,24 @@ function(mp_make_shared name)
         endif()
     endforeach()
 endfunction()
+
+# Add a test executable, which ctest runs under the same name. A test passes if
+# it exits with 0 (see tests/check.h)
+function(mp_add_test name)
+    cmake_parse_arguments(
+        PARSE_ARGV
+        1
+        arg
+        ""
+        ""
+        "SRC_FILES;DEPS;INCLUDE_DIRS"
+    )
+
+    add_executable(${name} ${arg_SRC_FILES})
+    target_include_directories(${name} PRIVATE ${PROJECT_SOURCE_DIR}/tests ${arg_INCLUDE_DIRS})
+    target_compile_features(${name} PRIVATE cxx_std_23)
+    if(DEFINED arg_DEPS)
+        target_link_libraries(${name} PRIVATE ${arg_DEPS})
+    endif()
+    add_test(NAME ${name} COMMAND ${name})
+endfunction()
@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+
+# Compare the size and write time of JSON and binary (.mpb) reports.
+#
+# Each example is run once per format, and the total time of the run (which
+# includes writing the report) is printed along with the size of the report.
+# Pass `-n <repeats>` to run each example several times, and keep the fastest
+# run. Reports are written to a temporary directory, and then removed.
+
+if [[ "$(uname -s)" == "Darwin" ]]; then
+  _preload=DYLD_INSERT_LIBRARIES
+  _lib_ext="dylib"
+  _size() {
+    stat -f %z "${1}"
+  }
+else
+  _preload=LD_PRELOAD
+  _lib_ext="so"
+  _size() {
+    stat -c %s "${1}"
+  }
+fi
+
+repeats=1
+if [[ "${1}" == "-n" ]]; then
+    repeats="${2}"
+fi
+
+mp_runtime="build/libmp_runtime.${_lib_ext}"
+out_dir="$(mktemp -d)"
+trap 'rm -rf "${out_dir}"' EXIT
+
+# Run an example with the runtime preloaded, and print the time taken in ms
+_run() {
+    local start end
+    start=$(date +%s%N)
+    env "${_preload}=${mp_runtime}" MEM_PROFILE_OUT="${2}" "${1}" > /dev/null
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+printf '%-36s %12s %9s %12s %9s\n' example "json bytes" "json ms" "mpb bytes" "mpb ms"
+for file in examples/build/*; do
+    if [[ -f $file && -x $file ]]; then
+        name="$(basename "${file}")"
+        line="$(printf '%-36s' "${name}")"
+        for ext in json mpb; do
+            best=""
+            for (( i = 0; i < repeats; i++ )); do
+                ms="$(_run "${file}" "${out_dir}/${name}.${ext}")"
+                if [[ -z "${best}" || "${ms}" -lt "${best}" ]]; then
+                    best="${ms}"
+                fi
+            done
+            line+="$(printf ' %12s %9s' "$(_size "${out_dir}/${name}.${ext}")" "${best}")"
+        done
+        echo "${line}"
+    fi
+done
@@ -38,12 +38,16 @@ mp_runtime="build/libmp_runtime.${_lib_ext}"
 
 _dsymutil "${mp_runtime}"
 
+# Each example is run once per report format, so that there's a JSON and a
+# binary (.mpb) fixture for each
 for file in examples/build/*; do
     if [[ -f $file && -x $file ]]; then
         example_name="$(_basename "${file}")"
         _dsymutil "$file"
-        _echo env "${_preload}=${mp_runtime}" \
-            MEM_PROFILE_OUT=etc/test_files/${_os}/${example_name}.json \
-            "${file}"
+        for ext in json mpb; do
+            _echo env "${_preload}=${mp_runtime}" \
+                MEM_PROFILE_OUT=etc/test_files/${_os}/${example_name}.${ext} \
+                "${file}"
+        done
     fi
 done
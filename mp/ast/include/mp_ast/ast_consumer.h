@@ -2,13 +2,17 @@
 
 #include <mp_ast/ast_env.h>
 #include <mp_ast/dtor_visitor.h>
+#include <mp_ast/instrument_filter.h>
 
 namespace mp {
 class ast_consumer : public ASTConsumer {
     CompilerInstance& compiler;
+    instrument_filter filter;
 
   public:
-    ast_consumer(CompilerInstance& compiler) : compiler(compiler) {}
+    ast_consumer(CompilerInstance& compiler, instrument_filter filter = {})
+      : compiler(compiler)
+      , filter(std::move(filter)) {}
 
     void HandleTranslationUnit(ASTContext& ctx) override {
         dtor_visitor v(compiler);
@@ -23,8 +27,12 @@ class ast_consumer : public ASTConsumer {
                          || v.print_dtor_body //
                          || get_env_flag("MEM_PROFILE_PRINT_NAME");
 
+        v.instrument_methods = filter.instruments_methods();
+        v.filter             = std::move(filter);
+
         v.TraverseDecl(ctx.getTranslationUnitDecl());
         v.rewrite_dtors();
+        v.rewrite_methods();
     }
 };
 } // namespace mp
@@ -3,6 +3,7 @@
 #include <clang/AST/AST.h>
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/Expr.h>
+#include <clang/AST/Mangle.h>
 #include <clang/AST/RecordLayout.h>
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/AST/Type.h>
@@ -10,8 +11,11 @@
 #include <clang/Frontend/FrontendPluginRegistry.h>
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <clang/Sema/Sema.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Support/raw_ostream.h>
+#include <memory>
 #include <span>
+#include <unordered_map>
 
 namespace mp {
 using Loc = clang::SourceLocation;
@@ -22,6 +26,18 @@ struct On {
     ASTContext& ctx;
     QualType    type;
 
+    /// Returns an implicit cast to `void const*` for the given pointer, so
+    /// that `this` can be passed from a const method
+    ImplicitCastExpr* to_const_void_ptr(Expr* expr) {
+        return ImplicitCastExpr::Create(ctx,
+                                        ctx.getPointerType(ctx.VoidTy.withConst()),
+                                        CK_BitCast,
+                                        expr,
+                                        nullptr,
+                                        VK_PRValue,
+                                        FPOptionsOverride());
+    }
+
     ImplicitCastExpr* decay_to_function_ptr(Expr* expr) {
         return ImplicitCastExpr::Create(ctx,
                                         ctx.getPointerType(type),
@@ -37,6 +53,16 @@ struct ast_tools {
     ASTContext&       ctx = compiler.getASTContext();
     PrintingPolicy    pol = ctx.getPrintingPolicy();
 
+    /// Used to derive the names of type descriptors (see type_data_var)
+    std::unique_ptr<MangleContext>               mangler{ctx.createMangleContext()};
+    /// The descriptor of each type seen so far
+    std::unordered_map<CXXRecordDecl*, VarDecl*> type_data_vars;
+    /// Declarations found by find_function_decl and find_record_decl. The
+    /// plugin only looks them up once the translation unit has been parsed,
+    /// so they can't change afterwards.
+    llvm::StringMap<FunctionDecl*>               function_decls;
+    llvm::StringMap<CXXRecordDecl*>              record_decls;
+
     ast_tools(CompilerInstance& compiler) : compiler(compiler) {
         // Ensures that tag keywords such as 'struct' or 'class' are suppressed
         // when printing the type name
@@ -118,12 +144,24 @@ struct ast_tools {
         return nullptr;
     }
 
+    /// Find a function declared at namespace scope. The result is cached,
+    /// since the hooks are looked up for every method that's instrumented
     FunctionDecl* find_function_decl(StringRef name) {
-        return get_decl_by_type<FunctionDecl>(name);
+        auto [it, inserted] = function_decls.try_emplace(name, nullptr);
+        if (inserted) {
+            it->second = get_decl_by_type<FunctionDecl>(name);
+        }
+        return it->second;
     }
 
+    /// Find a class declared at namespace scope. The result is cached, like
+    /// find_function_decl
     CXXRecordDecl* find_record_decl(StringRef name) {
-        return get_decl_by_type<CXXRecordDecl>(name);
+        auto [it, inserted] = record_decls.try_emplace(name, nullptr);
+        if (inserted) {
+            it->second = get_decl_by_type<CXXRecordDecl>(name);
+        }
+        return it->second;
     }
 
     /// Returns an implicit cast to a void pointer for the given expression
@@ -241,6 +279,12 @@ struct ast_tools {
         return CXXThisExpr::Create(ctx, loc, ctx.getPointerType(type), is_implicit);
     }
 
+    /// `this` within the given method. Unlike this_expr(loc, type), it has the
+    /// cv-qualifiers of the method
+    CXXThisExpr* this_expr(Loc loc, CXXMethodDecl* method, bool is_implicit = false) {
+        return CXXThisExpr::Create(ctx, loc, method->getThisType(), is_implicit);
+    }
+
     auto op_postfix_inc(Loc loc, Expr* expr, QualType type) -> UnaryOperator* {
         return UnaryOperator::Create(ctx,
                                      expr,
@@ -394,13 +438,53 @@ struct ast_tools {
         return result;
     }
 
-    auto invoke_hook(Loc            loc,
-                     QualType       type,
-                     FunctionDecl*  hook_decl,
-                     CXXRecordDecl* record,
-                     CXXMethodDecl* method_ctx) {
-        // Get a function pointer to the hook
-        auto func = fn_ptr(loc, hook_decl);
+    /// Name of a variable describing the given type. Names are derived from
+    /// the mangled name of the type, so the same type gets the same name in
+    /// every translation unit.
+    auto type_data_name(StringRef prefix, StringRef mangled_type) -> std::string {
+        return (prefix + "_" + mangled_type).str();
+    }
+
+    /// Move a variable declared in the translation unit to namespace scope,
+    /// and hand it to code generation, which never saw it as a top-level
+    /// declaration.
+    ///
+    /// If `is_inline`, the variable becomes an inline variable, which is
+    /// emitted as a COMDAT: every translation unit which uses it emits the
+    /// same definition, and the linker only keeps one. Otherwise it has
+    /// internal linkage.
+    void publish_global_var(VarDecl* var, bool is_inline) {
+        if (is_inline) {
+            var->setStorageClass(SC_None);
+            var->setInlineSpecified();
+        }
+        auto* tu = ctx.getTranslationUnitDecl();
+        tu->addDecl(var);
+        compiler.getASTConsumer().HandleTopLevelDecl(DeclGroupRef(var));
+    }
+
+    /// Get the `_mp_type_data` describing a type, declaring it (and the arrays
+    /// it points to) at namespace scope the first time the type is seen.
+    ///
+    /// On ELF targets, the descriptor is placed in the `mp_types` section, so
+    /// that the runtime can enumerate every type in a module (see
+    /// _mp_register_types). Types with external linkage get one descriptor
+    /// per program, rather than one per instrumented function.
+    auto type_data_var(Loc loc, QualType type, CXXRecordDecl* record) -> VarDecl* {
+        if (auto it = type_data_vars.find(record); it != type_data_vars.end()) {
+            return it->second;
+        }
+
+        std::string mangled;
+        {
+            llvm::raw_string_ostream os(mangled);
+            mangler->mangleCXXRTTIName(type, os);
+        }
+        // Descriptors of types without linkage must not be merged with those
+        // of unrelated types that happen to have the same mangled name in
+        // another translation unit
+        bool is_inline = record->isExternallyVisible();
+        auto tu        = ctx.getTranslationUnitDecl();
 
         const ASTRecordLayout& layout = ctx.getASTRecordLayout(record);
 
@@ -447,23 +531,28 @@ struct ast_tools {
         }
 
 
-        auto field_names_var
-            = decl_constexpr_static_cstring_array(loc, "__MP_FIELD_NAMES", field_names, method_ctx);
-        auto field_types_var
-            = decl_constexpr_static_cstring_array(loc, "__MP_FIELD_TYPES", field_types, method_ctx);
-        auto field_offsets_var = decl_constexpr_static_size_array(loc,
-                                                                  "__MP_FIELD_OFFSETS",
-                                                                  field_offsets,
-                                                                  method_ctx);
-        auto field_sizes_var
-            = decl_constexpr_static_size_array(loc, "__MP_FIELD_SIZES", field_sizes, method_ctx);
-
-        auto base_types_var
-            = decl_constexpr_static_cstring_array(loc, "__MP_BASE_TYPES", base_names, method_ctx);
-        auto base_sizes_var
-            = decl_constexpr_static_size_array(loc, "__MP_BASE_SIZES", base_sizes, method_ctx);
-        auto base_offsets_var
-            = decl_constexpr_static_size_array(loc, "__MP_BASE_OFFSETS", base_offsets, method_ctx);
+        // The arrays pointed to by the descriptor. Each is given a name
+        // derived from the type, so that it's merged along with it.
+        auto cstring_array = [&](StringRef prefix, std::vector<std::string> const& values) {
+            return decl_constexpr_static_cstring_array(loc,
+                                                       type_data_name(prefix, mangled),
+                                                       values,
+                                                       tu);
+        };
+        auto size_array = [&](StringRef prefix, std::vector<size_t> const& values) {
+            return decl_constexpr_static_size_array(loc,
+                                                    type_data_name(prefix, mangled),
+                                                    values,
+                                                    tu);
+        };
+
+        auto field_names_var   = cstring_array("__MP_FIELD_NAMES", field_names);
+        auto field_types_var   = cstring_array("__MP_FIELD_TYPES", field_types);
+        auto field_offsets_var = size_array("__MP_FIELD_OFFSETS", field_offsets);
+        auto field_sizes_var   = size_array("__MP_FIELD_SIZES", field_sizes);
+        auto base_types_var    = cstring_array("__MP_BASE_TYPES", base_names);
+        auto base_sizes_var    = size_array("__MP_BASE_SIZES", base_sizes);
+        auto base_offsets_var  = size_array("__MP_BASE_OFFSETS", base_offsets);
 
         auto mp_type_data_decl = find_record_decl("_mp_type_data");
         if (!mp_type_data_decl->isCompleteDefinition()) {
@@ -471,9 +560,14 @@ struct ast_tools {
         }
 
         auto mp_type_data_qual_type = ctx.getTypeDeclType(mp_type_data_decl);
-        auto type_data_var
-            = declare_static_var(loc, method_ctx, "__MP_TYPE_DATA", mp_type_data_qual_type);
+        auto type_data_var          = declare_static_var(loc,
+                                                tu,
+                                                type_data_name("__MP_TYPE_DATA", mangled),
+                                                ctx.getConstType(mp_type_data_qual_type));
         type_data_var->setConstexpr(true);
+        if (ctx.getTargetInfo().getTriple().isOSBinFormatELF()) {
+            type_data_var->addAttr(SectionAttr::CreateImplicit(ctx, "mp_types"));
+        }
 
         auto init_expr
             = new (ctx) InitListExpr(ctx,
@@ -497,27 +591,38 @@ struct ast_tools {
 
         type_data_var->setInit(init_expr);
 
-        auto args = array_ref<Expr*>({
-            to_void_ptr(this_expr(loc, type)),
-            builtin_alloca(loc, 40),
-            const_decl_ref(loc, type_data_var),
-        });
+        for (auto* var : {field_names_var,
+                          field_types_var,
+                          field_offsets_var,
+                          field_sizes_var,
+                          base_types_var,
+                          base_sizes_var,
+                          base_offsets_var,
+                          type_data_var}) {
+            publish_global_var(var, is_inline);
+        }
 
+        type_data_vars.emplace(record, type_data_var);
+        return type_data_var;
+    }
 
-        auto call_expr
-            = CallExpr::Create(ctx, func, args, ctx.VoidTy, VK_PRValue, loc, FPOptionsOverride());
+    /// Build a call to the hook, passing it `this`, a small alloca, and the
+    /// type's descriptor (see save_state)
+    auto invoke_hook(Loc            loc,
+                     QualType       type,
+                     FunctionDecl*  hook_decl,
+                     CXXRecordDecl* record,
+                     CXXMethodDecl* method_ctx) -> CallExpr* {
+        // Get a function pointer to the hook
+        auto func = fn_ptr(loc, hook_decl);
 
-        return std::array<Stmt*, 9>{
-            create_decl_stmt(loc, field_names_var),
-            create_decl_stmt(loc, field_types_var),
-            create_decl_stmt(loc, field_sizes_var),
-            create_decl_stmt(loc, field_offsets_var),
-            create_decl_stmt(loc, base_types_var),
-            create_decl_stmt(loc, base_sizes_var),
-            create_decl_stmt(loc, base_offsets_var),
-            create_decl_stmt(loc, type_data_var),
-            call_expr,
-        };
+        auto args = array_ref<Expr*>({
+            to_const_void_ptr(this_expr(loc, method_ctx)),
+            builtin_alloca(loc, 16),
+            const_decl_ref(loc, type_data_var(loc, type, record)),
+        });
+
+        return CallExpr::Create(ctx, func, args, ctx.VoidTy, VK_PRValue, loc, FPOptionsOverride());
     }
 
     auto create_decl_stmt(Loc loc, VarDecl* var_decl) -> DeclStmt* {
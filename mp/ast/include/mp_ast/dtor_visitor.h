@@ -9,20 +9,65 @@
 #include <clang/Frontend/FrontendPluginRegistry.h>
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <clang/Sema/Sema.h>
+#include <llvm/ADT/SetVector.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include <mp_core/colors.h>
 
 #include <mp_ast/ast_tools.h>
+#include <mp_ast/instrument_filter.h>
 #include <mp_error/error.h>
-#include <unordered_set>
 
 namespace mp {
 using namespace clang;
 
+/// Checks if a function body makes any calls, or creates any objects with
+/// non-trivial constructors. Bodies which don't can't allocate.
+struct call_finder : public RecursiveASTVisitor<call_finder> {
+    bool found = false;
+
+    bool VisitCallExpr(CallExpr*) {
+        found = true;
+        return false;
+    }
+
+    bool VisitCXXNewExpr(CXXNewExpr*) {
+        found = true;
+        return false;
+    }
+
+    bool VisitCXXConstructExpr(CXXConstructExpr* expr) {
+        if (expr->getConstructor()->isTrivial()) {
+            return true;
+        }
+        found = true;
+        return false;
+    }
+
+    static bool may_allocate(Stmt* body) {
+        call_finder finder;
+        finder.TraverseStmt(body);
+        return finder.found;
+    }
+};
+
 struct dtor_visitor : public RecursiveASTVisitor<dtor_visitor>, ast_tools {
   public:
-    std::unordered_set<CXXDestructorDecl*> dtors;
+    /// Destructors, in the order they were found, so that the descriptors of
+    /// their types are emitted in the same order on every build
+    llvm::SetVector<CXXDestructorDecl*> dtors;
+    /// Constructors and member functions. Only collected if
+    /// instrument_methods is set
+    llvm::SetVector<CXXMethodDecl*>     methods;
+
+    /// If true, constructors and member functions are instrumented as well as
+    /// destructors, so that allocations can be attributed to an object when
+    /// they're made (see save_member_state). Set by the `instrument-methods`
+    /// rule
+    bool instrument_methods = false;
+
+    /// Only types which pass the filter are instrumented
+    instrument_filter filter;
 
     /// If true, print the names of dtors as they're rewritten
     bool print_dtor_name = false;
@@ -58,6 +103,13 @@ struct dtor_visitor : public RecursiveASTVisitor<dtor_visitor>, ast_tools {
         return true;
     }
 
+    bool VisitCXXMethodDecl(CXXMethodDecl* method) {
+        if (instrument_methods && !isa<CXXDestructorDecl>(method)) {
+            methods.insert(method);
+        }
+        return true;
+    }
+
     void maybe_perform_rewrite(CXXDestructorDecl* dtor) {
         // Skip deleted destructors
         if (dtor->isDeleted()) {
@@ -80,6 +132,10 @@ struct dtor_visitor : public RecursiveASTVisitor<dtor_visitor>, ast_tools {
             return;
         }
 
+        if (!filter.should_instrument(parent, ctx, pol)) {
+            return;
+        }
+
         /// Skip destructors that aren't actually instantiated
         if (dtor->isTemplated() && !dtor->isTemplateInstantiation()) {
             return;
@@ -89,54 +145,98 @@ struct dtor_visitor : public RecursiveASTVisitor<dtor_visitor>, ast_tools {
         bool is_implicit = dtor->isImplicit();
 
         if (has_body || is_implicit) {
-            rewrite_dtor(dtor);
+            rewrite_method(dtor, "save_state");
         }
     }
 
-    void rewrite_dtor(CXXDestructorDecl* dtor) {
+    void maybe_perform_method_rewrite(CXXMethodDecl* method) {
+        // Static methods have no object to attribute allocations to, and
+        // immediate functions never run at all. `this` is passed to the hook
+        // as `void const*`, which can't hold a volatile object.
+        if (method->isDeleted() || method->isStatic() || method->isConsteval()
+            || method->isVolatile()) {
+            return;
+        }
 
-        // Get the class corresponding to this dtor, and the type of that class
-        CXXRecordDecl* record = dtor->getParent();
+        auto parent = method->getParent();
+        if (parent == nullptr || !parent->hasDefinition() || parent->isLambda()) {
+            return;
+        }
+
+        if (!filter.should_instrument(parent, ctx, pol)) {
+            return;
+        }
+
+        /// Skip methods that aren't actually instantiated
+        if (method->isTemplated() && !method->isTemplateInstantiation()) {
+            return;
+        }
+
+        // Only user-written bodies are instrumented. Implicit constructors and
+        // assignment operators only call the ones of the members, which are
+        // instrumented themselves.
+        if (!method->doesThisDeclarationHaveABody() || method->isDefaulted()) {
+            return;
+        }
+
+        // Methods which make no calls (e.g. getters) can't allocate, and
+        // instrumenting them would stop them from being inlined. Methods which
+        // must be inlined can't be instrumented at all.
+        if (method->hasAttr<AlwaysInlineAttr>() || !call_finder::may_allocate(method->getBody())) {
+            return;
+        }
+
+        rewrite_method(method, "save_member_state");
+    }
+
+    /// Inject a call to `hook_name` at the start of the method
+    void rewrite_method(CXXMethodDecl* method, StringRef hook_name) {
+
+        // Get the class corresponding to this method, and the type of that
+        // class
+        CXXRecordDecl* record = method->getParent();
         QualType       type   = ctx.getTypeDeclType(record);
 
         // Find the hook called by the payload
-        FunctionDecl* hook = find_function_decl("save_state");
+        FunctionDecl* hook = find_function_decl(hook_name);
 
         if (hook == nullptr) {
             /// TODO: add proper error handling
-            llvm::outs() << "Unable to find `save_state`\n";
+            llvm::outs() << "Unable to find `" << hook_name << "`\n";
             return;
         }
 
-        // Mark the dtor as not defaulted, since we're adding code for it
-        if (dtor->isDefaulted() || dtor->isExplicitlyDefaulted()) {
-            dtor->setDefaulted(false);
-            dtor->setExplicitlyDefaulted(false);
+        // Mark the method as not defaulted, since we're adding code for it
+        if (method->isDefaulted() || method->isExplicitlyDefaulted()) {
+            method->setDefaulted(false);
+            method->setExplicitlyDefaulted(false);
         }
 
-        auto dtor_start = dtor->getBeginLoc();
-        auto body_start = dtor->getBodyRBrace();
+        auto method_start = method->getBeginLoc();
+        auto body_start   = method->getBodyRBrace();
 
 
-        // Inject the payload into the dtor ast. This payload includes the
-        // call to the hook, as well as the creation of some static variables
-        // which provide information about the class.
-        auto payload = invoke_hook(body_start, type, hook, record, dtor);
+        // Inject the payload into the method's ast. The payload is a call to
+        // the hook. The descriptor of the class it passes to the hook is
+        // declared the first time the class is seen (see type_data_var).
+        Stmt* payload = invoke_hook(body_start, type, hook, record, method);
 
-        if (!dtor->hasBody()) {
-            dtor->setBody(compound_stmt(body_start, payload));
+        if (!method->hasBody()) {
+            method->setBody(compound_stmt(body_start, payload));
         } else {
-            auto OldBody = dtor->getBody();
+            auto OldBody = method->getBody();
             if (CompoundStmt* CS = dyn_cast<CompoundStmt>(OldBody)) {
-                dtor->setBody(prepend(CS, payload));
+                method->setBody(prepend(CS, payload));
             } else {
                 // Body is a single statement, wrap in compound statement with the hook prepended
-                dtor->setBody(join(payload, OldBody));
+                method->setBody(join(payload, OldBody));
             }
         }
 
-        // Mark the destructor as 'noinline', to ensure it isn't inlined
-        dtor->addAttr(NoInlineAttr::Create(ctx, SourceRange(dtor_start)));
+        // Mark the method as 'noinline'. The shadow stack entry pushed by the
+        // hook lives as long as the method's frame, so the method needs a
+        // frame of its own.
+        method->addAttr(NoInlineAttr::Create(ctx, SourceRange(method_start)));
 
         bool print_any = print_dtor_ast || print_dtor_body || print_dtor_name;
 
@@ -147,17 +247,17 @@ struct dtor_visitor : public RecursiveASTVisitor<dtor_visitor>, ast_tools {
                 outs << mp::colors::BW;
                 outs << "Rewrote ";
                 outs << mp::colors::BG;
-                dtor->getNameForDiagnostic(outs, pol, true);
+                method->getNameForDiagnostic(outs, pol, true);
                 outs << mp::colors::Re << " @ " << mp::colors::BC;
-                dtor->getLocation().print(outs, sm);
+                method->getLocation().print(outs, sm);
                 outs << mp::colors::Re << '\n';
             }
             if (print_dtor_body) {
 
-                dtor->print(outs, pol, 0, false);
+                method->print(outs, pol, 0, false);
             }
             if (print_dtor_ast) {
-                dtor->dumpColor();
+                method->dumpColor();
             }
         }
     }
@@ -168,6 +268,12 @@ struct dtor_visitor : public RecursiveASTVisitor<dtor_visitor>, ast_tools {
         }
     }
 
+    void rewrite_methods() {
+        for (auto method : methods) {
+            maybe_perform_method_rewrite(method);
+        }
+    }
+
     /// We want to visit implicitly generated destructors in order to instrument
     /// them
     bool shouldVisitImplicitCode() const { return true; }
@@ -0,0 +1,179 @@
+#include <mp_ast/instrument_filter.h>
+
+#include <clang/Basic/SourceManager.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+namespace mp {
+auto name_pattern::parse(StringRef text, name_pattern& out) -> std::string {
+    out = name_pattern();
+
+    if (text.consume_front("re:")) {
+        auto        regex = llvm::Regex(text);
+        std::string error;
+        if (!regex.isValid(error)) {
+            return "invalid regular expression '" + text.str() + "': " + error;
+        }
+        out.regex_.emplace(std::move(regex));
+        return {};
+    }
+
+    auto glob = llvm::GlobPattern::create(text);
+    if (!glob) {
+        return "invalid pattern '" + text.str() + "': " + llvm::toString(glob.takeError());
+    }
+    out.glob_.emplace(std::move(*glob));
+    return {};
+}
+
+bool name_pattern::matches(StringRef name) const {
+    if (regex_) return regex_->match(name);
+    return glob_ && glob_->match(name);
+}
+
+namespace {
+bool any_match(std::vector<name_pattern> const& patterns, StringRef name) {
+    for (auto const& pattern : patterns) {
+        if (pattern.matches(name)) return true;
+    }
+    return false;
+}
+
+bool any_match(std::vector<name_pattern> const& patterns, std::vector<std::string> const& names) {
+    for (auto const& name : names) {
+        if (any_match(patterns, name)) return true;
+    }
+    return false;
+}
+
+/// Qualified names of the namespaces enclosing `record`, from the outermost to
+/// the innermost (eg, `app` and `app::detail`). Inline namespaces are left out
+/// of both the list and the names, so `std::__cxx11::basic_string` is only in
+/// `std`. Types in the global namespace have a single, empty namespace.
+auto enclosing_namespaces(CXXRecordDecl const* record) -> std::vector<std::string> {
+    llvm::SmallVector<NamespaceDecl const*, 4> chain;
+    auto const* dc = record->getEnclosingNamespaceContext();
+    while (dc != nullptr) {
+        auto const* ns = dyn_cast<NamespaceDecl>(dc);
+        if (ns != nullptr && !ns->isInline()) chain.push_back(ns);
+        dc = dc->getParent();
+    }
+
+    auto names = std::vector<std::string>();
+    auto name  = std::string();
+    for (auto const* ns : llvm::reverse(chain)) {
+        if (!name.empty()) name += "::";
+        name += ns->isAnonymousNamespace() ? "(anonymous namespace)" : ns->getName().str();
+        names.push_back(name);
+    }
+    if (names.empty()) names.emplace_back();
+    return names;
+}
+} // namespace
+
+auto instrument_filter::add_rule(StringRef rule, bool allow_config) -> std::string {
+    rule = rule.trim();
+    if (rule == "main-file-only") {
+        main_file_only = true;
+        return {};
+    }
+    if (rule == "instrument-methods") {
+        instrument_methods = true;
+        return {};
+    }
+
+    auto [key, value] = rule.split('=');
+    if (key == "config") {
+        if (!allow_config) return "config files can't name other config files";
+        return add_config_file(value);
+    }
+
+    std::vector<name_pattern>* patterns = nullptr;
+    if (key == "allow-type") patterns = &types.allow;
+    if (key == "deny-type") patterns = &types.deny;
+    if (key == "allow-namespace") patterns = &namespaces.allow;
+    if (key == "deny-namespace") patterns = &namespaces.deny;
+    if (key == "allow-path") patterns = &paths.allow;
+    if (key == "deny-path") patterns = &paths.deny;
+
+    if (patterns == nullptr || value.empty()) {
+        return "unrecognized rule '" + rule.str() + "'";
+    }
+
+    auto pattern = name_pattern();
+    if (auto error = name_pattern::parse(value, pattern); !error.empty()) {
+        return error;
+    }
+    patterns->push_back(std::move(pattern));
+    return {};
+}
+
+auto instrument_filter::add_config_file(StringRef path) -> std::string {
+    auto buffer = llvm::MemoryBuffer::getFile(path, /* IsText */ true);
+    if (!buffer) {
+        return "unable to read config file '" + path.str() + "': " + buffer.getError().message();
+    }
+
+    StringRef contents = (*buffer)->getBuffer();
+    size_t    line_no  = 0;
+    while (!contents.empty()) {
+        auto [line, rest] = contents.split('\n');
+        contents          = rest;
+        line_no++;
+
+        line = line.trim();
+        if (line.empty() || line.starts_with("#")) continue;
+
+        if (auto error = add_rule(line, false); !error.empty()) {
+            return path.str() + ":" + std::to_string(line_no) + ": " + error;
+        }
+    }
+    return {};
+}
+
+bool instrument_filter::has_allow_rules() const noexcept {
+    return !types.allow.empty() || !namespaces.allow.empty() || !paths.allow.empty();
+}
+
+bool instrument_filter::empty() const noexcept {
+    return !main_file_only && !has_allow_rules() && types.deny.empty()
+        && namespaces.deny.empty() && paths.deny.empty();
+}
+
+bool instrument_filter::decide(CXXRecordDecl const*  record,
+                               ASTContext&           ctx,
+                               PrintingPolicy const& pol) const {
+    auto& sm  = ctx.getSourceManager();
+    auto  loc = sm.getFileLoc(record->getLocation());
+    if (main_file_only && !sm.isInMainFile(loc)) {
+        return false;
+    }
+
+    std::string type_name = ctx.getTypeDeclType(record).getAsString(pol);
+
+    auto namespace_names = enclosing_namespaces(record);
+
+    StringRef path = sm.getFilename(loc);
+
+    if (any_match(types.deny, type_name) || any_match(namespaces.deny, namespace_names)
+        || any_match(paths.deny, path)) {
+        return false;
+    }
+
+    return !has_allow_rules() || any_match(types.allow, type_name)
+        || any_match(namespaces.allow, namespace_names) || any_match(paths.allow, path);
+}
+
+bool instrument_filter::should_instrument(CXXRecordDecl const*  record,
+                                          ASTContext&           ctx,
+                                          PrintingPolicy const& pol) {
+    if (empty()) return true;
+
+    auto [it, inserted] = decisions.try_emplace(record, false);
+    if (inserted) {
+        it->second = decide(record, ctx, pol);
+    }
+    return it->second;
+}
+} // namespace mp
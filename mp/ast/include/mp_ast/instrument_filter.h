@@ -0,0 +1,102 @@
+#pragma once
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/DeclCXX.h>
+#include <llvm/Support/GlobPattern.h>
+#include <llvm/Support/Regex.h>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mp {
+using namespace clang;
+
+/// A glob matched against the whole name (eg, `std::*`), or a regular
+/// expression, if it's written with a `re:` prefix (eg, `re:^mylib::.*Node$`).
+/// Regular expressions match anywhere in the name, unless they're anchored.
+class name_pattern {
+    std::optional<llvm::GlobPattern> glob_;
+    std::optional<llvm::Regex>       regex_;
+
+  public:
+    /// Parse a pattern into `out`. Returns an error message, or an empty
+    /// string on success
+    static auto parse(StringRef text, name_pattern& out) -> std::string;
+
+    bool matches(StringRef name) const;
+};
+
+/// Decides which types the plugin instruments. Destructors and methods are
+/// only rewritten if their class passes the filter, so that everything else
+/// (eg, the standard library) keeps being inlined.
+///
+/// Types are matched by their qualified name (as it appears in reports), by
+/// the qualified names of the namespaces enclosing them, and by the path of
+/// the file they're defined in. A namespace pattern matches a type in that
+/// namespace, or nested anywhere inside it. Inline namespaces are skipped, so
+/// `deny-namespace=std` also covers `std::__cxx11::basic_string`. Then:
+///
+/// - A type matching any `deny-*` pattern isn't instrumented.
+/// - If there are any `allow-*` patterns, a type must match at least one of
+///   them.
+/// - With `main-file-only`, only types defined in the main file of the
+///   translation unit are instrumented.
+///
+/// Rules are given as plugin arguments
+/// (`-fplugin-arg-mp_instrument_dtors-<rule>`), or in a config file with one
+/// rule per line. Lines starting with `#` are comments, and config files can't
+/// name other config files. The rules are:
+///
+/// ```
+/// allow-type=<pattern>       deny-type=<pattern>
+/// allow-namespace=<pattern>  deny-namespace=<pattern>
+/// allow-path=<pattern>       deny-path=<pattern>
+/// main-file-only
+/// instrument-methods
+/// config=<path>
+/// ```
+///
+/// `instrument-methods` doesn't filter anything. It instruments the
+/// constructors and member functions of the types which pass the filter, as
+/// well as their destructors (see save_member_state).
+class instrument_filter {
+    struct rule_set {
+        std::vector<name_pattern> allow;
+        std::vector<name_pattern> deny;
+    };
+
+    rule_set types;
+    rule_set namespaces;
+    rule_set paths;
+    bool     main_file_only     = false;
+    bool     instrument_methods = false;
+
+    /// Decision made for each type so far
+    std::unordered_map<CXXRecordDecl const*, bool> decisions;
+
+    bool has_allow_rules() const noexcept;
+
+    bool decide(CXXRecordDecl const* record, ASTContext& ctx, PrintingPolicy const& pol) const;
+
+  public:
+    /// Add a single rule. `config=` rules are rejected unless `allow_config`
+    /// is set. Returns an error message, or an empty string on success
+    auto add_rule(StringRef rule, bool allow_config = true) -> std::string;
+
+    /// Add every rule in a config file. Returns an error message, or an empty
+    /// string on success
+    auto add_config_file(StringRef path) -> std::string;
+
+    /// True if every type passes the filter
+    bool empty() const noexcept;
+
+    /// True if constructors and member functions are instrumented, as well as
+    /// destructors
+    bool instruments_methods() const noexcept { return instrument_methods; }
+
+    /// Check if the given class should be instrumented. `pol` is used to print
+    /// its name, so it should be the policy used to name types in reports
+    bool should_instrument(CXXRecordDecl const* record, ASTContext& ctx, PrintingPolicy const& pol);
+};
+} // namespace mp
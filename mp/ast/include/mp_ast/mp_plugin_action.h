@@ -1,30 +1,48 @@
 #pragma once
 
 #include <mp_ast/ast_consumer.h>
+#include <mp_ast/instrument_filter.h>
 
 #include <clang/Frontend/FrontendPluginRegistry.h>
+#include <cstdlib>
+
 namespace mp {
 using namespace clang;
 
 class mp_plugin_action : public PluginASTAction {
+    /// Types to instrument, built from the plugin's arguments (see
+    /// instrument_filter)
+    instrument_filter filter;
+
   protected:
     std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance& CI,
                                                    llvm::StringRef) override {
-        return std::make_unique<ast_consumer>(CI);
+        return std::make_unique<ast_consumer>(CI, std::move(filter));
     }
 
     bool ParseArgs(const CompilerInstance&         CI,
                    const std::vector<std::string>& args) override {
-        DiagnosticsEngine& D = CI.getDiagnostics();
+        DiagnosticsEngine& D      = CI.getDiagnostics();
+        unsigned           DiagID = D.getCustomDiagID(DiagnosticsEngine::Error,
+                                                      "mp_instrument_dtors: %0");
+
+        bool ok     = true;
+        auto report = [&](std::string const& error) {
+            if (error.empty()) return;
+            D.Report(DiagID) << error;
+            ok = false;
+        };
+
+        // Rules in the config file named by the environment come first, so
+        // that builds which can't pass plugin arguments can still filter
+        if (char const* config = std::getenv("MEM_PROFILE_FILTER_CONFIG")) {
+            if (*config != '\0') report(filter.add_config_file(config));
+        }
         for (auto const& arg : args) {
-            unsigned DiagID =
-                D.getCustomDiagID(DiagnosticsEngine::Error,
-                                  "invalid argument '%0' - this plugin "
-                                  "does not take any arguments");
-            D.Report(DiagID) << arg;
+            report(filter.add_rule(arg));
         }
 
-        return args.empty();
+        return ok;
     }
 
     ActionType getActionType() override {
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cstring>
+#include <span>
+#include <string_view>
+
+#include <mp_types/types.h>
+
+/// Binary report format (`.mpb`).
+///
+/// A report is a set of columns, mirroring the structure-of-arrays layout of
+/// `output_record`. Each column is stored in one or more sections:
+///
+/// ```
+/// file_header
+/// section data       (each section begins on an 8-byte boundary)
+/// section table      (file_header::section_count section_entry records)
+/// ```
+///
+/// Columns with one row per event (and per object found on an event's call
+/// stack) are split into blocks of at most `EVENTS_PER_BLOCK` events, so that a
+/// report can be written while streaming events. Every other column is stored
+/// in block 0. Within a block, `EVENT_OBJECT_OFF` holds `count + 1` offsets
+/// into that block's objects, and the id of an event is its position across
+/// all blocks. Events refer to their call stack by its index in the stack
+/// table (`STACK_*`), so each distinct stack is only stored once.
+///
+/// Sections with `encoding::RAW` can be used in place once the file is mapped.
+/// All integers are little-endian.
+namespace mp::mpb {
+constexpr char MAGIC[8] = {'M', 'P', 'R', 'O', 'F', 'B', 'I', 'N'};
+
+/// Incremented whenever the layout changes in a way older readers can't handle
+constexpr u32 VERSION = 3;
+
+/// Maximum number of events in each block of event columns
+constexpr size_t EVENTS_PER_BLOCK = 65536;
+
+struct file_header {
+    char magic[8];
+    u32  version;
+    u32  reserved;
+    /// Offset of the section table
+    u64  section_table;
+    /// Number of entries in the section table
+    u64  section_count;
+};
+static_assert(sizeof(file_header) == 32);
+
+enum class encoding : u32 {
+    /// Fixed-width little-endian values, `width` bytes each
+    RAW,
+    /// Unsigned LEB128 varints
+    VARINT,
+    /// Each value is stored as the zigzag-encoded difference from the previous
+    /// value (starting from 0), as an unsigned LEB128 varint. Used for sorted
+    /// columns, and for addresses, which tend to be close to their neighbours.
+    DELTA_VARINT,
+};
+
+enum class column : u32 {
+    FRAME_PC = 0x100,
+    FRAME_OBJECT_PATH,
+    FRAME_OBJECT_ADDRESS,
+    FRAME_OBJECT_SYMBOL,
+    FRAME_OFFSETS,
+    FRAME_FILE,
+    FRAME_FUNC,
+    FRAME_LINE,
+    FRAME_COLUMN,
+    FRAME_IS_INLINE,
+
+    TYPE_SIZE = 0x200,
+    TYPE_TYPE,
+    TYPE_FIELD_OFF,
+    TYPE_FIELD_NAMES,
+    TYPE_FIELD_TYPES,
+    TYPE_FIELD_SIZES,
+    TYPE_FIELD_OFFSETS,
+    TYPE_BASE_OFF,
+    TYPE_BASE_TYPES,
+    TYPE_BASE_SIZES,
+    TYPE_BASE_OFFSETS,
+
+    EVENT_TYPE = 0x300,
+    EVENT_ALLOC_SIZE,
+    EVENT_ALLOC_ADDR,
+    EVENT_ALLOC_HINT,
+    EVENT_WEIGHT,
+    EVENT_STACK_ID,
+    EVENT_OBJECT_OFF,
+    /// id of the event which made the allocation an event releases. See
+    /// output_event::origin_id
+    EVENT_ORIGIN_ID,
+
+    OBJECT_TRACE_INDEX = 0x400,
+    OBJECT_ID,
+    OBJECT_ADDR,
+    OBJECT_TYPE_DATA,
+
+    CALL_GRAPH_PARENT = 0x500,
+    CALL_GRAPH_PC_ID,
+    CALL_GRAPH_NUM_BYTES,
+    CALL_GRAPH_NUM_ALLOCS,
+
+    /// `count + 1` u64 offsets into STRTAB_DATA. String i spans
+    /// `offsets[i]..offsets[i + 1]`
+    STRTAB_OFFSETS = 0x600,
+    /// Contents of every string, back to back
+    STRTAB_DATA,
+
+    MODULE_PATH = 0x700,
+    MODULE_BUILD_ID,
+    MODULE_LOAD_BASE,
+    MODULE_BEGIN,
+    MODULE_END,
+
+    /// `count + 1` offsets into STACK_PCS. Stack i spans
+    /// `offsets[i]..offsets[i + 1]`
+    STACK_OFFSETS = 0x800,
+    /// Program counter ids of every stack, innermost call first
+    STACK_PCS,
+
+    /// Single values: see output_peak
+    PEAK_MAX_BYTES = 0x900,
+    PEAK_NUM_BYTES,
+    PEAK_NUM_ALLOCS,
+    PEAK_TYPE_DATA,
+    PEAK_TYPE_BYTES,
+    PEAK_TYPE_ALLOCS,
+};
+
+struct section_entry {
+    column   col;
+    u32      block;
+    encoding enc;
+    /// Width of each value, in bytes. Only meaningful for RAW sections
+    u32      width;
+    /// Offset of the section, from the start of the file
+    u64      offset;
+    /// Size of the section, in bytes
+    u64      size;
+    /// Number of values in the section
+    u64      count;
+};
+static_assert(sizeof(section_entry) == 40);
+
+
+constexpr u64 zigzag(i64 value) noexcept { return (u64(value) << 1) ^ u64(value >> 63); }
+constexpr i64 unzigzag(u64 value) noexcept { return i64(value >> 1) ^ -i64(value & 1); }
+
+/// Maximum size of an encoded varint
+constexpr size_t MAX_VARINT_SIZE = 10;
+
+/// Encode `value` as an unsigned LEB128 varint. Returns the end of the encoding
+inline u8* encode_varint(u64 value, u8* out) noexcept {
+    while (value >= 0x80) {
+        *out++ = u8(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = u8(value);
+    return out;
+}
+
+/// Decodes the values of a VARINT or DELTA_VARINT section, one at a time
+class varint_reader {
+    u8 const* pos_;
+    u8 const* end_;
+    bool      delta_;
+    u64       prev_ = 0;
+
+  public:
+    varint_reader(std::span<u8 const> bytes, encoding enc) noexcept
+      : pos_(bytes.data())
+      , end_(bytes.data() + bytes.size())
+      , delta_(enc == encoding::DELTA_VARINT) {}
+
+    bool done() const noexcept { return pos_ == end_; }
+
+    /// Decode the next value. Must not be called once done() is true
+    u64 next() noexcept {
+        u64 value = 0;
+        for (u32 shift = 0; pos_ != end_; shift += 7) {
+            u8 byte = *pos_++;
+            value |= u64(byte & 0x7f) << shift;
+            if (byte < 0x80) break;
+        }
+        if (delta_) {
+            prev_ += u64(unzigzag(value));
+            return prev_;
+        }
+        return value;
+    }
+};
+
+
+/// Read-only view of a binary report held in memory, eg a mapped file
+class report_view {
+    u8 const*                      data_ = nullptr;
+    size_t                         size_ = 0;
+    std::span<section_entry const> sections_;
+
+  public:
+    /// Returns false if `data` doesn't hold a report of a supported version
+    bool open(void const* data, size_t size) noexcept {
+        file_header header;
+        if (size < sizeof(header)) return false;
+        std::memcpy(&header, data, sizeof(header));
+
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) return false;
+        if (header.version != VERSION) return false;
+
+        u64 table_size = header.section_count * sizeof(section_entry);
+        if (header.section_table > size || table_size > size - header.section_table) {
+            return false;
+        }
+
+        data_     = (u8 const*)data;
+        size_     = size;
+        sections_ = {(section_entry const*)(data_ + header.section_table), header.section_count};
+        for (auto const& s : sections_) {
+            if (s.offset > size || s.size > size - s.offset) return false;
+        }
+        return true;
+    }
+
+    std::span<section_entry const> sections() const noexcept { return sections_; }
+
+    /// Find the section holding the given block of a column. Returns null if
+    /// there is no such section.
+    section_entry const* find(column col, u32 block = 0) const noexcept {
+        for (auto const& s : sections_) {
+            if (s.col == col && s.block == block) return &s;
+        }
+        return nullptr;
+    }
+
+    std::span<u8 const> bytes(section_entry const& s) const noexcept {
+        return {data_ + s.offset, size_t(s.size)};
+    }
+
+    /// Get the values of a RAW section in place
+    template <class T>
+    std::span<T const> raw(section_entry const& s) const noexcept {
+        if (s.enc != encoding::RAW || s.width != sizeof(T)) return {};
+        return {(T const*)(data_ + s.offset), size_t(s.count)};
+    }
+
+    /// Decode every value of a section, calling `func(u64)` on each. RAW
+    /// sections must have a width of at most 8 bytes.
+    template <class F>
+    void for_each_value(section_entry const& s, F&& func) const {
+        if (s.enc == encoding::RAW) {
+            u8 const* p = data_ + s.offset;
+            for (u64 i = 0; i < s.count; i++, p += s.width) {
+                u64 value = 0;
+                std::memcpy(&value, p, s.width);
+                func(value);
+            }
+            return;
+        }
+        auto reader = varint_reader(bytes(s), s.enc);
+        while (!reader.done()) {
+            func(reader.next());
+        }
+    }
+
+    /// Get the i-th entry of the string table
+    std::string_view string(size_t i) const noexcept {
+        auto const* offsets = find(column::STRTAB_OFFSETS);
+        auto const* data    = find(column::STRTAB_DATA);
+        if (offsets == nullptr || data == nullptr || i + 1 >= offsets->count) return {};
+
+        auto off = raw<u64>(*offsets);
+        return {(char const*)(data_ + data->offset + off[i]), size_t(off[i + 1] - off[i])};
+    }
+};
+} // namespace mp::mpb
@@ -0,0 +1,83 @@
+#include <mp_format/mpb_writer.h>
+
+#include <cerrno>
+#include <mp_error/error.h>
+
+namespace mp::mpb {
+writer::writer(char const* filename) : file_(std::fopen(filename, "wb")) {
+    if (file_ == nullptr) {
+        throw ERR("Unable to open '{}' for writing. {}", filename, c_errcode{errno});
+    }
+
+    // The header is filled in once the location of the section table is known
+    file_header header{};
+    write_bytes(&header, sizeof(header));
+}
+
+writer::~writer() {
+    if (file_) std::fclose(file_);
+}
+
+void writer::close() {
+    file_header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version       = VERSION;
+    header.section_table = offset_;
+    header.section_count = sections_.size();
+
+    write_bytes(sections_.data(), sections_.size() * sizeof(section_entry));
+
+    if (std::fseek(file_, 0, SEEK_SET) != 0) {
+        throw ERR("Error when writing binary report header. {}", c_errcode{errno});
+    }
+    write_bytes(&header, sizeof(header));
+
+    std::FILE* file = file_;
+    file_           = nullptr;
+    if (std::fclose(file) != 0) {
+        throw ERR("Error when closing binary report. {}", c_errcode{errno});
+    }
+}
+
+void writer::write_strtab(std::span<std::string_view const> strtab) {
+    std::vector<u64> offsets(strtab.size() + 1);
+    for (size_t i = 0; i < strtab.size(); i++) {
+        offsets[i + 1] = offsets[i] + strtab[i].size();
+    }
+    write_column(column::STRTAB_OFFSETS, 0, encoding::RAW, offsets);
+
+    // Strings are written directly, rather than being copied into one buffer
+    auto entry = section_entry{column::STRTAB_DATA, 0, encoding::RAW, 1, offset_, 0, 0};
+    for (auto str : strtab) {
+        write_bytes(str.data(), str.size());
+    }
+    entry.size  = offset_ - entry.offset;
+    entry.count = entry.size;
+    sections_.push_back(entry);
+    pad();
+}
+
+void writer::write_section(column              col,
+                           u32                 block,
+                           encoding            enc,
+                           u32                 width,
+                           u64                 count,
+                           std::span<u8 const> bytes) {
+    sections_.push_back(section_entry{col, block, enc, width, offset_, bytes.size(), count});
+    write_bytes(bytes.data(), bytes.size());
+    pad();
+}
+
+void writer::pad() {
+    constexpr char zeros[8]{};
+    write_bytes(zeros, (8 - offset_ % 8) % 8);
+}
+
+void writer::write_bytes(void const* data, size_t size) {
+    if (size == 0) return;
+    if (std::fwrite(data, 1, size, file_) != size) {
+        throw ERR("Error when writing binary report. {}", c_errcode{errno});
+    }
+    offset_ += size;
+}
+} // namespace mp::mpb
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdio>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <mp_format/mpb.h>
+#include <mp_types/types.h>
+
+namespace mp::mpb {
+/// Writes a binary report, one section at a time.
+///
+/// Sections may be written in any order. The section table is written, and
+/// the header filled in, by close(). Errors are reported by throwing.
+class writer {
+    std::FILE*                 file_   = nullptr;
+    u64                        offset_ = 0;
+    std::vector<section_entry> sections_;
+
+    /// Holds the encoding of the section being written
+    std::vector<u8> scratch_;
+
+  public:
+    /// Open the given file for writing
+    explicit writer(char const* filename);
+    writer(writer const&) = delete;
+
+    /// Closes the file if close() was not called. The report is left
+    /// incomplete.
+    ~writer();
+
+    /// Write the section table and the header, then close the file
+    void close();
+
+    /// Write a column of integers (or floats, if `enc` is RAW)
+    template <class T>
+        requires std::is_arithmetic_v<T>
+    void write_column(column col, u32 block, encoding enc, std::span<T const> values) {
+        if (enc == encoding::RAW) {
+            auto bytes = std::span<u8 const>((u8 const*)values.data(), values.size_bytes());
+            write_section(col, block, enc, sizeof(T), values.size(), bytes);
+            return;
+        }
+
+        scratch_.resize(values.size() * MAX_VARINT_SIZE);
+        u8* out  = scratch_.data();
+        u64 prev = 0;
+        for (T value : values) {
+            if (enc == encoding::DELTA_VARINT) {
+                out  = encode_varint(zigzag(i64(u64(value) - prev)), out);
+                prev = u64(value);
+            } else {
+                out = encode_varint(u64(value), out);
+            }
+        }
+        auto bytes = std::span<u8 const>(scratch_.data(), out);
+        write_section(col, block, enc, 0, values.size(), bytes);
+    }
+
+    template <class T>
+    void write_column(column col, u32 block, encoding enc, std::vector<T> const& values) {
+        write_column(col, block, enc, std::span<T const>(values));
+    }
+
+    /// Write the string table, as the STRTAB_OFFSETS and STRTAB_DATA columns
+    void write_strtab(std::span<std::string_view const> strtab);
+
+  private:
+    void write_section(column              col,
+                       u32                 block,
+                       encoding            enc,
+                       u32                 width,
+                       u64                 count,
+                       std::span<u8 const> bytes);
+
+    /// Pad the file to an 8-byte boundary, so that RAW sections can be used
+    /// in place
+    void pad();
+
+    void write_bytes(void const* data, size_t size);
+};
+} // namespace mp::mpb
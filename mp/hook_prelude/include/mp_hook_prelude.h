@@ -1,7 +1,9 @@
 #ifndef MP_HOOK_PRELUDE_H
 #define MP_HOOK_PRELUDE_H
 
-#include <atomic>
+// Included into every instrumented translation unit, so it doesn't include any
+// headers (<atomic> alone made compiling the examples noticeably slower).
+// Atomics use the __atomic builtins instead.
 
 struct _mp_type_data {
     using size_t = __SIZE_TYPE__;
@@ -23,54 +25,190 @@ struct _mp_type_data {
 };
 
 namespace mp {
-using size_t       = __SIZE_TYPE__;
-using ull_t        = unsigned long long;
-using atomic_ull_t = ::std::atomic_ullong;
+using size_t = __SIZE_TYPE__;
+using ull_t  = unsigned long long;
+
+/// Hands out blocks of event ids to each thread. Holds the first id which
+/// hasn't been handed out yet. Ids start at 1, so that 0 never names an event.
+/// Only accessed atomically.
+inline ull_t _mp_event_counter = 1;
+
+/// Number of ids a thread takes from _mp_event_counter at a time
+constexpr ull_t _mp_event_block_size = 4096;
+
+/// Block of event ids owned by the current thread. Ids in [next, end) are
+/// still available.
+struct _mp_event_block {
+    ull_t next;
+    ull_t end;
+};
+inline thread_local _mp_event_block _mp_local_event_block = {0, 0};
+
+/// Get a unique event id. Threads take ids from _mp_event_counter in blocks,
+/// so the shared counter is only touched once every _mp_event_block_size
+/// events. Ids are unique and nonzero, but they're not ordered across threads.
+[[gnu::always_inline]] inline ull_t _mp_next_event_id() {
+    auto& block = _mp_local_event_block;
+    if (__builtin_expect(block.next == block.end, 0)) {
+        block.next = __atomic_fetch_add(&_mp_event_counter, _mp_event_block_size, __ATOMIC_RELAXED);
+        block.end  = block.next + _mp_event_block_size;
+    }
+    return block.next++;
+}
 
-constexpr ull_t     _mp_frame_tag     = 0xeeb36e726e3ffec1ull;
-inline atomic_ull_t _mp_event_counter = 0;
 
+/// An object whose destructor is running on the current thread, or (if the
+/// plugin instruments them) one of its constructors or member functions
+struct _mp_shadow_entry {
+    void const*          this_ptr;
+    _mp_type_data const* type_data;
+    /// Id of the destruction event. 0 unless `destroying` is set
+    ull_t                event_id;
+    /// Frame address of the function, which orders the entries, and its
+    /// return address. The function is still running for as long as its
+    /// return address is on the call stack.
+    ull_t                frame;
+    ull_t                return_address;
+    /// true if the entry was pushed by a destructor
+    bool                 destroying;
+};
 
-[[gnu::always_inline]] inline ull_t _mix(ull_t x, ull_t y) {
-    auto tmp = __uint128_t(x) * 1664525ull + y;
-    return ull_t(tmp) ^ ull_t(tmp >> 64);
-}
+/// Objects whose destructors (or instrumented constructors and member
+/// functions) are running on the current thread, from the outermost to the
+/// innermost, as pushed by save_state and save_member_state.
+///
+/// Nothing is popped when a function returns. Instead, each push discards any
+/// entries at or below its own frame (which must belong to functions that have
+/// returned), and readers skip entries whose return address isn't found when
+/// the stack is unwound (see mp_extract_events). If the stack is full, the
+/// outermost object is dropped.
+struct _mp_shadow_stack {
+    constexpr static size_t capacity = 32;
+
+    size_t           size;
+    _mp_shadow_entry entries[capacity];
+};
+} // namespace mp
 
-inline ull_t _mix4(ull_t t0, ull_t t1, ull_t t2, ull_t t3) {
-    return _mix(_mix(_mix(t3, t2), t1), t0);
-}
-inline bool check_frame(ull_t const* _start) {
-    return _mix4(_start[0], _start[1], _start[2], _start[3]) == _start[4];
+/// Defined by the runtime, if it's loaded. Returns the current thread's shadow
+/// stack, which the runtime owns. Every instrumented module pushes onto the
+/// same stack, and the stack doesn't go away if a module is unloaded.
+extern "C" [[gnu::weak]] mp::_mp_shadow_stack* _mp_get_shadow_stack();
+
+namespace mp {
+/// Pushed onto instead when the runtime isn't loaded. Nothing reads it.
+inline thread_local _mp_shadow_stack _mp_local_shadow_stack = {};
+
+/// The current thread's shadow stack, once it's been looked up
+inline thread_local _mp_shadow_stack* _mp_current_shadow_stack = nullptr;
+
+[[gnu::noinline]] inline _mp_shadow_stack* _mp_find_shadow_stack() {
+    auto* stack = _mp_get_shadow_stack != nullptr ? _mp_get_shadow_stack() : nullptr;
+    if (stack == nullptr) {
+        stack = &_mp_local_shadow_stack;
+    }
+    _mp_current_shadow_stack = stack;
+    return stack;
 }
+} // namespace mp
 
-struct _mp_frame_information {
-    /* [0] */ ull_t tag;
-    /* [1] */ ull_t call_count;
-    /* [2] */ alignas(ull_t) void* this_ptr;
-    /* [3] */ alignas(ull_t) _mp_type_data const* type_data;
-    /* [4] */ ull_t checksum;
-};
+/// Defined by the runtime, if it's loaded. Hands it the descriptors of every
+/// type instrumented in a module, so that it can give each type a dense id.
+extern "C" [[gnu::weak]] void _mp_register_types(_mp_type_data const* begin,
+                                                 _mp_type_data const* end);
 
-} // namespace mp
+#if defined(__ELF__)
+/// Bounds of the current module's `mp_types` section, where the plugin places
+/// the descriptor of every type it instruments. Defined by the linker if the
+/// module has any. They're hidden, so each module finds its own section.
+extern "C" [[gnu::weak, gnu::visibility("hidden")]] _mp_type_data const __start_mp_types[];
+extern "C" [[gnu::weak, gnu::visibility("hidden")]] _mp_type_data const __stop_mp_types[];
 
+namespace mp {
+[[gnu::visibility("hidden")]] inline bool _mp_register_local_types() noexcept {
+    if (_mp_register_types != nullptr && __start_mp_types != nullptr) {
+        _mp_register_types(__start_mp_types, __stop_mp_types);
+    }
+    return true;
+}
+
+/// Registers the module's types as it's loaded, before any of them can be
+/// used. Every module has its own copy, since it's hidden.
+[[gnu::visibility("hidden")]] inline bool const _mp_local_types_registered
+    = _mp_register_local_types();
+} // namespace mp
+#endif
 
 
-[[gnu::always_inline]]
-inline void save_state(void* this_ptr, void* alloca_block, _mp_type_data const& type_data) {
 
-    static_assert(sizeof(mp::_mp_frame_information) <= 40);
-    auto count  = ::mp::_mp_event_counter++;
-    auto result = mp::_mp_frame_information{
-        mp::_mp_frame_tag,
-        count,
+namespace mp {
+/// Push `this_ptr` onto the current thread's shadow stack. Always inlined, so
+/// that the frame and return address are those of the instrumented function.
+[[gnu::always_inline]] inline void _mp_push_shadow_entry(void const*          this_ptr,
+                                                         void*                anchor,
+                                                         _mp_type_data const& type_data,
+                                                         bool                 destroying) {
+    auto* current = _mp_current_shadow_stack;
+    if (__builtin_expect(current == nullptr, 0)) {
+        current = _mp_find_shadow_stack();
+    }
+    auto& stack = *current;
+
+    auto frame = ull_t(__builtin_frame_address(0));
+
+    // Entries at or below this frame were pushed by functions which have
+    // since returned
+    auto size = stack.size;
+    while (size > 0 && stack.entries[size - 1].frame <= frame) {
+        size--;
+    }
+    if (size == stack.capacity) {
+        __builtin_memmove(stack.entries,
+                          stack.entries + 1,
+                          (stack.capacity - 1) * sizeof(_mp_shadow_entry));
+        size--;
+    }
+
+    stack.entries[size] = _mp_shadow_entry{
         this_ptr,
         &type_data,
-        ::mp::_mix4(mp::_mp_frame_tag,
-                    count,
-                    mp::ull_t(this_ptr),
-                    mp::ull_t(&type_data)),
+        destroying ? _mp_next_event_id() : 0,
+        frame,
+        ull_t(__builtin_return_address(0)),
+        destroying,
     };
-    __builtin_memcpy(alloca_block, &result, sizeof(result));
-    asm volatile("" : : "r"(alloca_block) : "memory");
+    stack.size = size + 1;
+
+    // The anchor is allocated by the instrumented function (see save_state).
+    // Escaping it keeps the compiler from turning its last call into a tail
+    // call.
+    __asm__ volatile("" : : "r"(anchor) : "memory");
+}
+} // namespace mp
+
+/// Called at the start of every instrumented destructor. Pushes the object
+/// being destroyed onto the current thread's shadow stack, so that
+/// allocations freed while it's destroyed can be attributed to it.
+///
+/// The destructor must not be inlined, since its frame decides how long the
+/// entry lasts. The entry then covers the destructors of its members and
+/// bases, which run after the body but within the same frame. `anchor` is a
+/// small alloca made by the destructor, which stops it from tail-calling the
+/// destructor of its last member (that would pop the frame while the object is
+/// still being destroyed).
+[[gnu::always_inline]]
+inline void save_state(void const* this_ptr, void* anchor, _mp_type_data const& type_data) {
+    mp::_mp_push_shadow_entry(this_ptr, anchor, type_data, true);
+}
+
+/// Called at the start of constructors and member functions, if the plugin
+/// instruments them (see the `instrument-methods` rule). Allocations made
+/// while the function runs are then attributed to the object. `this_ptr` is
+/// const, so that const member functions can pass `this`. The same rules
+/// apply as for save_state.
+[[gnu::always_inline]]
+inline void
+save_member_state(void const* this_ptr, void* anchor, _mp_type_data const& type_data) {
+    mp::_mp_push_shadow_entry(this_ptr, anchor, type_data, false);
 }
 #endif
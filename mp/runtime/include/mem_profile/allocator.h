@@ -7,6 +7,7 @@
 #include <limits>
 #include <mem_profile/alloc.h>
 #include <mem_profile/prelude.h>
+#include <string>
 #include <type_traits>
 #include <vector>
 
@@ -18,6 +19,12 @@ struct allocator {
     using difference_type                        = ptrdiff_t;
     using propagate_on_container_move_assignment = std::true_type;
 
+    constexpr allocator() noexcept = default;
+
+    /// Allows rebinding, eg, when a container allocates internal nodes
+    template <class U>
+    constexpr allocator(allocator<U> const&) noexcept {}
+
     static void* _alloc(size_t n) {
         /// check if we need to use aligned storage
         if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
@@ -59,4 +66,6 @@ struct allocator {
 
 template <class T>
 using _vec = std::vector<T, mp::allocator<T>>;
+
+using _string = std::basic_string<char, std::char_traits<char>, mp::allocator<char>>;
 } // namespace mp
@@ -1,22 +1,44 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <climits> // Needed for CHAR_BIT
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <mutex>   // Needed for global_context
-#include <unordered_map>
+#include <pthread.h>
+#include <span>
+#include <thread>
 #include <utility> // Needed for std::hash
 #include <vector>
 
 #include <mem_profile/prelude.h>
 #include <mem_profile/alloc.h>
 #include <mem_profile/allocator.h>
+#include <mem_profile/dump_trigger.h>
+#include <mem_profile/event_ring.h>
+#include <mem_profile/live_table.h>
+#include <mem_profile/module_map.h>
+#include <mem_profile/sampler.h>
+#include <mem_profile/spool.h>
+#include <mem_profile/stable_vector.h>
+#include <mem_profile/stack_trie.h>
+#include <mem_profile/thread_registry.h>
 #include <mp_types/types.h>
 #include <mp_unwind/mp_unwind.h>
 
 
 namespace mp {
+template <class T>
+struct view : std::span<T const> {
+    using std::span<T const>::span;
+};
+
+template <class Range>
+view(Range const&)->view<typename Range::value_type>;
+
 /// Increments a counter on construction, decrements it on destruction
 /// Used to locally disable allocation recording (we don't want to record an
 /// allocation inside an allocation, as that can result in an infinite loop)
@@ -85,172 +107,253 @@ struct trace_view {
 
     addr_t const* data() const noexcept { return data_; }
     size_t        size() const noexcept { return count; }
-
-    _vec<addr_t> vec() const { return _vec<addr_t>(data_, data_ + count); }
 };
 
-/// Represents a call graph annotated with allocation counts
-struct call_graph : private alloc_count {
+/// Calling-context tree annotated with allocation counts. Used in aggregate
+/// mode, where allocations are counted in place rather than recorded as events.
+///
+/// Each node is a distinct call path (see stack_trie), and counts the
+/// allocations made with exactly that call stack. Inclusive counts for a path
+/// are the sum of the counts over its subtree. The size of the tree is bounded
+/// by the number of distinct call paths, rather than the number of allocations.
+///
+/// Counts are kept in a stable_vector alongside the paths, so another thread
+/// may read the tree while its owner is still recording. Only the owner writes
+/// a count, but others may read it at any time, so counts are read and
+/// written with relaxed atomics. The two fields of a count are separate, so a
+/// reader may see the bytes of an allocation before its count.
+class call_graph {
+    stack_trie                 paths_;
+    stable_vector<alloc_count> counts_;
+
+    /// Make sure there's a count for every path
+    void sync_counts() {
+        for (size_t i = counts_.size(); i < paths_.size(); i++) {
+            counts_.push_back(alloc_count{});
+        }
+    }
+
+    static u64 load(u64 const& value) noexcept {
+        return std::atomic_ref<u64>(const_cast<u64&>(value)).load(std::memory_order_relaxed);
+    }
+
+    /// Only called by the owner of the count, so it doesn't need to be an
+    /// atomic read-modify-write
+    static void add_to(u64& value, u64 amount) noexcept {
+        std::atomic_ref<u64>(value).store(value + amount, std::memory_order_relaxed);
+    }
+
+    static alloc_count load(alloc_count const& c) noexcept {
+        return alloc_count{load(c.num_bytes), load(c.num_allocs)};
+    }
+
+    static void add_to(alloc_count& c, u64 bytes, u64 allocs) noexcept {
+        add_to(c.num_bytes, bytes);
+        add_to(c.num_allocs, allocs);
+    }
+
   public:
-    call_graph()                  = default;
+    call_graph() { sync_counts(); }
     call_graph(call_graph const&) = delete;
-    call_graph(call_graph&&)      = default;
 
-    using alloc_count::num_allocs;
-    using alloc_count::num_bytes;
-    using alloc_count::record_alloc;
+    /// The call paths in this tree. Node ids are shared with `count()`
+    stack_trie const& paths() const noexcept { return paths_; }
 
-    std::unordered_map<addr_t, call_graph> child_counts;
+    /// Allocations made with exactly the given call path
+    alloc_count count(stack_id_t id) const noexcept {
+        return id < counts_.size() ? load(counts_[id]) : alloc_count{};
+    }
 
-    alloc_count count() const noexcept { return *this; }
+    size_t num_nodes() const noexcept { return paths_.size(); }
 
-    void add(call_graph const& other) {
-        alloc_count::add(other);
+    /// Record an allocation with the given trace. `weight` is the number of
+    /// allocations this one stands for (1 unless sampling is enabled).
+    void record_alloc(addr_t const* trace, size_t count, size_t bytes, float weight) {
+        stack_id_t id = paths_.intern(trace, count);
+        sync_counts();
 
-        for (auto& [addr, graph] : other.child_counts) {
-            child_counts[addr].add(graph);
+        if (weight == 1) {
+            add_to(counts_[id], bytes, 1);
+        } else {
+            add_to(counts_[id], u64(double(bytes) * weight + 0.5), u64(weight + 0.5f));
         }
     }
-    void drain(call_graph& other) {
-        alloc_count::drain(other);
 
-        for (auto& [addr, graph] : other.child_counts) {
-            child_counts[addr].drain(graph);
+    /// Add the given counts to the node for a trace
+    void record(addr_t const* trace, size_t count, alloc_count counts) {
+        stack_id_t id = paths_.intern(trace, count);
+        sync_counts();
+        add_to(counts_[id], counts.num_bytes, counts.num_allocs);
+    }
+
+    /// Add every path and count from `other` to this tree. `other` may still
+    /// be recording on another thread.
+    void add(call_graph const& other) {
+        auto   remap = paths_.merge(other.paths_);
+        size_t count = std::min(remap.size(), other.counts_.size());
+        sync_counts();
+
+        for (size_t i = 0; i < count; i++) {
+            auto c = load(other.counts_[i]);
+            add_to(counts_[remap[i]], c.num_bytes, c.num_allocs);
         }
     }
 
-    /// Gets the callgraph corresponding to the given address. Creates a new
-    /// empty callgraph if none is found.
-    call_graph* get(addr_t key) { return &child_counts[key]; }
+    /// Move every path and count from `other` into this tree, resetting the
+    /// counts in `other`. Nothing else may be recording into `other`.
+    void drain(call_graph& other) {
+        auto   remap = paths_.merge(other.paths_);
+        size_t count = std::min(remap.size(), other.counts_.size());
+        sync_counts();
 
-    size_t num_nodes() const {
-        size_t n = child_counts.size();
-        for (auto& [addr, graph] : child_counts) {
-            n += graph.num_nodes();
+        for (size_t i = 0; i < count; i++) {
+            counts_[remap[i]].drain(other.counts_[i]);
         }
-        return n;
     }
 };
 
 enum class event_type { FREE, ALLOC, REALLOC };
-struct event_record {
-    /// A unique 64-bit stamp that can be used to order events
-    /// chronologically. Also uniquely identifies an event.
-    /// The first event should have an id of 0
-    uint64_t id;
+/// Records the allocations made by a single thread.
+///
+/// Events are encoded into a fixed-size ring buffer, which is continuously
+/// drained into the event spool by the global_context. This keeps the memory
+/// used by the profiler flat, no matter how long the program runs.
+///
+/// Rather than copying the trace of every event, traces are interned into a
+/// per-thread stack_trie, and each event stores only the id of its stack.
+class alloc_counter {
+    alloc_count total_allocs_;
+    u32         thread_;
+    event_ring  events_;
+    stack_trie  stacks_;
+    call_graph  graph_;
 
-    /// Type of the event
-    event_type type;
+    /// Push an encoded event into the ring. If the ring is full, it's drained
+    /// into the spool on the current thread.
+    void push_event(byte_view header, byte_view objects);
 
-    /// Size of allocation (if applicable, 0 for free)
-    size_t      alloc_size = 0;
-    /// Allocated pointer (or pointer passed to free)
-    void const* alloc_ptr  = nullptr;
+  public:
+    alloc_counter(u32 thread, size_t ring_capacity) : thread_(thread), events_(ring_capacity) {}
+    alloc_counter(alloc_counter const&) = delete;
 
-    /// Pointer passed as input (eg to realloc())
-    void const* alloc_hint = nullptr;
+    /// Index of the thread this counter belongs to
+    u32 thread() const noexcept { return thread_; }
 
-    /// Trace of the event
-    _vec<addr_t> trace;
+    /// Ring holding events which haven't been drained into the spool yet
+    event_ring& events() noexcept { return events_; }
 
-    /// Records information about objects taking part in the trace
-    _vec<event_info> object_trace;
-};
+    /// Call stacks of the events recorded by this thread
+    stack_trie const& stacks() const noexcept { return stacks_; }
 
-class alloc_counter {
-    alloc_count        total_allocs_;
-    _vec<event_record> events_;
+    /// Allocations counted by this thread in aggregate mode
+    call_graph& graph() noexcept { return graph_; }
 
-  public:
-    alloc_counter()                     = default;
-    alloc_counter(alloc_counter const&) = delete;
-    alloc_counter(alloc_counter&&)      = default;
 
-    _vec<event_record> const& events() const noexcept { return events_; }
-
-
-    void record_alloc(uint64_t    id,
-                      event_type  type,
-                      size_t      alloc_size,
-                      void const* alloc_ptr,
-                      void const* alloc_hint,
-                      trace_view  trace) {
-        if (type != event_type::FREE) {
-            total_allocs_.record_alloc(alloc_size);
-        }
-        events_.push_back(event_record{id, type, alloc_size, alloc_ptr, alloc_hint, trace.vec()});
+    /// Records an allocation. Returns the id of the call stack in this
+    /// thread's trie, so the allocation can be added to the live table.
+    stack_id_t record_alloc(uint64_t    id,
+                            event_type  type,
+                            size_t      alloc_size,
+                            void const* alloc_ptr,
+                            void const* alloc_hint,
+                            float       weight,
+                            trace_view  trace) {
+        total_allocs_.record_alloc(alloc_size);
+        auto stack_id = stacks_.intern(trace.data(), trace.size());
+        auto header   = spool_event{
+            id,
+            alloc_size,
+            uintptr_t(alloc_ptr),
+            uintptr_t(alloc_hint),
+            u32(type),
+            stack_id,
+            0,
+            weight,
+            0,
+            0,
+            0,
+        };
+        push_event(as_bytes(header), {});
+        return stack_id;
     }
 
 
-    /// Records an allocation and extracts any events discovered on the stack
-    void record_alloc_with_events(uint64_t    id,
-                                  event_type  type,
-                                  size_t      alloc_size,
-                                  void const* alloc_ptr,
-                                  void const* alloc_hint,
-                                  trace_view  trace,
-                                  trace_view  spp) {
-        if (type != event_type::FREE) {
-            total_allocs_.record_alloc(alloc_size);
-        }
+    /// Records a free, and extracts any events discovered on the stack.
+    /// `origin` is the allocation being released, as it was found in the live
+    /// table. Its size becomes the size of the event.
+    void record_free(uint64_t          id,
+                     void const*       alloc_ptr,
+                     float             weight,
+                     live_alloc const& origin,
+                     trace_view        trace) {
         event_info event_buffer[OBJECT_BUFFER_SIZE];
         size_t     event_count
-            = mp_extract_events(OBJECT_BUFFER_SIZE, event_buffer, spp.size(), spp.data());
+            = mp_extract_events(OBJECT_BUFFER_SIZE, event_buffer, trace.size(), trace.data());
+
+        // Objects whose type couldn't be given an id are left out
+        spool_object objects[OBJECT_BUFFER_SIZE];
+        size_t       object_count = 0;
+        for (size_t i = 0; i < event_count; i++) {
+            auto const& e    = event_buffer[i];
+            type_id_t   type = TYPES.id(e.type_data);
+            if (type == 0) continue;
+            objects[object_count++] = spool_object{
+                e.event_id,
+                e.object_ptr,
+                u32(e.trace_index),
+                type,
+            };
+        }
 
-        events_.push_back(event_record{
+        auto header = spool_event{
             id,
-            type,
-            alloc_size,
-            alloc_ptr,
-            alloc_hint,
-            trace.vec(),
-            _vec<event_info>(event_buffer, event_buffer + event_count),
-        });
+            origin.size,
+            uintptr_t(alloc_ptr),
+            0,
+            u32(event_type::FREE),
+            stacks_.intern(trace.data(), trace.size()),
+            u32(object_count),
+            weight,
+            origin.alloc_id,
+            origin.thread,
+            0,
+        };
+        push_event(as_bytes(header), as_bytes(objects, object_count));
     }
 
 
-    void drain(alloc_counter& other) {
-        total_allocs_.drain(other.total_allocs_);
-
-        auto& oe = other.events_;
-        events_.insert(events_.end(),
-                       std::move_iterator(oe.data()),
-                       std::move_iterator(oe.data() + oe.size()));
-        oe.clear();
+    /// Count an allocation and intern its stack, without recording an event.
+    /// Used in peak mode, where allocations are only tracked while they're
+    /// live. Returns the id of the call stack in this thread's trie.
+    stack_id_t record_live(size_t alloc_size, trace_view trace) {
+        total_allocs_.record_alloc(alloc_size);
+        return stacks_.intern(trace.data(), trace.size());
     }
 
 
-    alloc_count total_allocs() const { return total_allocs_; }
+    /// Count an allocation in this thread's call graph, rather than recording
+    /// an event. Used in aggregate mode
+    void record_aggregate(size_t alloc_size, float weight, trace_view trace) {
+        total_allocs_.record_alloc(alloc_size);
+        graph_.record_alloc(trace.data(), trace.size(), alloc_size, weight);
+    }
 
 
-    /// Dump an annotated json representation of the alloc_counter to a file
-    ///
-    /// (Annotated meaning function names are provided and demangled)
-    void dump_json(char const* filename);
+    alloc_count total_allocs() const { return total_allocs_; }
 };
 
 
 /// Keeps track of allocations on a particular thread
 struct local_context {
-    /// Don't record allocations etc if this flag is nonzero
-    /// Used so that the allocation counter's own internal allocations
-    /// aren't recorded It is incremented at the beginning of a scope that
-    /// disables recording, and decremented at the end of that scope
-    size_t        nest_level = 0;
-    alloc_counter counter{};
+    alloc_counter counter;
 
-    local_context() = default;
+    local_context(u32 thread, size_t ring_capacity) : counter(thread, ring_capacity) {}
 
     /// We delete the copy constructor because we don't want to move a
     /// local_context. it records a pointer to itself in the global_context,
     /// and copying it or moving it would invalidate that pointer.
     local_context(local_context const&) = delete;
 
-    /// This function returns a set_guard which will re-enable allocation
-    /// recording at the end of the scope. It must therefore be assigned to
-    /// a local variable, so it's not destructed as a temporary.
-    counter_guard inc_nested() { return counter_guard(nest_level); }
-
     // These are provided so that allocating a new local_context on the heap
     // circumvents the mem_profile tracking machinery, so that we avoid allocating
     // while tracking other allocations
@@ -259,20 +362,222 @@ struct local_context {
 };
 
 
+#if defined(__ELF__)
+/// Thread-locals read by the allocation hooks use the initial-exec TLS model,
+/// so that accessing one is a single load at a fixed offset from the thread
+/// pointer, rather than a call to __tls_get_addr. The runtime is loaded at
+/// startup (by LD_PRELOAD, or by linking it), so it always gets static TLS.
+#define MP_INITIAL_EXEC_TLS [[gnu::tls_model("initial-exec")]]
+#else
+#define MP_INITIAL_EXEC_TLS
+#endif
+
+/// Per-thread state which is read on every call to an allocation hook.
+///
+/// This is a POD with a constant initializer, so that it can be a constinit
+/// thread_local: accessing it never goes through a TLS wrapper function or an
+/// init guard. The heavyweight local_context is only created once the thread
+/// records its first event.
+struct local_state {
+    /// Don't record allocations etc if this is nonzero. It is incremented at
+    /// the beginning of a scope that disables recording (eg, while an event is
+    /// recorded, so that the profiler's own allocations aren't recorded), and
+    /// decremented at the end of that scope. It's left nonzero once the
+    /// thread's context has been retired.
+    size_t         nest_level;
+    /// Decides which allocations on this thread are sampled
+    byte_sampler   sampler;
+    /// Stamp of the last event recorded on this thread
+    u64            last_stamp;
+    /// Context of this thread. Null until the thread records its first event
+    local_context* context;
+
+    /// This function returns a set_guard which will re-enable allocation
+    /// recording at the end of the scope. It must therefore be assigned to
+    /// a local variable, so it's not destructed as a temporary.
+    counter_guard inc_nested() noexcept { return counter_guard(nest_level); }
+};
+
+
+/// What's kept of threads which have exited, once their local_context has
+/// been freed (see global_context::retire_local_context).
+///
+/// The stacks of every exited thread are merged into a single trie, so call
+/// paths shared between threads are only stored once, and each thread only
+/// keeps a table mapping its stack ids into the shared trie. Events and live
+/// allocations keep referring to stacks by thread and id, so they never need
+/// to be rewritten. Call graphs (in aggregate mode) are merged the same way.
+class retired_threads {
+    stack_trie             stacks_;
+    _vec<_vec<stack_id_t>> remaps_;
+    call_graph             graph_;
+
+  public:
+    /// Move the stacks and call graph recorded by `counter` into the store
+    void retire(alloc_counter& counter) {
+        u32 thread = counter.thread();
+        if (remaps_.size() <= thread) {
+            remaps_.resize(thread + 1);
+        }
+        remaps_[thread] = stacks_.merge(counter.stacks());
+        graph_.drain(counter.graph());
+    }
+
+    /// true if the given thread has been retired
+    bool contains(u32 thread) const noexcept {
+        // A remap always holds at least the root
+        return thread < remaps_.size() && !remaps_[thread].empty();
+    }
+
+    /// Stacks of every retired thread
+    stack_trie const& stacks() const noexcept { return stacks_; }
+
+    /// Maps the stack ids recorded by a retired thread into stacks()
+    view<stack_id_t> remap(u32 thread) const noexcept {
+        return view<stack_id_t>(remaps_[thread].data(), remaps_[thread].size());
+    }
+
+    /// Allocations counted by every retired thread in aggregate mode
+    call_graph const& graph() const noexcept { return graph_; }
+};
+
+
 /// Stores record of reports from individual local_contexts for individual
 /// threads, and generates a report for the entire program on destruction.
-/// local_contexts synchronize with the global_context on their destruction
+///
+/// The global context owns a background thread, which periodically drains the
+/// event ring of every local_context into the event spool.
 struct global_context {
+    /// Must be held to dereference a context in `threads`, or to access
+    /// `retired`. Registering a thread doesn't take it.
     std::mutex context_lock;
 
-    // the global context knows about all existant counters
-    _vec<std::unique_ptr<local_context>> counters;
-
+    /// The context of every running thread. Contexts are freed when their
+    /// thread is retired, and the contexts of threads still running at exit
+    /// are never freed (see ~global_context)
+    thread_registry threads;
+
+    /// Stacks and counts of threads which have exited
+    retired_threads retired;
+
+    /// Key whose destructor retires the context of an exiting thread
+    pthread_key_t exit_key{};
+
+    /// Cleared by generate_report before the final report is written. Threads
+    /// which exit afterwards aren't retired, since the report reads their
+    /// contexts, and the global context may already be destroyed. Guarded by
+    /// context_lock.
+    bool retiring = true;
+
+    /// Guards the spool. Must be held in order to consume from any event ring.
+    std::mutex spool_lock;
+    spool_file spool;
+
+    /// Every module loaded over the lifetime of the program. Snapshots are
+    /// taken at startup, by the drain thread whenever a module is loaded or
+    /// unloaded, before each call to dlclose, and at exit.
+    module_map modules;
+
+    /// Used to wake and stop the drain thread and the timeline thread
+    std::mutex              drain_lock;
+    std::condition_variable drain_cv;
+    bool                    drain_stop = false;
+    std::thread             drain_thread;
+
+    /// Appends snapshots of the live allocations to the timeline file. Only
+    /// runs if mem_profile_interval_ms is set
+    std::thread timeline_thread;
+
+    /// Writes a report whenever one is requested while the program runs. Only
+    /// runs if mem_profile_dump_signal or mem_profile_dump_file is set
+    dump_trigger dump_requests;
+    std::thread  dump_thread;
+
+    /// Opens the spool, and starts the drain thread (and the timeline thread
+    /// and dump thread, if enabled)
+    global_context();
+
+    /// Open the event spool, and start the drain thread. Only used in events
+    /// mode
+    void open_spool();
+
+    /// Create and register the context of the current thread. Doesn't
+    /// allocate (other than with the underlying malloc), and doesn't lock.
+    /// Called the first time the thread records an event.
     local_context* new_local_context();
 
+    /// Called when a thread exits. Drains the events of the thread's context
+    /// into the spool, moves its stacks and counts into `retired`, and frees
+    /// it. The thread must not use the context afterwards. Does nothing once
+    /// `retiring` is cleared.
+    void retire_local_context(local_context* context);
+
+    /// Append the program counters of a stack recorded by the given thread to
+    /// `out` (see stack_trie::expand). Works for threads which have exited.
+    /// Requires context_lock
+    void expand_stack(u32 thread, stack_id_t id, _vec<addr_t>& out) const;
+
+    /// Drain the given counter's events into the spool. Requires spool_lock
+    void drain_locked(alloc_counter& counter);
+
+    /// Drain the events of every local context into the spool
+    void drain_all();
+
+    /// Body of the drain thread
+    void run_drain_thread();
+
+    /// Body of the timeline thread
+    void run_timeline_thread();
+
+    /// Body of the dump thread
+    void run_dump_thread();
+
+    /// Stop the drain thread, the timeline thread, and the dump thread, if
+    /// they're running
+    void stop_threads();
+
+    /// Write a report on everything recorded so far to `filename`.
+    ///
+    /// This may be called while the program is still running. Counters are
+    /// read in place rather than reset, and locks which the allocation hooks
+    /// take are only held briefly (to drain the event rings, or to copy the
+    /// peak snapshot), never while the report is written. Counts read from
+    /// other threads' call graphs may be slightly out of date.
+    void write_report(char const* filename);
+
+    /// Invoke write_report(), printing a warning instead of throwing if the
+    /// report couldn't be written
+    bool try_write_report(char const* filename) noexcept;
+
+    /// Stop recording, and write the final report to mem_profile_out
     void generate_report();
 
-    /// Invokes generate_report()
+    /// Invokes generate_report(). The contexts of threads which are still
+    /// running are never freed, since they may still be in use
     ~global_context();
 };
+
+/// Write an annotated report on the events in the spool to a file. `stacks`
+/// holds the call stack of each event, and `remaps[thread]` maps the stack ids
+/// recorded by each thread into `stacks`, and `modules` lists the modules loaded
+/// while the program ran. The report is written as JSON, or in the binary
+/// format (see mem_profile_format).
+///
+/// (Annotated meaning function names are provided and demangled)
+void dump_report(spool_reader const&    spool,
+                 stack_trie const&      stacks,
+                 view<_vec<stack_id_t>> remaps,
+                 view<module_info>      modules,
+                 char const*            filename);
+
+struct live_snapshot;
+
+/// Write an annotated report on the given calling-context tree to a file
+/// (used in aggregate and peak mode). In peak mode, `graph` counts the
+/// allocations which were live at the peak, and `peak` holds the rest of the
+/// snapshot. Otherwise, `peak` is empty.
+void dump_report(call_graph const&    graph,
+                 live_snapshot const& peak,
+                 view<module_info>    modules,
+                 char const*          filename);
 } // namespace mp
@@ -0,0 +1,116 @@
+#include <mem_profile/dump_trigger.h>
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace mp {
+namespace {
+/// How often the control file is checked for
+constexpr auto CONTROL_FILE_POLL_INTERVAL = std::chrono::milliseconds(250);
+
+/// Write end of the pipe of the open dump_trigger, read by the signal handler
+std::atomic<int> trigger_fd{-1};
+
+struct sigaction previous_action {};
+
+void on_dump_signal(int) {
+    int saved = errno;
+    int fd    = trigger_fd.load(std::memory_order_relaxed);
+    if (fd >= 0) {
+        char byte = 0;
+        (void)!::write(fd, &byte, 1);
+    }
+    errno = saved;
+}
+} // namespace
+
+dump_trigger::~dump_trigger() {
+    if (signal_ != 0) {
+        ::sigaction(signal_, &previous_action, nullptr);
+    }
+    trigger_fd.store(-1);
+    if (read_fd_ >= 0) ::close(read_fd_);
+    if (write_fd_ >= 0) ::close(write_fd_);
+}
+
+bool dump_trigger::open(size_t signal_offset, char const* control_file) {
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fmt::println(stderr,
+                     "mem_profile: Unable to create dump trigger. {}",
+                     std::strerror(errno));
+        return false;
+    }
+    read_fd_  = fds[0];
+    write_fd_ = fds[1];
+    trigger_fd.store(write_fd_);
+
+    if (signal_offset != 0) {
+        if (signal_offset > size_t(SIGRTMAX - SIGRTMIN)) {
+            fmt::println(stderr,
+                         "mem_profile: MEM_PROFILE_DUMP_SIGNAL={} is past SIGRTMAX. "
+                         "Dumps can't be requested with a signal.",
+                         signal_offset);
+        } else {
+            int              signal = SIGRTMIN + int(signal_offset);
+            struct sigaction action {};
+            action.sa_handler = on_dump_signal;
+            action.sa_flags   = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            if (::sigaction(signal, &action, &previous_action) == 0) {
+                signal_ = signal;
+            } else {
+                fmt::println(stderr,
+                             "mem_profile: Unable to handle signal {}. {}",
+                             signal,
+                             std::strerror(errno));
+            }
+        }
+    }
+
+    if (control_file != nullptr && *control_file != '\0') {
+        control_file_ = control_file;
+    }
+    return signal_ != 0 || control_file_ != nullptr;
+}
+
+bool dump_trigger::wait() {
+    int timeout = control_file_ ? int(CONTROL_FILE_POLL_INTERVAL.count()) : -1;
+    for (;;) {
+        if (stopped_.load()) return false;
+
+        auto pfd = pollfd{read_fd_, POLLIN, 0};
+        int  n   = ::poll(&pfd, 1, timeout);
+        if (stopped_.load()) return false;
+
+        if (n > 0) {
+            // Merge every pending request into one
+            char buff[64];
+            while (::read(read_fd_, buff, sizeof(buff)) > 0) {
+            }
+            return true;
+        }
+        if (n < 0 && errno != EINTR) return false;
+
+        // The control file is removed before dumping, so that it can be
+        // created again to request the next dump
+        if (control_file_ && ::unlink(control_file_) == 0) {
+            return true;
+        }
+    }
+}
+
+void dump_trigger::stop() noexcept {
+    stopped_.store(true);
+    if (write_fd_ >= 0) {
+        char byte = 0;
+        (void)!::write(write_fd_, &byte, 1);
+    }
+}
+} // namespace mp
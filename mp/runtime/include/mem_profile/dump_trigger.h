@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <mp_types/types.h>
+
+namespace mp {
+/// Wakes the dump thread when a report is requested while the program runs
+/// (see mem_profile_dump_signal and mem_profile_dump_file).
+///
+/// Requests are delivered through a pipe. The signal handler only writes a
+/// single byte to it, which is async-signal-safe, and never blocks: the write
+/// end is non-blocking, and if the pipe is full, a dump is already pending.
+/// If a control file is given, it's polled for while waiting on the pipe.
+///
+/// Only one dump_trigger may be open at a time, since the signal handler
+/// needs to find the pipe.
+class dump_trigger {
+    int               read_fd_      = -1;
+    int               write_fd_     = -1;
+    int               signal_       = 0;
+    char const*       control_file_ = nullptr;
+    std::atomic<bool> stopped_{false};
+
+  public:
+    dump_trigger() = default;
+    dump_trigger(dump_trigger const&) = delete;
+
+    /// Restores the previous signal handler, and closes the pipe
+    ~dump_trigger();
+
+    /// Install a handler for `SIGRTMIN + signal_offset` (unless the offset is
+    /// 0), and watch for `control_file` (unless it's empty). Returns false
+    /// (after printing a warning) if neither could be set up.
+    bool open(size_t signal_offset, char const* control_file);
+
+    /// Block until a dump is requested, or the trigger is stopped. Returns
+    /// false once it's stopped. Requests which arrive while a dump is being
+    /// written are merged into a single request.
+    bool wait();
+
+    /// Wake the thread blocked in wait(), and make it return false
+    void stop() noexcept;
+};
+} // namespace mp
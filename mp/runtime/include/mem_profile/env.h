@@ -9,6 +9,18 @@
         return var_;                                                                               \
     }
 
+#define MP_CONFIG_SIZE(env_var, default_)                                                          \
+    [] {                                                                                           \
+        static size_t const var_ = mp::env_size_or(env_var, default_);                             \
+        return var_;                                                                               \
+    }
+
+#define MP_CONFIG_DOUBLE(env_var, default_)                                                        \
+    [] {                                                                                           \
+        static double const var_ = mp::env_double_or(env_var, default_);                           \
+        return var_;                                                                               \
+    }
+
 namespace mp {
 /// Attempt to get the value of the given environment variable. Return the value of 'default_'
 /// if the environment variable is not set.
@@ -18,8 +30,102 @@ inline char const* env_or(char const* name, char const* default_) {
     return result ? result : default_;
 }
 
+/// Attempt to parse the given environment variable as an unsigned integer. Return the value of
+/// 'default_' if the environment variable is not set, or is not a valid integer.
+inline size_t env_size_or(char const* name, size_t default_) {
+    char const* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') return default_;
+
+    char*              end    = nullptr;
+    unsigned long long result = std::strtoull(value, &end, 10);
+    return *end == '\0' ? size_t(result) : default_;
+}
+
+/// Attempt to parse the given environment variable as a floating-point number. Return the value
+/// of 'default_' if the environment variable is not set, or is not a valid number.
+inline double env_double_or(char const* name, double default_) {
+    char const* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') return default_;
+
+    char*  end    = nullptr;
+    double result = std::strtod(value, &end);
+    return *end == '\0' ? result : default_;
+}
+
 
 /// Output filename at which to store information about recorded allocations
 /// during the lifetime of the program
 constexpr static auto mem_profile_out = MP_CONFIG("MEM_PROFILE_OUT", "malloc_stats.json");
+
+/// Format of the output file. Either "json", or "binary" for the compact
+/// binary format described in mp_format/mpb.h. If unset, the binary format is
+/// used when the output filename ends in ".mpb", and JSON otherwise.
+constexpr static auto mem_profile_format = MP_CONFIG("MEM_PROFILE_FORMAT", "");
+
+/// What the profiler records. Either:
+/// - "events" (the default): every allocation and free is recorded as an
+///   event, along with its call stack, and objects found on the stack
+/// - "aggregate": each thread counts allocations in a calling-context tree,
+///   so the size of the profile only depends on the number of distinct call
+///   paths. Individual events and frees are not recorded.
+/// - "peak": live allocations are tracked, and only a snapshot of the live set
+///   at the peak of heap usage is written, grouped by call stack and by type
+///   (see mem_profile_peak_ratio). Individual events are not recorded.
+constexpr static auto mem_profile_mode = MP_CONFIG("MEM_PROFILE_MODE", "events");
+
+/// Average number of bytes allocated between sampled allocations. If nonzero,
+/// only a random sample of allocations are recorded, and each recorded event
+/// carries a weight so that totals can still be estimated. If zero (the
+/// default), every allocation is recorded.
+constexpr static auto mem_profile_sample_interval
+    = MP_CONFIG_SIZE("MEM_PROFILE_SAMPLE_INTERVAL", 0);
+
+/// Used in peak mode. A new snapshot of the live allocations is taken once
+/// live bytes exceed the previous snapshot by this ratio, so the snapshot
+/// that's written is within this ratio of the true peak. Smaller ratios are
+/// more precise, but take more snapshots. Values below 1 are treated as 1.
+constexpr static auto mem_profile_peak_ratio = MP_CONFIG_DOUBLE("MEM_PROFILE_PEAK_RATIO", 1.05);
+
+/// If nonzero, a snapshot of the live allocations is appended to
+/// `<MEM_PROFILE_OUT>.timeline.jsonl` every this many milliseconds, so heap
+/// growth can be followed over time (see timeline.h). Not supported in
+/// aggregate mode.
+constexpr static auto mem_profile_interval_ms = MP_CONFIG_SIZE("MEM_PROFILE_INTERVAL_MS", 0);
+
+/// If nonzero, sending the process the realtime signal `SIGRTMIN + N` writes a
+/// report on everything recorded so far, while the program keeps running. Each
+/// report is written next to MEM_PROFILE_OUT, with `.dump-<n>` inserted before
+/// the extension.
+constexpr static auto mem_profile_dump_signal = MP_CONFIG_SIZE("MEM_PROFILE_DUMP_SIGNAL", 0);
+
+/// If set, this file is checked for periodically, and when it appears, it's
+/// removed and a report is written, the same way as for
+/// mem_profile_dump_signal.
+constexpr static auto mem_profile_dump_file = MP_CONFIG("MEM_PROFILE_DUMP_FILE", "");
+
+/// Stack unwinder used to record call stacks. Either "libunwind" (the default),
+/// or "fp" to follow frame pointers, which is much faster but requires code
+/// built with `-fno-omit-frame-pointer`.
+constexpr static auto mem_profile_unwind = MP_CONFIG("MEM_PROFILE_UNWIND", "libunwind");
+
+/// When program counters are symbolized. Either:
+/// - "eager" (the default): when the report is written, as the program exits
+/// - "deferred": the report only holds raw program counters, along with the
+///   modules they belong to. `mp_symbolize` fills in the frame table later,
+///   so the program exits much faster.
+constexpr static auto mem_profile_symbolize = MP_CONFIG("MEM_PROFILE_SYMBOLIZE", "eager");
+
+/// Maximum number of threads used to symbolize program counters when writing
+/// the report. 0 (the default) uses one thread per core.
+constexpr static auto mem_profile_symbolize_threads
+    = MP_CONFIG_SIZE("MEM_PROFILE_SYMBOLIZE_THREADS", 0);
+
+/// Directory holding the persistent symbolization cache (see symbol_cache.h).
+/// If unset, `$XDG_CACHE_HOME/mem_profile/symbols` is used, falling back to
+/// `$HOME/.cache/mem_profile/symbols`. "off" disables the cache.
+constexpr static auto mem_profile_symbol_cache = MP_CONFIG("MEM_PROFILE_SYMBOL_CACHE", "");
+
+/// Size (in bytes) of the per-thread ring buffer which events are recorded into,
+/// before being drained into the event spool. Rounded up to a power of two.
+constexpr static auto mem_profile_ring_size = MP_CONFIG_SIZE("MEM_PROFILE_RING_SIZE", 1 << 20);
 } // namespace mp
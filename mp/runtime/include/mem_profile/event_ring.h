@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <initializer_list>
+#include <span>
+
+#include <mem_profile/alloc.h>
+#include <mem_profile/prelude.h>
+
+namespace mp {
+/// A view of raw bytes, eg, part of an encoded event record
+using byte_view = std::span<char const>;
+
+/// Get a view of the bytes making up a trivially copyable object
+template <class T>
+byte_view as_bytes(T const& value) noexcept {
+    return byte_view((char const*)&value, sizeof(T));
+}
+
+/// Get a view of the bytes making up an array of trivially copyable objects
+template <class T>
+byte_view as_bytes(T const* values, size_t count) noexcept {
+    return byte_view((char const*)values, count * sizeof(T));
+}
+
+/// Fixed-size single-producer, single-consumer ring buffer of bytes.
+///
+/// The thread that owns the ring pushes encoded event records with try_push().
+/// A record is published all at once, so a consumer never observes a partially
+/// written record.
+///
+/// Only one consumer may call consume() at a time. The ring does not enforce
+/// this itself: consumers are serialized by `global_context::spool_lock`.
+class event_ring {
+    /// Keeps the producer and consumer cursors on separate cache lines
+    constexpr static size_t CACHE_LINE = 64;
+
+    char*  buff_     = nullptr;
+    size_t capacity_ = 0;
+    size_t mask_     = 0;
+
+    /// Total number of bytes ever written. Only modified by the producer
+    alignas(CACHE_LINE) std::atomic<size_t> head_{0};
+    /// Total number of bytes ever consumed. Only modified by the consumer
+    alignas(CACHE_LINE) std::atomic<size_t> tail_{0};
+
+    void write_at(size_t pos, byte_view bytes) noexcept {
+        size_t start = pos & mask_;
+        size_t first = std::min(bytes.size(), capacity_ - start);
+        ::memcpy(buff_ + start, bytes.data(), first);
+        ::memcpy(buff_, bytes.data() + first, bytes.size() - first);
+    }
+
+  public:
+    /// Create a ring with the given capacity, which must be a power of two.
+    ///
+    /// Storage is obtained from the underlying malloc, so creating a ring is
+    /// never recorded as an allocation.
+    explicit event_ring(size_t capacity)
+      : buff_((char*)mperf_malloc(capacity))
+      , capacity_(capacity)
+      , mask_(capacity - 1) {}
+
+    event_ring(event_ring const&) = delete;
+
+    ~event_ring() { mperf_free(buff_); }
+
+    size_t capacity() const noexcept { return capacity_; }
+
+    /// Attempt to push a single record made up of the given parts.
+    /// Returns false (and writes nothing) if there isn't enough space.
+    bool try_push(std::initializer_list<byte_view> parts) noexcept {
+        size_t size = 0;
+        for (auto part : parts) {
+            size += part.size();
+        }
+
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+
+        if (capacity_ - (head - tail) < size) {
+            return false;
+        }
+
+        for (auto part : parts) {
+            write_at(head, part);
+            head += part.size();
+        }
+
+        head_.store(head, std::memory_order_release);
+        return true;
+    }
+
+    /// Consume every byte that's currently available. Available bytes are
+    /// passed to `sink(first, second)`: if the data wraps around the end of
+    /// the buffer, `second` holds the part that wrapped around. Otherwise it's
+    /// empty.
+    ///
+    /// Returns the number of bytes consumed.
+    template <class Sink>
+    size_t consume(Sink&& sink) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t size = head - tail;
+
+        if (size == 0) {
+            return 0;
+        }
+
+        size_t start = tail & mask_;
+        size_t first = std::min(size, capacity_ - start);
+        sink(byte_view(buff_ + start, first), byte_view(buff_, size - first));
+
+        tail_.store(head, std::memory_order_release);
+        return size;
+    }
+};
+} // namespace mp
@@ -0,0 +1,72 @@
+#include <mem_profile/json_writer.h>
+
+#include <cerrno>
+#include <mp_error/error.h>
+
+namespace mp {
+json_writer::json_writer(char const* filename)
+  : file_(std::fopen(filename, "wb"))
+  , buffer_(new char[BUFFER_SIZE]) {
+    if (file_ == nullptr) {
+        throw ERR("Unable to open '{}' for writing. {}", filename, c_errcode{errno});
+    }
+}
+
+json_writer::~json_writer() {
+    if (file_ == nullptr) return;
+
+    std::fwrite(buffer_.get(), 1, pos_, file_);
+    std::fclose(file_);
+}
+
+void json_writer::flush() {
+    write_unbuffered(std::string_view(buffer_.get(), pos_));
+    pos_ = 0;
+}
+
+void json_writer::close() {
+    flush();
+
+    std::FILE* file = file_;
+    file_           = nullptr;
+    if (std::fclose(file) != 0) {
+        throw ERR("Error when closing json output. {}", c_errcode{errno});
+    }
+}
+
+void json_writer::write_unbuffered(std::string_view text) {
+    if (std::fwrite(text.data(), 1, text.size(), file_) != text.size()) {
+        throw ERR("Error when writing json output. {}", c_errcode{errno});
+    }
+}
+
+void json_writer::string(std::string_view str) {
+    constexpr char HEX[] = "0123456789abcdef";
+
+    put('"');
+    size_t start = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        unsigned char ch = str[i];
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+
+        raw(str.substr(start, i - start));
+        start = i + 1;
+
+        char escape[6] = {'\\', 'u', '0', '0', HEX[ch >> 4], HEX[ch & 0xf]};
+        switch (ch) {
+        case '"':  raw("\\\""); break;
+        case '\\': raw("\\\\"); break;
+        case '\n': raw("\\n"); break;
+        case '\r': raw("\\r"); break;
+        case '\t': raw("\\t"); break;
+        default:   raw(std::string_view(escape, sizeof(escape))); break;
+        }
+    }
+    raw(str.substr(start));
+    put('"');
+}
+
+void json_writer::throw_glz_error(std::string const& error) {
+    throw ERR("Error when dumping json - {}", error);
+}
+} // namespace mp
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <charconv>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <glaze/glaze.hpp>
+#include <mp_types/types.h>
+
+namespace mp {
+/// Buffered writer for a JSON document.
+///
+/// Values are formatted directly into a fixed-size buffer, which is flushed to
+/// the file whenever it fills up. This means the memory used to write a report
+/// doesn't depend on the size of the report. Errors are reported by throwing.
+class json_writer {
+    constexpr static size_t BUFFER_SIZE = size_t(1) << 20;
+
+    std::FILE*              file_ = nullptr;
+    std::unique_ptr<char[]> buffer_;
+    size_t                  pos_ = 0;
+
+    /// Scratch space for values serialized with glaze
+    std::string scratch_;
+
+  public:
+    /// Open the given file for writing
+    explicit json_writer(char const* filename);
+    json_writer(json_writer const&) = delete;
+
+    /// Closes the file if close() was not called. Errors are ignored.
+    ~json_writer();
+
+    /// Flush the buffer to the file
+    void flush();
+
+    /// Flush the buffer and close the file
+    void close();
+
+    /// Write raw text, which must already be valid JSON
+    void raw(std::string_view text) {
+        if (text.size() > BUFFER_SIZE - pos_) {
+            flush();
+            if (text.size() > BUFFER_SIZE) {
+                write_unbuffered(text);
+                return;
+            }
+        }
+        text.copy(buffer_.get() + pos_, text.size());
+        pos_ += text.size();
+    }
+
+    void put(char ch) {
+        if (pos_ == BUFFER_SIZE) {
+            flush();
+        }
+        buffer_[pos_++] = ch;
+    }
+
+    /// Write an object key, followed by a colon. A comma is written first
+    /// unless `first` is true.
+    void key(std::string_view name, bool first = false) {
+        if (!first) put(',');
+        string(name);
+        put(':');
+    }
+
+    /// Write an integer or floating point value
+    template <class T>
+        requires std::is_arithmetic_v<T>
+    void number(T value) {
+        // Large enough for any 64-bit integer, or the shortest representation
+        // of any double
+        constexpr size_t MAX_CHARS = 32;
+        if (BUFFER_SIZE - pos_ < MAX_CHARS) {
+            flush();
+        }
+        char* begin = buffer_.get() + pos_;
+        auto  res   = std::to_chars(begin, begin + MAX_CHARS, value);
+        pos_ += res.ptr - begin;
+    }
+
+    /// Write a string, escaping it as needed
+    void string(std::string_view str);
+
+    /// Write an array of numbers. `get(i)` returns the i-th element
+    template <class F>
+    void number_array(size_t count, F&& get) {
+        put('[');
+        for (size_t i = 0; i < count; i++) {
+            if (i != 0) put(',');
+            number(get(i));
+        }
+        put(']');
+    }
+
+    /// Write a value using its glaze metadata. The serialized value is held
+    /// in memory before it's written, so this should only be used for values
+    /// whose size is bounded (eg, a table of unique program counters).
+    template <class T>
+    void value(T const& value) {
+        scratch_.clear();
+        auto errc = glz::write_json(value, scratch_);
+        if (errc) {
+            throw_glz_error(glz::format_error(errc, scratch_));
+        }
+        raw(scratch_);
+    }
+
+  private:
+    void write_unbuffered(std::string_view text);
+
+    [[noreturn]] static void throw_glz_error(std::string const& error);
+};
+} // namespace mp
@@ -0,0 +1,96 @@
+#include <mem_profile/live_table.h>
+
+namespace mp {
+namespace {
+/// Slot index of a pointer with the given hash. The low bits of the hash are
+/// used to pick the shard, so they're skipped.
+size_t home_slot(u64 h, size_t capacity) noexcept { return size_t(h >> 6) & (capacity - 1); }
+} // namespace
+
+live_alloc_table::shard::~shard() {
+    if (slots) allocator<slot>().deallocate(slots, capacity);
+}
+
+void live_alloc_table::shard::insert(addr_t ptr, live_alloc const& alloc) {
+    // Keep the load factor at most 1/2, so probe sequences stay short
+    if (2 * (count + 1) > capacity) grow();
+
+    size_t mask = capacity - 1;
+    for (size_t i = home_slot(hash(ptr), capacity);; i = (i + 1) & mask) {
+        auto& s = slots[i];
+        if (s.ptr == ptr) {
+            bytes = bytes - s.alloc.size + alloc.size;
+            s.alloc = alloc;
+            return;
+        }
+        if (s.ptr == 0) {
+            s = slot{ptr, alloc};
+            count += 1;
+            bytes += alloc.size;
+            return;
+        }
+    }
+}
+
+bool live_alloc_table::shard::erase(addr_t ptr, live_alloc& alloc) noexcept {
+    if (count == 0) return false;
+
+    size_t mask = capacity - 1;
+    size_t i    = home_slot(hash(ptr), capacity);
+    while (slots[i].ptr != ptr) {
+        if (slots[i].ptr == 0) return false;
+        i = (i + 1) & mask;
+    }
+
+    alloc = slots[i].alloc;
+    count -= 1;
+    bytes -= alloc.size;
+
+    // Backward-shift deletion: move later entries of the probe sequence into
+    // the hole, so that no tombstones are needed
+    for (size_t j = (i + 1) & mask; slots[j].ptr != 0; j = (j + 1) & mask) {
+        size_t home = home_slot(hash(slots[j].ptr), capacity);
+        // The entry at j can fill the hole at i only if its home slot isn't
+        // in the (cyclic) range (i, j]
+        bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            slots[i] = slots[j];
+            i        = j;
+        }
+    }
+    slots[i].ptr = 0;
+    return true;
+}
+
+void live_alloc_table::shard::grow() {
+    size_t new_capacity = capacity == 0 ? MIN_CAPACITY : 2 * capacity;
+    slot*  new_slots    = allocator<slot>().allocate(new_capacity);
+    for (size_t i = 0; i < new_capacity; i++) {
+        new_slots[i].ptr = 0;
+    }
+
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        if (slots[i].ptr == 0) continue;
+
+        size_t j = home_slot(hash(slots[i].ptr), new_capacity);
+        while (new_slots[j].ptr != 0) {
+            j = (j + 1) & mask;
+        }
+        new_slots[j] = slots[i];
+    }
+
+    if (slots) allocator<slot>().deallocate(slots, capacity);
+    slots    = new_slots;
+    capacity = new_capacity;
+}
+
+u64 live_alloc_table::live_bytes() noexcept {
+    u64 total = 0;
+    for (auto& s : shards_) {
+        auto guard = std::lock_guard(s.lock);
+        total += s.bytes;
+    }
+    return total;
+}
+} // namespace mp
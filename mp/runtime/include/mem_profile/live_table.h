@@ -0,0 +1,114 @@
+#pragma once
+
+#include <ankerl/unordered_dense.h>
+#include <mutex>
+
+#include <mem_profile/allocator.h>
+#include <mem_profile/stack_trie.h>
+#include <mem_profile/type_registry.h>
+#include <mp_hook_prelude.h>
+#include <mp_types/types.h>
+
+namespace mp {
+/// A recorded allocation which hasn't been freed yet
+struct live_alloc {
+    /// Size of the allocation, in bytes
+    u64        size     = 0;
+    /// id of the event which recorded the allocation. 0 if it wasn't recorded
+    u64        alloc_id = 0;
+    /// Call stack of the allocation, in the trie of the thread which made it
+    stack_id_t stack_id = 0;
+    /// Thread which recorded the allocation
+    u32        thread   = 0;
+    /// Weight of the allocation's event (see mem_profile_sample_interval)
+    float      weight   = 0;
+    /// id of the type of the innermost object on the call stack when the
+    /// allocation was made (see type_registry). Only recorded if live bytes
+    /// are grouped by type, ie in peak mode or when the timeline is enabled
+    /// (see RECORD_OWNER_TYPE). Otherwise 0
+    type_id_t  type     = 0;
+};
+
+/// Every recorded allocation which is still live, keyed by pointer.
+///
+/// A free looks up the allocation it releases at the time it's recorded, so
+/// its event carries the size and origin of that allocation. The table also
+/// keeps a running total of live bytes.
+///
+/// Pointers are spread across independently locked shards, so that threads
+/// touching unrelated pointers rarely contend. Each shard is an open-addressing
+/// hash table with linear probing, so a lookup usually touches a single cache
+/// line. Slots are allocated with the underlying malloc, so growing a shard is
+/// never recorded as an allocation.
+class live_alloc_table {
+    constexpr static size_t SHARD_COUNT  = 64;
+    constexpr static size_t MIN_CAPACITY = 64;
+
+    struct slot {
+        /// 0 if the slot is empty
+        addr_t     ptr;
+        live_alloc alloc;
+    };
+
+    struct alignas(64) shard {
+        std::mutex lock;
+        slot*      slots    = nullptr;
+        /// Number of slots. Always a power of two (or 0)
+        size_t     capacity = 0;
+        size_t     count    = 0;
+        /// Total size of the allocations in this shard
+        u64        bytes    = 0;
+
+        ~shard();
+
+        void insert(addr_t ptr, live_alloc const& alloc);
+        bool erase(addr_t ptr, live_alloc& alloc) noexcept;
+
+      private:
+        /// Double the number of slots, rehashing every entry
+        void grow();
+    };
+
+    shard shards_[SHARD_COUNT];
+
+    static u64 hash(addr_t ptr) noexcept {
+        return ankerl::unordered_dense::detail::wyhash::hash(ptr);
+    }
+
+    /// The low bits of the hash select the shard, and the rest select the slot
+    static shard& shard_for(shard* shards, u64 h) noexcept { return shards[h % SHARD_COUNT]; }
+
+  public:
+    /// Record that `ptr` is live. If it's already in the table, the entry is
+    /// replaced (eg, if its free wasn't seen).
+    void insert(void const* ptr, live_alloc const& alloc) {
+        auto& s     = shard_for(shards_, hash(addr_t(ptr)));
+        auto  guard = std::lock_guard(s.lock);
+        s.insert(addr_t(ptr), alloc);
+    }
+
+    /// Remove `ptr` from the table. Returns false if it isn't in the table.
+    /// Otherwise, `alloc` is set to the allocation it was recorded with.
+    bool erase(void const* ptr, live_alloc& alloc) noexcept {
+        auto& s     = shard_for(shards_, hash(addr_t(ptr)));
+        auto  guard = std::lock_guard(s.lock);
+        return s.erase(addr_t(ptr), alloc);
+    }
+
+    /// Total size of every live allocation, in bytes. Shards are read one at
+    /// a time, so this isn't an atomic snapshot while other threads allocate.
+    u64 live_bytes() noexcept;
+
+    /// Invoke `func(addr_t ptr, live_alloc const&)` on every live allocation.
+    /// Each shard is locked while it's visited, so `func` must not allocate.
+    template <class F>
+    void for_each(F&& func) {
+        for (auto& s : shards_) {
+            auto guard = std::lock_guard(s.lock);
+            for (size_t i = 0; i < s.capacity; i++) {
+                if (s.slots[i].ptr != 0) func(s.slots[i].ptr, s.slots[i].alloc);
+            }
+        }
+    }
+};
+} // namespace mp
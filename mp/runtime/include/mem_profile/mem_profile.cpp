@@ -12,6 +12,9 @@ alloc_hook_table ALLOC_HOOK_TABLE{};
 
 #include <atomic>
 #include <mem_profile/counters.h>
+#include <mem_profile/live_table.h>
+#include <mem_profile/peak.h>
+#include <mem_profile/sampler.h>
 
 /// Rules for contsruction and destruction:
 /// 1. All thread_local objects are destroyed prior to any static objects
@@ -24,13 +27,34 @@ alloc_hook_table ALLOC_HOOK_TABLE{};
 /// - https://en.cppreference.com/w/cpp/utility/program/exit
 
 namespace mp {
-/// true if tracing is enabled. See tracing_enabled
-std::atomic_bool            TRACING_ENABLED = true;
+/// true if tracing is enabled. See tracing_enabled. Set once the global
+/// context has been constructed
+std::atomic_bool            TRACING_ENABLED = false;
+/// Recorded allocations which haven't been freed yet. Not used in aggregate
+/// mode. Constructed before (and so destroyed after) the global context
+live_alloc_table                    LIVE_ALLOCS;
+/// Average number of bytes between sampled allocations. 0 if sampling is disabled
+size_t const                        SAMPLE_INTERVAL = mem_profile_sample_interval();
+/// true if allocations are counted in per-thread call graphs, rather than
+/// recorded as events. See mem_profile_mode
+bool const AGGREGATE_MODE = std::string_view(mem_profile_mode()) == "aggregate";
+/// true if only a snapshot of the live allocations at peak heap usage is
+/// recorded, rather than events. See mem_profile_mode
+bool const PEAK_MODE = std::string_view(mem_profile_mode()) == "peak";
+/// Snapshots the live allocations as heap usage reaches new peaks. Only used
+/// in peak mode
+peak_tracker PEAK{mem_profile_peak_ratio()};
+/// Milliseconds between timeline snapshots. 0 if the timeline is disabled
+size_t const INTERVAL_MS = mem_profile_interval_ms();
+/// true if the type of the innermost object on the call stack is recorded
+/// with each live allocation, so that live bytes can be grouped by type
+bool const RECORD_OWNER_TYPE = PEAK_MODE || INTERVAL_MS != 0;
 /// Keeps track of global allocation counts. Local Contexts synchronize with
 /// the global context on their destruction
-global_context              GLOBAL_CONTEXT{};
-/// Keeps track of allocation counts on the current thread.
-thread_local local_context* LOCAL_CONTEXT = GLOBAL_CONTEXT.new_local_context();
+global_context GLOBAL_CONTEXT{};
+/// Hot state of the current thread, read on every call to a hook. The
+/// thread's local_context is created lazily (see current_context)
+constinit thread_local local_state LOCAL MP_INITIAL_EXEC_TLS{};
 
 /// Tracing is enabled provided that there are living local contexts.
 /// At the end of the program, all the local contexts will be destroyed
@@ -40,6 +64,93 @@ thread_local local_context* LOCAL_CONTEXT = GLOBAL_CONTEXT.new_local_context();
 /// synchronizes with the global context. Then when the global context is
 /// destroyed, the global context generates a report
 inline bool tracing_enabled() noexcept { return TRACING_ENABLED.load(std::memory_order_relaxed); }
+
+/// Get the context of the current thread, creating it the first time the
+/// thread records an event. Must only be called with the nest level raised,
+/// so that creating the context is never recorded.
+inline local_context& current_context() {
+    if (LOCAL.context == nullptr) [[unlikely]] {
+        LOCAL.context = GLOBAL_CONTEXT.new_local_context();
+    }
+    return *LOCAL.context;
+}
+
+/// Decides whether an allocation of the given size is recorded, and sets
+/// `weight` to the weight of its event. Allocations which aren't sampled only
+/// cost a decrement of a thread-local counter.
+inline bool sample_alloc(size_t size, float& weight) noexcept {
+    if (SAMPLE_INTERVAL == 0) {
+        weight = 1;
+        return true;
+    }
+    if (!LOCAL.sampler.countdown(size)) [[likely]] {
+        return false;
+    }
+    weight = LOCAL.sampler.take_sample(size, SAMPLE_INTERVAL);
+    return weight != 0;
+}
+
+/// Remember that the allocation at `ptr` is live, so that its free is
+/// recorded with its size and origin
+inline void track_live(void const* ptr, live_alloc const& alloc) {
+    if (ptr != nullptr) {
+        LIVE_ALLOCS.insert(ptr, alloc);
+    }
+}
+
+/// Weight of an event which releases `ptr`, or 0 if the release isn't
+/// recorded. `origin` is set to the allocation being released, if it was
+/// recorded. When sampling, the weight is the weight `ptr` was sampled with,
+/// and releases of allocations which weren't sampled aren't recorded.
+/// Otherwise, every release is recorded with a weight of 1, even if the
+/// allocation wasn't (eg, because it was made before tracing started). Always
+/// 0 in aggregate mode, which doesn't record frees, and in peak mode, which
+/// only removes the allocation from the live set.
+inline float release(void const* ptr, live_alloc& origin) noexcept {
+    if (AGGREGATE_MODE) return 0;
+    bool found = LIVE_ALLOCS.erase(ptr, origin);
+    if (PEAK_MODE) {
+        if (found) PEAK.on_free(origin);
+        return 0;
+    }
+    if (found) {
+        return SAMPLE_INTERVAL == 0 ? 1.f : origin.weight;
+    }
+    return SAMPLE_INTERVAL == 0 ? 1.f : 0.f;
+}
+
+/// id of the type of the innermost object on the call stack, or 0 if there is
+/// none. Objects whose constructors or member functions are running count as
+/// well, if the plugin instrumented them. Always 0 unless RECORD_OWNER_TYPE is set
+inline type_id_t find_owner_type(trace_view trace) noexcept {
+    if (!RECORD_OWNER_TYPE) return 0;
+
+    event_info owner;
+    if (mp_extract_events(1, &owner, trace.size(), trace.data(), true) == 0) return 0;
+    return TYPES.id(owner.type_data);
+}
+
+/// Add an allocation to the live set in peak mode. The type of the innermost
+/// object on the call stack is recorded, so that the snapshot can be grouped
+/// by type.
+inline void track_peak(alloc_counter& counter,
+                       void const*    ptr,
+                       size_t         size,
+                       float          weight,
+                       trace_view     trace) {
+    if (ptr == nullptr) return;
+
+    auto alloc = live_alloc{
+        size,
+        0,
+        counter.record_live(size, trace),
+        counter.thread(),
+        weight,
+        find_owner_type(trace),
+    };
+    LIVE_ALLOCS.insert(ptr, alloc);
+    PEAK.on_alloc(alloc, LIVE_ALLOCS);
+}
 } // namespace mp
 
 
@@ -55,13 +166,25 @@ inline bool tracing_enabled() noexcept { return TRACING_ENABLED.load(std::memory
 // Used to get underlying malloc implementation
 #include <mem_profile/alloc.h>
 
+#include <mem_profile/stamp.h>
 #include <mp_unwind/mp_unwind.h>
 
-namespace {
-std::atomic_uint64_t EVENT_COUNTER = 0;
+namespace mp {
+/// Get the id of a new event on the current thread.
+///
+/// Rather than incrementing a shared counter (which every thread would
+/// contend on), ids are timestamps, bumped if necessary so that they strictly
+/// increase on each thread. Events are put into a total order at report time,
+/// by sorting on (id, thread).
+inline u64 next_event_id() noexcept {
+    u64 stamp        = std::max(read_stamp(), LOCAL.last_stamp + 1);
+    LOCAL.last_stamp = stamp;
+    return stamp;
 }
+} // namespace mp
 
-/// Records an allocation if tracing is enabled in the current context.
+/// Records an event in the current context, provided it isn't nested inside
+/// another recording.
 ///
 /// This is implemented as a macro in order to avoid adding another function to
 /// the backtrace, so the top of the backtrace should always say "malloc" or
@@ -69,9 +192,9 @@ std::atomic_uint64_t EVENT_COUNTER = 0;
 ///
 /// Procedure:
 ///
-/// Checks if tracing is enabled globally. If there are no more living local
-/// contexts, eg because the program is in the process of exiting, tracing will
-/// be disabled globally.
+/// The caller checks if tracing is enabled globally. If there are no more
+/// living local contexts, eg because the program is in the process of exiting,
+/// tracing will be disabled globally.
 ///
 /// If tracing is enabled globally, it's safe to obtain the current local
 /// context. The local context is obtained, and then it checks if tracing is
@@ -80,40 +203,86 @@ std::atomic_uint64_t EVENT_COUNTER = 0;
 ///   while mallocs are being traced)
 /// - obtains a backtrace
 /// - records the current allocation and it's backtrace
+/// - adds the allocation to the live table, so that its free can refer to it
 /// - re-enables tracing (the guard re-enables it upon destruction)
-#define RECORD_ALLOC(_type, _alloc_size, _alloc_ptr, _alloc_hint)                                  \
-    if (mp::tracing_enabled()) {                                                                   \
-        auto& context = *mp::LOCAL_CONTEXT;                                                        \
-        if (context.nest_level == 0) {                                                             \
-            auto guard = context.inc_nested();                                                     \
+#define RECORD_EVENT(_type, _alloc_size, _alloc_ptr, _alloc_hint, _weight)                         \
+    {                                                                                              \
+        if (mp::LOCAL.nest_level == 0) {                                                           \
+            auto  guard   = mp::LOCAL.inc_nested();                                                \
+            auto& context = mp::current_context();                                                 \
                                                                                                    \
             mp::addr_t trace_buff[BACKTRACE_BUFFER_SIZE];                                          \
             size_t     trace_size = mp::mp_unwind(BACKTRACE_BUFFER_SIZE, trace_buff);              \
-            context.counter.record_alloc(EVENT_COUNTER++,                                          \
-                                         _type,                                                    \
-                                         _alloc_size,                                              \
-                                         _alloc_ptr,                                               \
-                                         _alloc_hint,                                              \
-                                         trace_view{trace_buff, trace_size});                      \
+            if (mp::AGGREGATE_MODE) {                                                              \
+                context.counter.record_aggregate(_alloc_size,                                      \
+                                                 _weight,                                          \
+                                                 trace_view{trace_buff, trace_size});              \
+            } else if (mp::PEAK_MODE) {                                                            \
+                mp::track_peak(context.counter,                                                    \
+                               _alloc_ptr,                                                         \
+                               _alloc_size,                                                        \
+                               _weight,                                                            \
+                               trace_view{trace_buff, trace_size});                                \
+            } else {                                                                               \
+                auto id_    = mp::next_event_id();                                                 \
+                auto stack_ = context.counter.record_alloc(id_,                                    \
+                                                           _type,                                  \
+                                                           _alloc_size,                            \
+                                                           _alloc_ptr,                             \
+                                                           _alloc_hint,                            \
+                                                           _weight,                                \
+                                                           trace_view{trace_buff, trace_size});    \
+                mp::track_live(_alloc_ptr,                                                         \
+                               mp::live_alloc{                                                     \
+                                   _alloc_size,                                                    \
+                                   id_,                                                            \
+                                   stack_,                                                         \
+                                   context.counter.thread(),                                       \
+                                   _weight,                                                        \
+                                   mp::find_owner_type(trace_view{trace_buff, trace_size}),        \
+                               });                                                                 \
+            }                                                                                      \
         }                                                                                          \
     }
 
-#define RECORD_ALLOC_WITH_OBJECT_INFO(_type, _alloc_size, _alloc_ptr, _alloc_hint)                 \
-    if (mp::tracing_enabled()) {                                                                   \
-        auto& context = *mp::LOCAL_CONTEXT;                                                        \
-        if (context.nest_level == 0) {                                                             \
-            auto guard = context.inc_nested();                                                     \
+/// Records a free of `_ptr` with the id `_id`, along with any objects
+/// discovered on the stack. `_origin` is the allocation being released (see
+/// mp::release)
+#define RECORD_FREE_EVENT(_id, _ptr, _weight, _origin)                                             \
+    {                                                                                              \
+        if (mp::LOCAL.nest_level == 0) {                                                           \
+            auto  guard   = mp::LOCAL.inc_nested();                                                \
+            auto& context = mp::current_context();                                                 \
                                                                                                    \
             mp::addr_t trace_buff[BACKTRACE_BUFFER_SIZE];                                          \
-            mp::addr_t spp_buff[BACKTRACE_BUFFER_SIZE];                                            \
-            size_t     trace_size = mp::mp_unwind(BACKTRACE_BUFFER_SIZE, trace_buff, spp_buff);    \
-            context.counter.record_alloc_with_events(EVENT_COUNTER++,                              \
-                                                     _type,                                        \
-                                                     _alloc_size,                                  \
-                                                     _alloc_ptr,                                   \
-                                                     _alloc_hint,                                  \
-                                                     trace_view{trace_buff, trace_size},           \
-                                                     trace_view{spp_buff, trace_size});            \
+            size_t     trace_size = mp::mp_unwind(BACKTRACE_BUFFER_SIZE, trace_buff);              \
+            context.counter.record_free(_id,                                                       \
+                                        _ptr,                                                      \
+                                        _weight,                                                   \
+                                        _origin,                                                   \
+                                        trace_view{trace_buff, trace_size});                       \
+        }                                                                                          \
+    }
+
+/// Records an allocation if tracing is enabled, and the allocation is sampled
+/// (every allocation is sampled, unless MEM_PROFILE_SAMPLE_INTERVAL is set)
+#define RECORD_ALLOC(_type, _alloc_size, _alloc_ptr, _alloc_hint)                                  \
+    if (mp::tracing_enabled()) {                                                                   \
+        float weight_;                                                                             \
+        if (mp::sample_alloc(_alloc_size, weight_)) {                                              \
+            RECORD_EVENT(_type, _alloc_size, _alloc_ptr, _alloc_hint, weight_);                    \
+        }                                                                                          \
+    }
+
+/// Records a free if tracing is enabled, and the freed allocation was sampled.
+/// The free is stamped before the underlying free, so it's ordered before any
+/// allocation which reuses the address.
+#define RECORD_FREE(_ptr)                                                                          \
+    if (mp::tracing_enabled()) {                                                                   \
+        auto  origin_ = mp::live_alloc{};                                                          \
+        float weight_ = mp::release(_ptr, origin_);                                                \
+        if (weight_ != 0) {                                                                        \
+            RECORD_FREE_EVENT(mp::next_event_id(), _ptr, weight_, origin_);                        \
         }                                                                                          \
     }
 
@@ -137,8 +306,20 @@ extern "C" MP_EXPORT void* calloc(size_t n, size_t size) {
 }
 
 extern "C" MP_EXPORT void* realloc(void* hint, size_t n) {
+    // realloc is recorded as a free of `hint`, followed by an allocation of
+    // the result. Once the underlying realloc releases `hint`, another thread
+    // can be handed the same address, and stamp its allocation before this
+    // thread records anything. So the free is looked up and stamped first,
+    // and the allocation is stamped afterwards, as with any other allocation.
+    auto  hint_origin = live_alloc{};
+    float hint_weight = hint && tracing_enabled() ? release(hint, hint_origin) : 0;
+    u64   hint_id     = hint_weight != 0 ? next_event_id() : 0;
+
     auto result = mperf_realloc(hint, n);
 
+    if (hint_weight != 0 && tracing_enabled()) {
+        RECORD_FREE_EVENT(hint_id, hint, hint_weight, hint_origin);
+    }
     RECORD_ALLOC(event_type::ALLOC, n, result, hint);
 
     return result;
@@ -156,7 +337,7 @@ extern "C" MP_EXPORT void* memalign(size_t alignment, size_t size) {
 
 extern "C" MP_EXPORT void free(void* ptr) {
     if (ptr == nullptr) return;
-    RECORD_ALLOC_WITH_OBJECT_INFO(event_type::FREE, 0, ptr, nullptr);
+    RECORD_FREE(ptr);
     mperf_free(ptr);
 }
 
@@ -228,22 +409,22 @@ MP_EXPORT void* operator new[](size_t count, std::align_val_t al, const std::not
 /// See: https://en.cppreference.com/w/cpp/memory/new/operator_delete
 MP_EXPORT void operator delete(void* ptr) noexcept {
     if (ptr == nullptr) return;
-    RECORD_ALLOC_WITH_OBJECT_INFO(event_type::FREE, 0, ptr, nullptr);
+    RECORD_FREE(ptr);
     mperf_free(ptr);
 }
 MP_EXPORT void operator delete[](void* ptr) noexcept {
     if (ptr == nullptr) return;
-    RECORD_ALLOC_WITH_OBJECT_INFO(event_type::FREE, 0, ptr, nullptr);
+    RECORD_FREE(ptr);
     mperf_free(ptr);
 }
 MP_EXPORT void operator delete(void* ptr, std::align_val_t al) noexcept {
     if (ptr == nullptr) return;
-    RECORD_ALLOC_WITH_OBJECT_INFO(event_type::FREE, 0, ptr, nullptr);
+    RECORD_FREE(ptr);
     mperf_free(ptr);
 }
 MP_EXPORT void operator delete[](void* ptr, std::align_val_t al) noexcept {
     if (ptr == nullptr) return;
-    RECORD_ALLOC_WITH_OBJECT_INFO(event_type::FREE, 0, ptr, nullptr);
+    RECORD_FREE(ptr);
     mperf_free(ptr);
 }
 
@@ -252,43 +433,381 @@ MP_EXPORT void operator delete[](void* ptr, std::align_val_t al) noexcept {
 ////  Local and global context implementations  ////
 ////////////////////////////////////////////////////
 
+#include <bit>
+#include <chrono>
+#include <mem_profile/io.h>
+#include <mem_profile/timeline.h>
+#include <string>
+#include <string_view>
+
 namespace mp {
+namespace {
+/// How often the drain thread empties the event rings into the spool
+constexpr auto DRAIN_INTERVAL = std::chrono::milliseconds(10);
+
+/// Capacity of each event ring. Must be a power of two, and large enough to
+/// hold the largest possible event record.
+size_t ring_capacity() noexcept {
+    return std::bit_ceil(std::max(mem_profile_ring_size(), MAX_SPOOL_EVENT_SIZE));
+}
+
+/// Name of the n-th report requested while the program runs: the output
+/// filename, with `.dump-<n>` inserted before its extension
+std::string dump_filename(std::string_view out, u64 n) {
+    size_t name = out.rfind('/');
+    name        = name == out.npos ? 0 : name + 1;
+    size_t ext  = out.rfind('.');
+    if (ext == out.npos || ext <= name) {
+        ext = out.size();
+    }
+
+    auto result = std::string(out.substr(0, ext));
+    result += ".dump-";
+    result += std::to_string(n);
+    result += out.substr(ext);
+    return result;
+}
+
+/// Destructor of global_context::exit_key. Runs after the thread's
+/// thread_local objects have been destroyed
+void retire_current_thread(void* context) {
+    // Allocations made from here on (eg, by the destructors of other keys)
+    // are no longer recorded, and no new context is created
+    LOCAL.nest_level = 1;
+    LOCAL.context    = nullptr;
+
+    GLOBAL_CONTEXT.retire_local_context((local_context*)context);
+}
+
+/// Select the unwinder named by MEM_PROFILE_UNWIND
+void configure_unwind_backend() noexcept {
+    std::string_view name = mem_profile_unwind();
+    if (name == "libunwind") {
+        return;
+    }
+
+    bool ok = (name == "fp" || name == "frame_pointer")
+           && set_unwind_backend(unwind_backend::FRAME_POINTER);
+    if (!ok) {
+        std::setbuf(stderr, nullptr);
+        fwrite_msg(stderr, "mem_profile: Unsupported MEM_PROFILE_UNWIND='");
+        fwrite_msg(stderr, name);
+        fwrite_msg(stderr, "'. Using libunwind.\n");
+    }
+}
+} // namespace
+
+global_context::global_context() {
+    configure_unwind_backend();
+    modules.snapshot();
+
+    // Created before any thread registers, so that every context can be
+    // retired when its thread exits
+    if (::pthread_key_create(&exit_key, retire_current_thread) != 0) {
+        std::setbuf(stderr, nullptr);
+        fwrite_msg(stderr, "mem_profile: Unable to create thread exit key. ");
+        fwrite_msg(stderr, "Contexts of exited threads won't be reclaimed.\n");
+        exit_key = ~pthread_key_t(0);
+    }
+
+    // In aggregate and peak mode, no events are recorded, so there's nothing
+    // to spool
+    if (!AGGREGATE_MODE && !PEAK_MODE) {
+        open_spool();
+    }
+
+    if (INTERVAL_MS != 0) {
+        if (AGGREGATE_MODE) {
+            std::setbuf(stderr, nullptr);
+            fwrite_msg(stderr, "mem_profile: MEM_PROFILE_INTERVAL_MS isn't supported in ");
+            fwrite_msg(stderr, "aggregate mode. No timeline will be written.\n");
+        } else {
+            timeline_thread = std::thread([this] { run_timeline_thread(); });
+        }
+    }
+
+    if (mem_profile_dump_signal() != 0 || *mem_profile_dump_file() != '\0') {
+        if (dump_requests.open(mem_profile_dump_signal(), mem_profile_dump_file())) {
+            dump_thread = std::thread([this] { run_dump_thread(); });
+        }
+    }
+
+    // The hooks run as soon as the runtime is loaded, before any of its
+    // globals are initialized (eg, by the dynamic loader, or by libraries
+    // initialized first). Nothing is recorded until everything is ready, so
+    // that no thread registers before `threads` is constructed.
+    TRACING_ENABLED.store(true, std::memory_order_release);
+}
+
+void global_context::open_spool() {
+    if (std::string_view(mem_profile_mode()) != "events") {
+        std::setbuf(stderr, nullptr);
+        fwrite_msg(stderr, "mem_profile: Unknown MEM_PROFILE_MODE='");
+        fwrite_msg(stderr, mem_profile_mode());
+        fwrite_msg(stderr, "'. Recording events.\n");
+    }
+
+    if (!spool.open(mem_profile_out())) {
+        std::setbuf(stderr, nullptr);
+        fwrite_msg(stderr, "mem_profile: Unable to create event spool next to '");
+        fwrite_msg(stderr, mem_profile_out());
+        fwrite_msg(stderr, "'. Events will not be recorded.\n");
+    }
+
+    drain_thread = std::thread([this] { run_drain_thread(); });
+}
 
 local_context* global_context::new_local_context() {
-    // We MUST NOT allocate when creating the new local_context
-    // (we can perform untracked allocations, just not tracked ones)
+    // This is called from inside a hook, with the nest level raised, so any
+    // tracked allocations made here wouldn't be recorded. Even so, the context
+    // is only allocated with the underlying malloc, to keep this cheap.
+
+    u32 thread = threads.reserve();
+
+    // Does not allocate: uses `local_context.operator new`, and the event ring
+    // is allocated with mperf_malloc
+    auto* context = new local_context(thread, ring_capacity());
 
-    // Does not allocate: uses `local_context.operator new`
-    auto  handle = std::make_unique<local_context>();
-    auto* ptr    = handle.get();
+    // Does not allocate: slots are allocated with mperf_calloc
+    threads.publish(thread, context);
 
+    if (exit_key != ~pthread_key_t(0)) {
+        ::pthread_setspecific(exit_key, context);
+    }
+    return context;
+}
+
+void global_context::retire_local_context(local_context* context) {
+    auto& counter = context->counter;
+
+    // Same lock order as drain_all()
+    auto spool_guard   = std::lock_guard(spool_lock);
+    auto context_guard = std::lock_guard(context_lock);
+
+    // Once the final report starts, contexts are left alone. A thread which
+    // was already exiting when ~global_context deleted exit_key may get here
+    // after the global context is destroyed, but its storage is static, and
+    // destroying a std::mutex doesn't release anything on glibc
+    if (!retiring) return;
+
+    drain_locked(counter);
+    retired.retire(counter);
+    threads.take(counter.thread());
+    delete context;
+}
+
+void global_context::expand_stack(u32 thread, stack_id_t id, _vec<addr_t>& out) const {
+    if (auto* context = threads[thread]) {
+        context->counter.stacks().expand(id, out);
+    } else if (retired.contains(thread)) {
+        retired.stacks().expand(retired.remap(thread)[id], out);
+    }
+}
+
+void global_context::drain_locked(alloc_counter& counter) {
+    counter.events().consume([&](byte_view first, byte_view second) {
+        if (!spool.is_open()) return;
+
+        if (!spool.append(counter.thread(), first, second)) {
+            static bool reported = false;
+            if (!std::exchange(reported, true)) {
+                std::setbuf(stderr, nullptr);
+                fwrite_msg(stderr, "mem_profile: Failed to write to event spool. ");
+                fwrite_msg(stderr, "Some events will be missing from the report.\n");
+            }
+        }
+    });
+}
+
+void global_context::drain_all() {
+    auto spool_guard   = std::lock_guard(spool_lock);
+    auto context_guard = std::lock_guard(context_lock);
+    threads.for_each([&](local_context* context) { drain_locked(context->counter); });
+}
+
+void global_context::run_drain_thread() {
+    // Allocations made by the drain thread are never recorded
+    auto guard = LOCAL.inc_nested();
+
+    auto lock = std::unique_lock(drain_lock);
+    while (!drain_stop) {
+        drain_cv.wait_for(lock, DRAIN_INTERVAL);
+
+        lock.unlock();
+        drain_all();
+        modules.poll();
+        lock.lock();
+    }
+}
+
+void global_context::run_timeline_thread() {
+    // Allocations made by the timeline thread are never recorded
+    auto guard = LOCAL.inc_nested();
+
+    auto writer = timeline_writer();
+    if (!writer.open(mem_profile_out())) return;
+
+    auto start    = std::chrono::steady_clock::now();
+    auto interval = std::chrono::milliseconds(INTERVAL_MS);
+    auto next     = start + interval;
+
+    auto lock = std::unique_lock(drain_lock);
+    for (;;) {
+        // A final snapshot is written when the thread is stopped
+        bool stop = drain_cv.wait_until(lock, next, [this] { return drain_stop; });
+        lock.unlock();
+
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        auto ms      = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+        if (!writer.write_snapshot(LIVE_ALLOCS, *this, u64(ms)) || stop) return;
+
+        next += interval;
+        lock.lock();
+    }
+}
+
+void global_context::run_dump_thread() {
+    // Allocations made by the dump thread are never recorded
+    auto guard = LOCAL.inc_nested();
+
+    for (u64 count = 1; dump_requests.wait(); count++) {
+        auto filename = dump_filename(mem_profile_out(), count);
+        if (try_write_report(filename.c_str())) {
+            std::setbuf(stderr, nullptr);
+            fwrite_msg(stderr, "mem_profile: Wrote ");
+            fwrite_msg(stderr, filename);
+            fwrite_msg(stderr, "\n");
+        }
+    }
+}
+
+void global_context::stop_threads() {
     {
-        auto guard = std::lock_guard(context_lock);
-        // Does not allocate: uses mp::_vec
-        counters.push_back(std::move(handle));
+        auto guard = std::lock_guard(drain_lock);
+        drain_stop = true;
     }
+    drain_cv.notify_all();
+    dump_requests.stop();
 
-    return ptr;
+    if (drain_thread.joinable()) {
+        drain_thread.join();
+    }
+    if (timeline_thread.joinable()) {
+        timeline_thread.join();
+    }
+    if (dump_thread.joinable()) {
+        dump_thread.join();
+    }
+}
+
+void alloc_counter::push_event(byte_view header, byte_view objects) {
+    while (!events_.try_push({header, objects})) {
+        // The ring is full. Rather than waiting for the drain thread to catch
+        // up, drain it from the current thread.
+        auto guard = std::lock_guard(GLOBAL_CONTEXT.spool_lock);
+        GLOBAL_CONTEXT.drain_locked(*this);
+    }
+}
+
+void global_context::write_report(char const* filename) {
+    modules.snapshot();
+
+    if (AGGREGATE_MODE) {
+        // Merge the call graph from every thread into a single graph
+        auto graph = call_graph();
+        {
+            auto guard = std::lock_guard(context_lock);
+            graph.add(retired.graph());
+            threads.for_each([&](local_context* context) { graph.add(context->counter.graph()); });
+        }
+        dump_report(graph, live_snapshot(), modules.modules(), filename);
+        return;
+    }
+
+    if (PEAK_MODE) {
+        // Build a calling-context tree from the live allocations at the peak.
+        // Stacks are looked up by the thread which made them.
+        auto peak  = PEAK.snapshot();
+        auto graph = call_graph();
+        {
+            auto guard = std::lock_guard(context_lock);
+            auto trace = _vec<addr_t>();
+            for (auto const& [key, count] : peak.by_stack) {
+                trace.clear();
+                expand_stack(key.thread, key.stack_id, trace);
+                graph.record(trace.data(), trace.size(), count);
+            }
+        }
+        dump_report(graph, peak, modules.modules(), filename);
+        return;
+    }
+
+    // Drain every event ring, and map the spool as it stands. Events which are
+    // appended afterwards are past the end of the mapping, so the spool_lock
+    // can be released before the report is written.
+    auto spool_guard = std::unique_lock(spool_lock);
+    {
+        auto context_guard = std::lock_guard(context_lock);
+        threads.for_each([&](local_context* context) { drain_locked(context->counter); });
+    }
+    auto reader = spool_reader(spool);
+    spool_guard.unlock();
+
+    // Merge the stacks from every thread into a single trie. Each thread's
+    // stack ids are remapped into the merged trie. Every stack referred to by
+    // a drained event was published before the event was recorded. Threads
+    // which have exited are remapped through the retired stacks.
+    auto stacks = stack_trie();
+    auto remaps = std::vector<_vec<stack_id_t>>();
+    {
+        auto guard         = std::lock_guard(context_lock);
+        auto retired_remap = stacks.merge(retired.stacks());
+        for (u32 thread = 0; thread < threads.size(); thread++) {
+            auto& remap = remaps.emplace_back();
+            if (auto* context = threads[thread]) {
+                remap = stacks.merge(context->counter.stacks());
+            } else if (retired.contains(thread)) {
+                for (stack_id_t id : retired.remap(thread)) {
+                    remap.push_back(retired_remap[id]);
+                }
+            }
+        }
+    }
+
+    dump_report(reader, stacks, remaps, modules.modules(), filename);
 }
 
 void global_context::generate_report() {
     TRACING_ENABLED = false;
-    auto counter    = alloc_counter();
-    auto guard      = std::lock_guard(context_lock);
-    for (auto& local_context : counters) {
-        counter.drain(local_context->counter);
+    {
+        auto guard = std::lock_guard(context_lock);
+        retiring   = false;
     }
-    counter.dump_json(mp::mem_profile_out());
+    stop_threads();
+    write_report(mp::mem_profile_out());
 }
 
-global_context::~global_context() { generate_report(); }
+global_context::~global_context() {
+    generate_report();
+
+    // Threads which exit from here on are no longer retired
+    if (exit_key != ~pthread_key_t(0)) {
+        ::pthread_key_delete(exit_key);
+    }
+
+    // Contexts which are still registered belong to threads which haven't
+    // exited. They may be inside a hook which checked tracing_enabled() before
+    // the report started, and still write to their context, so they're left
+    // for the OS to reclaim. Contexts of exited threads were already freed
+    // when they were retired.
+}
 } // namespace mp
 
 
 
-///////////////////////////////////
-////  alloc_counter::dump_json  ////
-///////////////////////////////////
+///////////////////////////
+////  mp::dump_report  ////
+///////////////////////////
 
 /// Used to obtnain symbol information (mangled function name, file name,
 /// offsets, etc) from an address
@@ -296,23 +815,84 @@ global_context::~global_context() { generate_report(); }
 #include <mem_profile/abi.h>
 #include <mem_profile/containers.h>
 
+#include <mem_profile/json_writer.h>
 #include <mem_profile/output_record.h>
-#include <mem_profile/output_record_io.h>
+#include <mp_format/mpb_writer.h>
 
-void mp::alloc_counter::dump_json(char const* filename) {
-    using namespace mp;
+namespace mp {
+namespace {
+/// true if the report should be written in the binary format. See mem_profile_format
+bool use_binary_format(char const* filename) {
+    auto format = std::string_view(mem_profile_format());
+    if (format == "binary") return true;
+    if (format == "json") return false;
+    if (!format.empty()) {
+        std::setbuf(stderr, nullptr);
+        fwrite_msg(stderr, "mem_profile: Unknown MEM_PROFILE_FORMAT='");
+        fwrite_msg(stderr, mem_profile_format());
+        fwrite_msg(stderr, "'. Writing JSON.\n");
+        return false;
+    }
+    return std::string_view(filename).ends_with(".mpb");
+}
 
+/// Open the output file in the selected format, and pass it to `write`
+template <class F>
+void write_report(char const* filename, F&& write) {
     sv_store store;
-    auto     data = make_output_record(*this, store);
-
-    constexpr glz::opts opts{.skip_null_members = false};
+    if (use_binary_format(filename)) {
+        auto out = mpb::writer(filename);
+        write(out, store);
+        out.close();
+    } else {
+        auto out = json_writer(filename);
+        write(out, store);
+        out.close();
+    }
+}
+} // namespace
+
+void dump_report(spool_reader const&    spool,
+                 stack_trie const&      stacks,
+                 view<_vec<stack_id_t>> remaps,
+                 view<module_info>      modules,
+                 char const*            filename) {
+    auto types = TYPES.snapshot();
+    write_report(filename, [&](auto& out, sv_store& store) {
+        write_event_report(out, spool, stacks, remaps, modules, types, store);
+    });
+}
 
-    auto errc = glz::write_file_json<opts>(data, filename, std::string{});
-    if (errc) {
-        std::string glz_error = glz::format_error(errc, std::string{});
-        throw ERR("Error when dumping json - {}", glz_error);
+bool global_context::try_write_report(char const* filename) noexcept {
+    auto warn = [&](std::string_view reason) {
+        std::setbuf(stderr, nullptr);
+        fwrite_msg(stderr, "mem_profile: Unable to write report to '");
+        fwrite_msg(stderr, filename);
+        fwrite_msg(stderr, "'. ");
+        fwrite_msg(stderr, reason);
+        fwrite_msg(stderr, "\n");
+    };
+    try {
+        write_report(filename);
+        return true;
+    } catch (mp_error const& err) {
+        warn(err.msg);
+    } catch (std::exception const& err) {
+        warn(err.what());
     }
+    return false;
+}
+
+void dump_report(call_graph const&    graph,
+                 live_snapshot const& peak,
+                 view<module_info>    modules,
+                 char const*          filename) {
+    auto types = TYPES.snapshot();
+    write_report(filename, [&](auto& out, sv_store& store) {
+        write_call_graph_report(out, graph, peak, modules, types, store);
+    });
 }
+} // namespace mp
 
 
 
@@ -355,3 +935,29 @@ calloc_t alloc_hook_table::get_calloc() noexcept {
     return calloc_;
 }
 } // namespace mp
+
+
+
+////////////////////////
+////  dlclose hook  ////
+////////////////////////
+
+/// Once a library is unloaded, it's no longer possible to tell which library a
+/// program counter belonged to. The loaded modules are snapshotted before
+/// each call to dlclose, so that the library's program counters can still be
+/// symbolized (see mem_profile_symbolize).
+///
+/// dlopen isn't hooked: the dynamic loader uses the caller of dlopen to
+/// resolve $ORIGIN and RUNPATH, and a hook would become the caller. Libraries
+/// which are opened are picked up by the drain thread, or by the snapshot
+/// taken before they're closed.
+extern "C" MP_EXPORT int dlclose(void* handle) {
+    using dlclose_t = int (*)(void*);
+    static auto const real_dlclose = mp::dlsym_load_or_exit_as<dlclose_t>(RTLD_NEXT, "dlclose");
+
+    // Once tracing stops, the report has been (or is being) written
+    if (mp::tracing_enabled()) {
+        mp::GLOBAL_CONTEXT.modules.snapshot();
+    }
+    return real_dlclose(handle);
+}
@@ -0,0 +1,294 @@
+#include <mem_profile/module_map.h>
+
+#if defined(__linux__)
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <link.h>
+#include <unistd.h>
+
+namespace mp {
+namespace {
+/// Get the GNU build-id of a module as a hex string, by searching its notes
+_string read_build_id(dl_phdr_info const* info) {
+    constexpr char HEX[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        auto const& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_NOTE) continue;
+
+        auto const* p   = (char const*)(info->dlpi_addr + phdr.p_vaddr);
+        auto const* end = p + phdr.p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            auto const* note = (ElfW(Nhdr) const*)p;
+            auto const* name = p + sizeof(ElfW(Nhdr));
+            auto const* desc = name + ((note->n_namesz + 3) & ~3u);
+            p                = desc + ((note->n_descsz + 3) & ~3u);
+
+            bool is_build_id = note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+                            && std::memcmp(name, "GNU", 4) == 0;
+            if (!is_build_id || p > end) continue;
+
+            _string result;
+            for (size_t j = 0; j < note->n_descsz; j++) {
+                auto byte = u8(desc[j]);
+                result.push_back(HEX[byte >> 4]);
+                result.push_back(HEX[byte & 0xf]);
+            }
+            return result;
+        }
+    }
+    return {};
+}
+
+_string module_path(dl_phdr_info const* info) {
+    if (info->dlpi_name && info->dlpi_name[0] != '\0') {
+        return _string(info->dlpi_name);
+    }
+    // The main executable has an empty name
+    char    buffer[PATH_MAX];
+    ssize_t len = ::readlink("/proc/self/exe", buffer, sizeof(buffer));
+    return len > 0 ? _string(buffer, size_t(len)) : _string();
+}
+
+module_info make_module_info(dl_phdr_info const* info, _string path) {
+    auto result = module_info{std::move(path), read_build_id(info), info->dlpi_addr};
+
+    result.begin = ~addr_t();
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        auto const& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD) continue;
+
+        addr_t begin = info->dlpi_addr + phdr.p_vaddr;
+        result.begin = std::min(result.begin, begin);
+        result.end   = std::max(result.end, begin + phdr.p_memsz);
+    }
+    if (result.begin > result.end) {
+        result.begin = result.end;
+    }
+    return result;
+}
+} // namespace
+
+void module_map::snapshot() {
+    auto guard = std::lock_guard(lock_);
+
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, size_t, void* data) -> int {
+            auto& self = *(module_map*)data;
+            self.adds_ = info->dlpi_adds;
+            self.subs_ = info->dlpi_subs;
+
+            auto path = module_path(info);
+            for (auto const& m : self.modules_) {
+                if (m.load_base == info->dlpi_addr && m.path == path) {
+                    return 0;
+                }
+            }
+            self.modules_.push_back(make_module_info(info, std::move(path)));
+            return 0;
+        },
+        this);
+}
+
+void module_map::poll() {
+    struct counts {
+        u64 adds;
+        u64 subs;
+    } current{};
+
+    // The counters are the same for every module, so only the first is needed
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, size_t, void* data) -> int {
+            *(counts*)data = counts{info->dlpi_adds, info->dlpi_subs};
+            return 1;
+        },
+        &current);
+
+    bool changed;
+    {
+        auto guard = std::lock_guard(lock_);
+        changed    = current.adds != adds_ || current.subs != subs_;
+    }
+    if (changed) {
+        snapshot();
+    }
+}
+
+
+namespace {
+/// Pointers in the dynamic section are relocated in place by glibc, but left
+/// relative to the load address by other loaders (and in the vDSO)
+template <class T>
+T const* dynamic_ptr(dl_phdr_info const* info, ElfW(Addr) ptr) {
+    return (T const*)(ptr < info->dlpi_addr ? info->dlpi_addr + ptr : ptr);
+}
+
+/// The dynamic section doesn't record the number of symbols, so it's found
+/// from the hash table
+size_t dynamic_symbol_count(u32 const* hash, u32 const* gnu_hash) {
+    if (hash) {
+        // nchain is the number of symbols
+        return hash[1];
+    }
+    if (!gnu_hash) return 0;
+
+    // The GNU hash table only holds symbols from `symoffset` onwards. The
+    // last symbol is at the end of the chain of the highest bucket
+    u32        nbuckets   = gnu_hash[0];
+    u32        symoffset  = gnu_hash[1];
+    u32        bloom_size = gnu_hash[2];
+    u32 const* buckets    = gnu_hash + 4 + bloom_size * (sizeof(ElfW(Addr)) / sizeof(u32));
+    u32 const* chain      = buckets + nbuckets;
+
+    u32 last = 0;
+    for (u32 i = 0; i < nbuckets; i++) {
+        last = std::max(last, buckets[i]);
+    }
+    if (last < symoffset) return symoffset;
+    while ((chain[last - symoffset] & 1) == 0) {
+        last++;
+    }
+    return size_t(last) + 1;
+}
+} // namespace
+
+module_index::module_index() {
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, size_t, void* data) -> int {
+            auto&  self = *(module_index*)data;
+            auto   id   = u32(self.modules_.size());
+            addr_t page = addr_t(::sysconf(_SC_PAGESIZE));
+
+            auto& m = self.modules_.emplace_back();
+            m.path      = std::string(module_path(info));
+            m.base      = ~addr_t();
+            m.load_base = info->dlpi_addr;
+
+            ElfW(Dyn) const* dynamic = nullptr;
+            for (size_t i = 0; i < info->dlpi_phnum; i++) {
+                auto const& phdr = info->dlpi_phdr[i];
+                if (phdr.p_type == PT_DYNAMIC) {
+                    dynamic = (ElfW(Dyn) const*)(info->dlpi_addr + phdr.p_vaddr);
+                }
+                if (phdr.p_type != PT_LOAD) continue;
+
+                addr_t begin = info->dlpi_addr + phdr.p_vaddr;
+                self.segments_.push_back(segment{begin, begin + phdr.p_memsz, id});
+                m.base = std::min(m.base, info->dlpi_addr + (phdr.p_vaddr & ~(page - 1)));
+            }
+            if (m.base == ~addr_t()) {
+                m.base = info->dlpi_addr;
+            }
+
+            ElfW(Sym) const* symtab   = nullptr;
+            char const*      strtab   = nullptr;
+            u32 const*       hash     = nullptr;
+            u32 const*       gnu_hash = nullptr;
+            for (auto const* dyn = dynamic; dyn && dyn->d_tag != DT_NULL; dyn++) {
+                switch (dyn->d_tag) {
+                case DT_SYMTAB:   symtab = dynamic_ptr<ElfW(Sym)>(info, dyn->d_un.d_ptr); break;
+                case DT_STRTAB:   strtab = dynamic_ptr<char>(info, dyn->d_un.d_ptr); break;
+                case DT_HASH:     hash = dynamic_ptr<u32>(info, dyn->d_un.d_ptr); break;
+                case DT_GNU_HASH: gnu_hash = dynamic_ptr<u32>(info, dyn->d_un.d_ptr); break;
+                }
+            }
+
+            m.symbol_begin = self.symbols_.size();
+            size_t count   = symtab && strtab ? dynamic_symbol_count(hash, gnu_hash) : 0;
+            for (size_t i = 0; i < count; i++) {
+                auto const& sym = symtab[i];
+                // Same filter as dladdr: defined, non-TLS symbols
+                bool defined = sym.st_shndx != SHN_UNDEF && sym.st_value != 0;
+                if (!defined || ELF64_ST_TYPE(sym.st_info) == STT_TLS) continue;
+
+                self.symbols_.push_back(
+                    symbol{info->dlpi_addr + sym.st_value, sym.st_size, strtab + sym.st_name});
+            }
+            m.symbol_end = self.symbols_.size();
+
+            std::sort(self.symbols_.begin() + m.symbol_begin,
+                      self.symbols_.end(),
+                      [](symbol const& a, symbol const& b) { return a.addr < b.addr; });
+            return 0;
+        },
+        this);
+
+    std::sort(segments_.begin(), segments_.end(), [](segment const& a, segment const& b) {
+        return a.begin < b.begin;
+    });
+}
+
+auto module_index::find_module(addr_t addr) const noexcept -> module const* {
+    auto seg = std::upper_bound(segments_.begin(), segments_.end(), addr, [](addr_t a, auto& s) {
+        return a < s.begin;
+    });
+    if (seg == segments_.begin() || addr >= (--seg)->end) return nullptr;
+    return &modules_[seg->module];
+}
+
+bool module_index::lookup(addr_t addr, Dl_info& info) const noexcept {
+    auto const* mod = find_module(addr);
+    if (mod == nullptr) return false;
+
+    auto const& m  = *mod;
+    info.dli_fname = m.path.c_str();
+    info.dli_fbase = (void*)m.base;
+    info.dli_sname = nullptr;
+    info.dli_saddr = nullptr;
+
+    // The nearest symbol at or below the address, if it contains the address
+    auto first = symbols_.begin() + m.symbol_begin;
+    auto last  = symbols_.begin() + m.symbol_end;
+    auto sym   = std::upper_bound(first, last, addr, [](addr_t a, auto& s) { return a < s.addr; });
+    if (sym == first) return true;
+
+    --sym;
+    if (addr < sym->addr + sym->size || (sym->size == 0 && addr == sym->addr)) {
+        info.dli_sname = sym->name;
+        info.dli_saddr = (void*)sym->addr;
+    }
+    return true;
+}
+
+bool module_index::object(addr_t addr, char const*& path, addr_t& object_address) const noexcept {
+    auto const* m = find_module(addr);
+    if (m == nullptr) return false;
+
+    path           = m->path.c_str();
+    object_address = addr - m->load_base;
+    return true;
+}
+} // namespace mp
+
+#else
+namespace mp {
+// Modules can only be enumerated with dl_iterate_phdr, so the map is empty on
+// other platforms, and the index falls back to dladdr. Program counters can
+// still be symbolized in-process.
+void module_map::snapshot() {}
+void module_map::poll() {}
+
+module_index::module_index() {}
+
+bool module_index::lookup(addr_t addr, Dl_info& info) const noexcept {
+    return dladdr((void const*)addr, &info) != 0;
+}
+
+bool module_index::object(addr_t addr, char const*& path, addr_t& object_address) const noexcept {
+    Dl_info info;
+    if (dladdr((void const*)addr, &info) == 0) return false;
+
+    path           = info.dli_fname;
+    object_address = addr - addr_t(info.dli_fbase);
+    return true;
+}
+} // namespace mp
+#endif
+
+namespace mp {
+_vec<module_info> module_map::modules() const {
+    auto guard = std::lock_guard(lock_);
+    return modules_;
+}
+} // namespace mp
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <mem_profile/allocator.h>
+#include <mp_types/types.h>
+
+namespace mp {
+/// An object (the executable, or a shared library) loaded into the process
+struct module_info {
+    /// Path to the object file
+    _string path;
+    /// GNU build-id of the object, as a hex string. Empty if it has none
+    _string build_id;
+    /// Difference between addresses in the object file and addresses in
+    /// memory (`dlpi_addr`)
+    addr_t  load_base = 0;
+    /// Range of addresses occupied by the object's loadable segments
+    addr_t  begin     = 0;
+    addr_t  end       = 0;
+};
+
+/// Every module that has been loaded over the lifetime of the process.
+///
+/// Program counters are only meaningful relative to the modules which were
+/// loaded when they were recorded. Modules are never removed from the map, so
+/// that program counters in a library which was unloaded with `dlclose` can
+/// still be symbolized later. If an address range is reused, later modules
+/// take precedence.
+///
+/// Storage is obtained from the underlying malloc, so snapshots are never
+/// recorded as allocations.
+class module_map {
+    mutable std::mutex lock_;
+    _vec<module_info>  modules_;
+
+    /// Values of `dlpi_adds` and `dlpi_subs` at the last snapshot
+    u64 adds_ = 0;
+    u64 subs_ = 0;
+
+  public:
+    /// Add any modules which are currently loaded, but not yet in the map
+    void snapshot();
+
+    /// Take a snapshot if any modules have been loaded or unloaded since the
+    /// last snapshot. This is cheap enough to call periodically.
+    void poll();
+
+    /// Get a copy of every module in the map, in the order they were found
+    _vec<module_info> modules() const;
+};
+
+/// Index of the segments and dynamic symbols of every currently loaded
+/// module, for resolving many addresses at once.
+///
+/// `dladdr` takes the loader lock and scans the list of loaded modules on
+/// every call. Instead, the index is built once with dl_iterate_phdr, and
+/// each lookup is a binary search over sorted segments, followed by a binary
+/// search over the module's `.dynsym` symbols. The index is immutable once
+/// built, so it can be shared between threads. It refers to the modules'
+/// symbol names in place, so it must not outlive them.
+class module_index {
+    struct segment {
+        addr_t begin;
+        addr_t end;
+        u32    module;
+    };
+
+    struct symbol {
+        addr_t      addr;
+        addr_t      size;
+        char const* name;
+    };
+
+    struct module {
+        std::string path;
+        /// Lowest address the module is mapped at. Matches `dli_fbase`
+        addr_t      base         = 0;
+        /// Difference between addresses in the object file and addresses in
+        /// memory (`dlpi_addr`)
+        addr_t      load_base    = 0;
+        /// Range of the module's symbols in `symbols_`
+        size_t      symbol_begin = 0;
+        size_t      symbol_end   = 0;
+    };
+
+    /// Segments of every module, sorted by address
+    std::vector<segment> segments_;
+    std::vector<module>  modules_;
+    /// Symbols of every module. Each module's symbols are sorted by address
+    std::vector<symbol>  symbols_;
+
+    /// Find the module containing an address. Returns null if there is none
+    module const* find_module(addr_t addr) const noexcept;
+
+  public:
+    /// Build an index of the modules which are currently loaded
+    module_index();
+
+    /// Resolve an address, filling in `info` the way dladdr would. Returns
+    /// false if the address isn't in any loaded module. `dli_sname` and
+    /// `dli_saddr` are null if no exported symbol contains the address.
+    bool lookup(addr_t addr, Dl_info& info) const noexcept;
+
+    /// Find the object file containing an address, and the address within
+    /// that file, the way cpptrace resolves an `object_frame`. Returns false
+    /// if the address isn't in any loaded module.
+    bool object(addr_t addr, char const*& path, addr_t& object_address) const noexcept;
+};
+} // namespace mp
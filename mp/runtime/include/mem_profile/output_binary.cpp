@@ -0,0 +1,187 @@
+#include <mem_profile/output_record.h>
+#include <mp_format/mpb_writer.h>
+
+namespace mp {
+using mpb::column;
+using mpb::encoding;
+
+namespace {
+void write_frame_table(mpb::writer& out, output_frame_table const& t) {
+    out.write_column(column::FRAME_PC, 0, encoding::DELTA_VARINT, t.pc);
+    out.write_column(column::FRAME_OBJECT_PATH, 0, encoding::VARINT, t.object_path);
+    out.write_column(column::FRAME_OBJECT_ADDRESS, 0, encoding::VARINT, t.object_address);
+    out.write_column(column::FRAME_OBJECT_SYMBOL, 0, encoding::VARINT, t.object_symbol);
+    out.write_column(column::FRAME_OFFSETS, 0, encoding::DELTA_VARINT, t.offsets);
+    out.write_column(column::FRAME_FILE, 0, encoding::VARINT, t.file);
+    out.write_column(column::FRAME_FUNC, 0, encoding::VARINT, t.func);
+    out.write_column(column::FRAME_LINE, 0, encoding::VARINT, t.line);
+    out.write_column(column::FRAME_COLUMN, 0, encoding::VARINT, t.column);
+    out.write_column(column::FRAME_IS_INLINE, 0, encoding::RAW, t.is_inline);
+}
+
+void write_type_data(mpb::writer& out, output_type_data const& t) {
+    out.write_column(column::TYPE_SIZE, 0, encoding::VARINT, t.size);
+    out.write_column(column::TYPE_TYPE, 0, encoding::VARINT, t.type);
+    out.write_column(column::TYPE_FIELD_OFF, 0, encoding::DELTA_VARINT, t.field_off);
+    out.write_column(column::TYPE_FIELD_NAMES, 0, encoding::VARINT, t.field_names);
+    out.write_column(column::TYPE_FIELD_TYPES, 0, encoding::VARINT, t.field_types);
+    out.write_column(column::TYPE_FIELD_SIZES, 0, encoding::VARINT, t.field_sizes);
+    out.write_column(column::TYPE_FIELD_OFFSETS, 0, encoding::VARINT, t.field_offsets);
+    out.write_column(column::TYPE_BASE_OFF, 0, encoding::DELTA_VARINT, t.base_off);
+    out.write_column(column::TYPE_BASE_TYPES, 0, encoding::VARINT, t.base_types);
+    out.write_column(column::TYPE_BASE_SIZES, 0, encoding::VARINT, t.base_sizes);
+    out.write_column(column::TYPE_BASE_OFFSETS, 0, encoding::VARINT, t.base_offsets);
+}
+
+void write_stack_table(mpb::writer& out, output_stack_table const& t) {
+    out.write_column(column::STACK_OFFSETS, 0, encoding::DELTA_VARINT, t.stack_offsets);
+    out.write_column(column::STACK_PCS, 0, encoding::VARINT, t.stack_pcs);
+}
+
+void write_call_graph(mpb::writer& out, output_call_graph const& g) {
+    out.write_column(column::CALL_GRAPH_PARENT, 0, encoding::VARINT, g.parent);
+    out.write_column(column::CALL_GRAPH_PC_ID, 0, encoding::VARINT, g.pc_id);
+    out.write_column(column::CALL_GRAPH_NUM_BYTES, 0, encoding::VARINT, g.num_bytes);
+    out.write_column(column::CALL_GRAPH_NUM_ALLOCS, 0, encoding::VARINT, g.num_allocs);
+}
+
+void write_peak(mpb::writer& out, output_peak const& p) {
+    out.write_column(column::PEAK_MAX_BYTES, 0, encoding::VARINT, std::vector{p.max_bytes});
+    out.write_column(column::PEAK_NUM_BYTES, 0, encoding::VARINT, std::vector{p.num_bytes});
+    out.write_column(column::PEAK_NUM_ALLOCS, 0, encoding::VARINT, std::vector{p.num_allocs});
+    out.write_column(column::PEAK_TYPE_DATA, 0, encoding::VARINT, p.type_data);
+    out.write_column(column::PEAK_TYPE_BYTES, 0, encoding::VARINT, p.type_bytes);
+    out.write_column(column::PEAK_TYPE_ALLOCS, 0, encoding::VARINT, p.type_allocs);
+}
+
+void write_module_table(mpb::writer& out, output_module_table const& m) {
+    out.write_column(column::MODULE_PATH, 0, encoding::VARINT, m.path);
+    out.write_column(column::MODULE_BUILD_ID, 0, encoding::VARINT, m.build_id);
+    out.write_column(column::MODULE_LOAD_BASE, 0, encoding::VARINT, m.load_base);
+    out.write_column(column::MODULE_BEGIN, 0, encoding::VARINT, m.begin);
+    out.write_column(column::MODULE_END, 0, encoding::VARINT, m.end);
+}
+
+/// Columns for a single block of events. Once a block is full, it's written
+/// out and the columns are reused for the next block.
+struct event_block {
+    std::vector<u8>    type;
+    std::vector<u64>   alloc_size;
+    std::vector<u64>   alloc_addr;
+    std::vector<u64>   alloc_hint;
+    std::vector<float> weight;
+    std::vector<u32>   stack_id;
+    std::vector<u64>   origin_id;
+
+    output_object_table objects;
+
+    size_t size() const noexcept { return type.size(); }
+
+    void write(mpb::writer& out, u32 block) {
+        // Addresses and object ids are delta-encoded: consecutive events tend
+        // to touch nearby addresses, and object ids increase over time
+        out.write_column(column::EVENT_TYPE, block, encoding::RAW, type);
+        out.write_column(column::EVENT_ALLOC_SIZE, block, encoding::VARINT, alloc_size);
+        out.write_column(column::EVENT_ALLOC_ADDR, block, encoding::DELTA_VARINT, alloc_addr);
+        out.write_column(column::EVENT_ALLOC_HINT, block, encoding::DELTA_VARINT, alloc_hint);
+        out.write_column(column::EVENT_WEIGHT, block, encoding::RAW, weight);
+        out.write_column(column::EVENT_STACK_ID, block, encoding::VARINT, stack_id);
+        out.write_column(column::EVENT_ORIGIN_ID, block, encoding::DELTA_VARINT, origin_id);
+
+        auto const& o = objects;
+        out.write_column(column::EVENT_OBJECT_OFF, block, encoding::DELTA_VARINT, o.object_off);
+        out.write_column(column::OBJECT_TRACE_INDEX, block, encoding::VARINT, o.trace_index);
+        out.write_column(column::OBJECT_ID, block, encoding::DELTA_VARINT, o.object_id);
+        out.write_column(column::OBJECT_ADDR, block, encoding::DELTA_VARINT, o.addr);
+        out.write_column(column::OBJECT_TYPE_DATA, block, encoding::VARINT, o.type_data);
+    }
+
+    /// Clear the columns, keeping their capacity
+    void clear() {
+        type.clear();
+        alloc_size.clear();
+        alloc_addr.clear();
+        alloc_hint.clear();
+        weight.clear();
+        stack_id.clear();
+        origin_id.clear();
+
+        objects.object_off.assign(1, 0);
+        objects.trace_index.clear();
+        objects.object_id.clear();
+        objects.addr.clear();
+        objects.type_data.clear();
+    }
+};
+} // namespace
+
+void write_event_report(mpb::writer&               out,
+                        spool_reader const&        spool,
+                        stack_trie const&          stacks,
+                        view<_vec<stack_id_t>>     remaps,
+                        view<module_info>          modules,
+                        view<_mp_type_data const*> types,
+                        sv_store&                  store) {
+    string_table strtab{store};
+
+    auto type_data        = collect_type_data(spool, types);
+    auto type_data_lookup = compute_lookup(view(type_data));
+    auto stack_ids        = collect_stacks(spool, remaps, stacks.size());
+    auto node_stack_ids   = compute_node_stack_ids(stack_ids, stacks.size());
+    {
+        auto frame_table = make_frame_table(strtab, collect_pcs(stacks), modules);
+        auto node_pc_ids = compute_node_pc_ids(stacks, frame_table.pc);
+
+        write_frame_table(out, frame_table);
+        write_type_data(out, output_type_data(strtab, resolve_type_data(type_data, types)));
+        write_stack_table(out, output_stack_table(stacks, stack_ids, node_pc_ids));
+    }
+
+    auto events = event_block();
+    u32  block  = 0;
+    for_each_report_event(spool, remaps, [&](report_event const& e) {
+        events.type.push_back(u8(e.type));
+        events.alloc_size.push_back(e.alloc_size);
+        events.alloc_addr.push_back(e.alloc_addr);
+        events.alloc_hint.push_back(e.alloc_hint);
+        events.weight.push_back(e.weight);
+        events.stack_id.push_back(node_stack_ids[e.stack_id]);
+        events.origin_id.push_back(e.origin_id);
+        events.objects.append(e.objects, type_data_lookup);
+
+        if (events.size() == mpb::EVENTS_PER_BLOCK) {
+            events.write(out, block++);
+            events.clear();
+        }
+    });
+    if (events.size() != 0) {
+        events.write(out, block);
+    }
+
+    write_module_table(out, output_module_table(strtab, modules));
+    out.write_strtab(strtab.strtab);
+}
+
+void write_call_graph_report(mpb::writer&               out,
+                             call_graph const&          graph,
+                             live_snapshot const&       peak,
+                             view<module_info>          modules,
+                             view<_mp_type_data const*> types,
+                             sv_store&                  store) {
+    string_table strtab{store};
+
+    auto type_data = collect_type_data(peak, types);
+    {
+        auto frame_table   = make_frame_table(strtab, collect_pcs(graph.paths()), modules);
+        auto pc_ids_lookup = compute_lookup(view(frame_table.pc));
+
+        write_frame_table(out, frame_table);
+        write_type_data(out, output_type_data(strtab, resolve_type_data(type_data, types)));
+        write_stack_table(out, output_stack_table());
+        write_call_graph(out, output_call_graph(graph, pc_ids_lookup));
+    }
+    write_peak(out, output_peak(peak, compute_lookup(view(type_data))));
+    write_module_table(out, output_module_table(strtab, modules));
+    out.write_strtab(strtab.strtab);
+}
+} // namespace mp
@@ -1,52 +1,412 @@
 #include <mem_profile/containers.h>
 #include <mem_profile/output_record.h>
+#include <mem_profile/output_record_io.h>
 #include <mp_hook_prelude.h>
 
 #include <dlfcn.h>
+#include <exception>
+#include <mem_profile/env.h>
+#include <mem_profile/symbol_cache.h>
 #include <span>
+#include <thread>
 
 namespace mp {
-template <class T>
-auto compute_lookup(view<T> values) -> map<T, size_t> {
-    auto lookup = map<T, size_t>(values.size() * 2);
+namespace {
+/// Symbolization results for a range of program counters
+struct symbolized_pcs {
+    std::vector<cpptrace::object_frame>     object_frames;
+    std::vector<cpptrace::stacktrace_frame> stack_frames;
+    std::vector<Dl_info>                    dl_info;
+    /// 1 if the frames for a program counter came from the symbol cache
+    std::vector<u8>                         cached;
+
+    void append(symbolized_pcs&& other) {
+        auto move_append = [](auto& dst, auto& src) {
+            dst.insert(dst.end(),
+                       std::make_move_iterator(src.begin()),
+                       std::make_move_iterator(src.end()));
+        };
+        move_append(object_frames, other.object_frames);
+        move_append(stack_frames, other.stack_frames);
+        move_append(dl_info, other.dl_info);
+        move_append(cached, other.cached);
+    }
+};
+
+auto symbolize(view<addr_t> pcs, module_index const& index, symbol_cache const& cache)
+    -> symbolized_pcs {
+    auto result = symbolized_pcs{
+        std::vector<cpptrace::object_frame>(pcs.size()),
+        {},
+        std::vector<Dl_info>(pcs.size()),
+        std::vector<u8>(pcs.size()),
+    };
+
+    // The cache is checked before anything is resolved, and only misses are
+    // resolved with cpptrace
+    auto cached_frames = std::vector<cpptrace::stacktrace_frame>();
+    auto cached_end    = std::vector<size_t>(pcs.size());
+    auto misses        = std::vector<addr_t>();
+    for (size_t i = 0; i < pcs.size(); i++) {
+        result.cached[i] = cache.lookup(pcs[i], cached_frames);
+        cached_end[i]    = cached_frames.size();
+        if (!result.cached[i]) misses.push_back(pcs[i]);
+    }
+
+    // Object frames come from the index rather than cpptrace, which would
+    // call dladdr and re-read each object's headers for every pc
+    for (size_t i = 0; i < pcs.size(); i++) {
+        if (!index.lookup(pcs[i], result.dl_info[i])) {
+            result.dl_info[i] = {nullptr, nullptr, nullptr, nullptr};
+        }
+        char const* path           = nullptr;
+        addr_t      object_address = 0;
+        if (index.object(pcs[i], path, object_address)) {
+            result.object_frames[i] = cpptrace::object_frame{pcs[i], object_address, path};
+        } else {
+            result.object_frames[i] = cpptrace::object_frame{pcs[i], 0, {}};
+        }
+    }
+
+    auto resolved = cpptrace::raw_trace{std::move(misses)}.resolve().frames;
+
+    // Each program counter has zero or more inline frames, followed by
+    // exactly one non-inline frame
+    auto& frames = result.stack_frames;
+    frames.reserve(cached_frames.size() + resolved.size());
+    for (size_t i = 0, c = 0, r = 0; i < pcs.size(); i++) {
+        if (result.cached[i]) {
+            for (; c < cached_end[i]; c++) {
+                frames.push_back(std::move(cached_frames[c]));
+            }
+        } else {
+            while (r < resolved.size()) {
+                bool is_inline = resolved[r].is_inline;
+                frames.push_back(std::move(resolved[r++]));
+                if (!is_inline) break;
+            }
+        }
+    }
+    return result;
+}
+
+/// Number of threads used to symbolize the given number of program counters
+size_t symbolize_thread_count(size_t pc_count) {
+    size_t max_threads = mem_profile_symbolize_threads();
+    if (max_threads == 0) {
+        max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    return std::clamp<size_t>(pc_count / MIN_PCS_PER_THREAD, 1, max_threads);
+}
+} // namespace
+
+auto resolve_frames(string_table& strtab, std::vector<addr_t> pcs, view<module_info> modules)
+    -> output_frame_table {
+    auto index = module_index();
+    auto cache = symbol_cache(modules);
+
+    // The pcs are split into contiguous shards, which are symbolized in
+    // parallel. Symbolizing a pc doesn't depend on any other pc, and the
+    // results are concatenated in order before anything is added to the
+    // string table, so the output doesn't depend on the number of threads.
+    size_t shard_count = symbolize_thread_count(pcs.size());
+    size_t shard_size  = (pcs.size() + shard_count - 1) / shard_count;
+
+    auto shards = std::vector<symbolized_pcs>(shard_count);
+    auto errors = std::vector<std::exception_ptr>(shard_count);
+    auto run    = [&](size_t i) {
+        try {
+            size_t begin = std::min(i * shard_size, pcs.size());
+            size_t end   = std::min(begin + shard_size, pcs.size());
+            auto   shard = view<addr_t>(pcs.data() + begin, end - begin);
+            shards[i]    = symbolize(shard, index, cache);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    {
+        auto threads = std::vector<std::jthread>();
+        for (size_t i = 1; i < shard_count; i++) {
+            threads.emplace_back(run, i);
+        }
+        run(0);
+    }
+
+    for (auto const& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+
+    auto frames = std::move(shards[0]);
+    for (size_t i = 1; i < shard_count; i++) {
+        frames.append(std::move(shards[i]));
+    }
+
+    // Anything that had to be resolved is added to the cache for next time
+    for (size_t i = 0, f = 0; i < pcs.size(); i++) {
+        size_t begin = f;
+        while (f < frames.stack_frames.size() && frames.stack_frames[f++].is_inline) {}
+        if (!frames.cached[i]) {
+            auto const* first = frames.stack_frames.data() + begin;
+            cache.insert(pcs[i], view<cpptrace::stacktrace_frame>(first, f - begin));
+        }
+    }
+    cache.save();
+
+    return output_frame_table(strtab,
+                              std::move(pcs),
+                              frames.object_frames,
+                              frames.stack_frames,
+                              frames.dl_info);
+}
 
-    for (size_t i = 0; i < values.size(); i++) {
-        lookup[values[i]] = i;
+auto make_frame_table(string_table& strtab, std::vector<addr_t> pcs, view<module_info> modules)
+    -> output_frame_table {
+    if (std::string_view(mem_profile_symbolize()) == "deferred") {
+        return output_frame_table(std::move(pcs));
     }
+    return resolve_frames(strtab, std::move(pcs), modules);
+}
 
-    return lookup;
+auto compute_node_pc_ids(stack_trie const& stacks, view<addr_t> pcs) -> std::vector<u32> {
+    auto pc_ids_lookup = compute_lookup(pcs);
+    auto node_pc_ids   = std::vector<u32>(stacks.size());
+    for (size_t i = 1; i < stacks.size(); i++) {
+        node_pc_ids[i] = u32(pc_ids_lookup.at(stacks[stack_id_t(i)].pc));
+    }
+    return node_pc_ids;
 }
 
-output_record make_output_record(alloc_counter const& source, sv_store& store) {
-    auto const& events = source.events();
+auto compute_node_stack_ids(view<stack_id_t> ids, size_t node_count) -> std::vector<u32> {
+    auto node_stack_ids = std::vector<u32>(node_count);
+    for (size_t i = 0; i < ids.size(); i++) {
+        node_stack_ids[ids[i]] = u32(i);
+    }
+    return node_stack_ids;
+}
 
-    auto type_data = collect_type_data(events);
+auto collect_stacks(spool_reader const& spool, view<_vec<stack_id_t>> remaps, size_t node_count)
+    -> std::vector<stack_id_t> {
+    // The trie is dense, so a bitmap is cheaper than hashing every event
+    auto used = std::vector<bool>(node_count);
+    spool.for_each_record([&](spool_record const& rec) {
+        used[remaps[rec.thread][rec.event->stack_id]] = true;
+    });
 
-    auto raw_trace = cpptrace::raw_trace{collect_pcs(events)};
+    auto ids = std::vector<stack_id_t>();
+    for (size_t i = 0; i < node_count; i++) {
+        if (used[i]) ids.push_back(stack_id_t(i));
+    }
+    return ids;
+}
 
-    auto object_trace     = raw_trace.resolve_object_trace();
-    auto stack_trace      = raw_trace.resolve();
-    auto pc_ids_lookup    = compute_lookup(view(raw_trace.frames));
+namespace {
+void write_strtab(json_writer& out, view<std::string_view> strtab) {
+    out.put('[');
+    for (size_t i = 0; i < strtab.size(); i++) {
+        if (i != 0) out.put(',');
+        out.string(strtab[i]);
+    }
+    out.put(']');
+}
+
+/// Write the event table. The objects found on each event's call stack are
+/// added to `objects`, which is written as its own table afterwards.
+void write_events(json_writer&                  out,
+                  output_object_table&          objects,
+                  spool_reader const&           spool,
+                  view<_vec<stack_id_t>>        remaps,
+                  view<u32>                     node_stack_ids,
+                  map<type_id_t, size_t> const& type_data_lookup) {
+    out.put('[');
+    for_each_report_event(spool, remaps, [&](report_event const& e) {
+        if (e.id != 0) out.put(',');
+        out.put('{');
+        out.key("id", true);
+        out.number(e.id);
+        out.key("type");
+        out.string(event_type_name(e.type));
+        out.key("alloc_size");
+        out.number(e.alloc_size);
+        out.key("alloc_addr");
+        out.number(e.alloc_addr);
+        out.key("alloc_hint");
+        out.number(e.alloc_hint);
+        out.key("weight");
+        out.number(e.weight);
+        out.key("stack_id");
+        out.number(node_stack_ids[e.stack_id]);
+        out.key("origin_id");
+        out.number(e.origin_id);
+        out.put('}');
+
+        objects.append(e.objects, type_data_lookup);
+    });
+    out.put(']');
+}
+} // namespace
+
+void write_event_report(json_writer&               out,
+                        spool_reader const&        spool,
+                        stack_trie const&          stacks,
+                        view<_vec<stack_id_t>>     remaps,
+                        view<module_info>          modules,
+                        view<_mp_type_data const*> types,
+                        sv_store&                  store) {
+    string_table strtab{store};
+
+    auto type_data        = collect_type_data(spool, types);
     auto type_data_lookup = compute_lookup(view(type_data));
+    auto stack_ids        = collect_stacks(spool, remaps, stacks.size());
+    auto node_stack_ids   = compute_node_stack_ids(stack_ids, stacks.size());
+
+    out.put('{');
+    {
+        // The frame, type, and stack tables are only needed until they're written
+        auto frame_table = make_frame_table(strtab, collect_pcs(stacks), modules);
+        auto node_pc_ids = compute_node_pc_ids(stacks, frame_table.pc);
+
+        out.key("frame_table", true);
+        out.value(frame_table);
+        out.key("type_data_table");
+        out.value(output_type_data(strtab, resolve_type_data(type_data, types)));
+        out.key("stack_table");
+        out.value(output_stack_table(stacks, stack_ids, node_pc_ids));
+    }
+    {
+        auto objects = output_object_table();
+        out.key("event_table");
+        write_events(out, objects, spool, remaps, node_stack_ids, type_data_lookup);
+        out.key("object_table");
+        out.value(objects);
+    }
+    out.key("call_graph");
+    out.value(output_call_graph());
+    out.key("peak");
+    out.value(output_peak());
+    out.key("module_table");
+    out.value(output_module_table(strtab, modules));
+    out.key("strtab");
+    write_strtab(out, strtab.strtab);
+    out.put('}');
+}
 
+void write_call_graph_report(json_writer&               out,
+                             call_graph const&          graph,
+                             live_snapshot const&       peak,
+                             view<module_info>          modules,
+                             view<_mp_type_data const*> types,
+                             sv_store&                  store) {
     string_table strtab{store};
 
-    return output_record{
-        output_frame_table(strtab,
-                           std::move(raw_trace.frames),
-                           object_trace.frames,
-                           stack_trace.frames),
-        output_type_data(strtab, type_data),
-        compute_output_events(strtab, events, pc_ids_lookup, type_data_lookup),
-        std::move(strtab.strtab),
-    };
+    auto type_data = collect_type_data(peak, types);
+
+    out.put('{');
+    {
+        auto frame_table   = make_frame_table(strtab, collect_pcs(graph.paths()), modules);
+        auto pc_ids_lookup = compute_lookup(view(frame_table.pc));
+
+        out.key("frame_table", true);
+        out.value(frame_table);
+        out.key("type_data_table");
+        out.value(output_type_data(strtab, resolve_type_data(type_data, types)));
+        out.key("stack_table");
+        out.value(output_stack_table());
+        out.key("event_table");
+        out.raw("[]");
+        out.key("object_table");
+        out.value(output_object_table());
+        out.key("call_graph");
+        out.value(output_call_graph(graph, pc_ids_lookup));
+    }
+    out.key("peak");
+    out.value(output_peak(peak, compute_lookup(view(type_data))));
+    out.key("module_table");
+    out.value(output_module_table(strtab, modules));
+    out.key("strtab");
+    write_strtab(out, strtab.strtab);
+    out.put('}');
+}
+
+auto event_type_name(event_type type) -> std::string_view {
+    switch (type) {
+    case event_type::FREE:    return "FREE";
+    case event_type::ALLOC:   return "ALLOC";
+    case event_type::REALLOC: return "REALLOC";
+    }
+    return "<unknown>";
+}
+
+
+output_call_graph::output_call_graph(call_graph const&          graph,
+                                     map<addr_t, size_t> const& pc_ids_lookup)
+  : parent(graph.num_nodes())
+  , pc_id(graph.num_nodes())
+  , num_bytes(graph.num_nodes())
+  , num_allocs(graph.num_nodes()) {
+    auto const& paths = graph.paths();
+    for (size_t i = 0; i < parent.size(); i++) {
+        auto const& node = paths[stack_id_t(i)];
+        auto        c    = graph.count(stack_id_t(i));
+
+        parent[i]     = node.parent;
+        pc_id[i]      = i == 0 ? 0 : pc_ids_lookup.at(node.pc);
+        num_bytes[i]  = c.num_bytes;
+        num_allocs[i] = c.num_allocs;
+    }
+}
+
+
+void output_object_table::append(view<spool_object>            objects,
+                                 map<type_id_t, size_t> const& type_data_lookup) {
+    for (auto const& obj : objects) {
+        auto it = type_data_lookup.find(obj.type);
+        if (it == type_data_lookup.end()) continue;
+
+        trace_index.push_back(obj.trace_index);
+        object_id.push_back(obj.event_id);
+        addr.push_back(obj.object_ptr);
+        type_data.push_back(it->second);
+    }
+    object_off.push_back(trace_index.size());
+}
+
+
+output_stack_table::output_stack_table(stack_trie const& stacks,
+                                       view<stack_id_t>  ids,
+                                       view<u32>         node_pc_ids) {
+    stack_offsets.reserve(ids.size() + 1);
+    for (stack_id_t leaf : ids) {
+        for (stack_id_t id = leaf; id != 0; id = stacks[id].parent) {
+            stack_pcs.push_back(node_pc_ids[id]);
+        }
+        stack_offsets.push_back(stack_pcs.size());
+    }
+}
+
+
+output_module_table::output_module_table(string_table& strtab, view<module_info> modules)
+  : path(modules.size())
+  , build_id(modules.size())
+  , load_base(modules.size())
+  , begin(modules.size())
+  , end(modules.size()) {
+    for (size_t i = 0; i < modules.size(); i++) {
+        auto const& m = modules[i];
+        path[i]       = strtab.insert(std::string_view(m.path));
+        build_id[i]   = strtab.insert(std::string_view(m.build_id));
+        load_base[i]  = m.load_base;
+        begin[i]      = m.begin;
+        end[i]        = m.end;
+    }
 }
 
 
 output_frame_table::output_frame_table(string_table&                    strtab,
                                        std::vector<addr_t>              pcs,
                                        view<cpptrace::object_frame>     object_frames,
-                                       view<cpptrace::stacktrace_frame> stack_frames)
+                                       view<cpptrace::stacktrace_frame> stack_frames,
+                                       view<Dl_info>                    dl_info)
   : pc(std::move(pcs))
   , object_path(pc.size())
   , object_address(pc.size())
@@ -63,17 +423,17 @@ output_frame_table::output_frame_table(string_table&                    strtab,
                  object_frames.size(),
                  "Expected 1-to-1 relation between object frames and program counters");
 
-    std::vector<Dl_info> dl_info(pc.size());
+    MP_ASSERT_EQ(pc.size(),
+                 dl_info.size(),
+                 "Expected 1-to-1 relation between dladdr results and program counters");
 
     for (size_t i = 0; i < pc.size(); i++) {
-        auto& info = dl_info[i];
-        if (dladdr((const void*)pc[i], &info)) {
+        auto const& info = dl_info[i];
+        if (info.dli_fname) {
             object_path[i]    = strtab.insert_cstr(info.dli_fname);
             object_address[i] = pc[i] - uintptr_t(info.dli_fbase);
             object_symbol[i]  = strtab.insert_cstr(info.dli_sname);
         } else {
-            info = {nullptr, nullptr, nullptr, nullptr};
-
             object_path[i]    = strtab.insert(object_frames[i].object_path);
             object_address[i] = object_frames[i].object_address;
             object_symbol[i]  = strtab.insert_cstr("");
@@ -109,78 +469,6 @@ output_frame_table::output_frame_table(string_table&                    strtab,
 }
 
 
-auto compute_output_events(string_table&                            strtab,
-                           view<event_record>                       events,
-                           map<addr_t, size_t> const&               pc_ids_lookup,
-                           map<_mp_type_data const*, size_t> const& type_data_lookup)
-    -> std::vector<output_event> {
-    size_t events_size    = events.size();
-    auto   output_events  = std::vector<output_event>(events_size);
-    auto   event_ordering = compute_event_ordering(events);
-
-    for (size_t i = 0; i < events_size; i++) {
-        // Ensure that events are sequenced
-        auto const& e = events[event_ordering[i]];
-
-        std::vector<size_t> pc_ids(e.trace.size());
-        for (size_t i = 0; i < e.trace.size(); i++) {
-            pc_ids[i] = pc_ids_lookup.at(e.trace[i]);
-        }
-
-        output_events[i] = output_event{
-            e.id,
-            e.type,
-            e.alloc_size,
-            uintptr_t(e.alloc_ptr),
-            uintptr_t(e.alloc_hint),
-            std::move(pc_ids),
-        };
-        if (!e.object_trace.empty()) {
-            output_events[i].object_info
-                = output_object_info(strtab, e.object_trace, type_data_lookup);
-        }
-    }
-
-    compute_free_sizes(output_events);
-
-    return output_events;
-}
-
-
-
-auto compute_event_ordering(view<event_record> events) -> std::vector<size_t> {
-    std::vector<size_t> event_ordering(events.size());
-    for (size_t i = 0; i < events.size(); i++) {
-        event_ordering[i] = i;
-    }
-    std::sort(event_ordering.begin(), event_ordering.end(), [&](size_t i, size_t j) -> bool {
-        return events[i].id < events[j].id;
-    });
-    return event_ordering;
-}
-
-
-void compute_free_sizes(std::vector<output_event>& output_events) {
-    MP_ASSERT_EQ(is_events_sorted(output_events),
-                 true,
-                 "Expected events to be ordered by event id by this stage");
-
-    // Because events are ordered by event id, that means that every
-    // free is sequenced after it's corresponding allocation. So we can
-    // record the sizes of all frees by running through all of the events
-
-    auto alloc_sizes = map<addr_t, size_t>(output_events.size());
-
-    for (auto& event : output_events) {
-        auto& saved_size = alloc_sizes[event.alloc_addr];
-        if (event.type != event_type::FREE) {
-            saved_size = event.alloc_size; // Save the size if it's an allocation
-        } else {
-            event.alloc_size = saved_size; // Use the saved size if it's a free
-        }
-    }
-}
-
 void run_sanity_check_on_frames(size_t pc_count, view<cpptrace::stacktrace_frame> frames) {
     size_t non_inline_frame_count = 0;
     for (auto const& frame : frames) {
@@ -191,19 +479,13 @@ void run_sanity_check_on_frames(size_t pc_count, view<cpptrace::stacktrace_frame
                  pc_count,
                  "The number of non_inline frames must match the number of program counters");
 }
-bool is_events_sorted(view<output_event> events) {
-    return std::is_sorted(
-        events.begin(),
-        events.end(),
-        [](output_event const& rhs, output_event const& lhs) { return rhs.id < lhs.id; });
-}
 
 
-
-std::vector<addr_t> collect_pcs(view<event_record> events) {
+std::vector<addr_t> collect_pcs(stack_trie const& stacks) {
     ankerl::unordered_dense::set<addr_t> pc_set;
-    for (auto const& event : events) {
-        pc_set.insert(event.trace.begin(), event.trace.end());
+    // Node 0 is the root, which has no program counter
+    for (size_t i = 1; i < stacks.size(); i++) {
+        pc_set.insert(stacks[stack_id_t(i)].pc);
     }
     std::vector<addr_t> pcs(pc_set.begin(), pc_set.end());
     std::sort(pcs.data(), pcs.data() + pcs.size());
@@ -211,41 +493,62 @@ std::vector<addr_t> collect_pcs(view<event_record> events) {
 }
 
 
-auto collect_type_data(view<event_record> events) -> std::vector<_mp_type_data const*> {
-    set<_mp_type_data const*> type_data;
+namespace {
+/// true if `types` holds a descriptor for the type
+bool has_type_data(type_id_t id, view<_mp_type_data const*> types) {
+    return id != 0 && id <= types.size() && types[id - 1] != nullptr;
+}
+} // namespace
+
+auto collect_type_data(spool_reader const& spool, view<_mp_type_data const*> types)
+    -> std::vector<type_id_t> {
+    set<type_id_t> type_data;
     type_data.max_load_factor(0.5);
 
-    for (auto const& e : events) {
-        for (auto const& obj : e.object_trace) {
-            type_data.insert(obj.type_data);
+    spool.for_each_record([&](spool_record const& rec) {
+        for (u32 i = 0; i < rec.event->object_count; i++) {
+            type_id_t id = rec.objects[i].type;
+            if (has_type_data(id, types)) type_data.insert(id);
         }
-    }
+    });
+
+    std::vector<type_id_t> values(type_data.begin(), type_data.end());
+    // Types in the same module have consecutive ids, so sorting keeps their
+    // descriptors together when we access them later
+    std::sort(values.begin(), values.end());
+    return values;
+}
 
-    std::vector<_mp_type_data const*> values(type_data.begin(), type_data.end());
-    // Sorting it now will help enable better cache locality when we access it later
+auto collect_type_data(live_snapshot const& peak, view<_mp_type_data const*> types)
+    -> std::vector<type_id_t> {
+    std::vector<type_id_t> values;
+    for (auto const& [type, count] : peak.by_type) {
+        if (has_type_data(type, types)) values.push_back(type);
+    }
     std::sort(values.begin(), values.end());
     return values;
 }
 
+auto resolve_type_data(view<type_id_t> ids, view<_mp_type_data const*> types)
+    -> std::vector<_mp_type_data const*> {
+    auto values = std::vector<_mp_type_data const*>(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        values[i] = types[ids[i] - 1];
+    }
+    return values;
+}
+
 
-output_object_info::output_object_info(string_table&                            strtab,
-                                       view<event_info>                         object_trace,
-                                       map<_mp_type_data const*, size_t> const& type_data_lookup)
-  : trace_index(object_trace.size())
-  , object_id(object_trace.size())
-  , addr(object_trace.size())
-  , size(object_trace.size())
-  , type(object_trace.size())
-  , type_data(object_trace.size()) {
-    size_t i = 0;
-    for (auto const& event : object_trace) {
-        trace_index[i] = event.trace_index;
-        object_id[i]   = event.event_id;
-        addr[i]        = event.object_ptr;
-        size[i]        = event.type_data->size;
-        type[i]        = strtab.insert_cstr(event.type_data->type);
-        type_data[i]   = type_data_lookup.at(event.type_data);
-        ++i;
+output_peak::output_peak(live_snapshot const& peak, map<type_id_t, size_t> const& type_data_lookup)
+  : max_bytes(peak.max_bytes)
+  , num_bytes(peak.live.num_bytes)
+  , num_allocs(peak.live.num_allocs) {
+    for (auto const& [type, count] : peak.by_type) {
+        auto it = type_data_lookup.find(type);
+        if (it == type_data_lookup.end()) continue;
+        type_data.push_back(it->second);
+        type_bytes.push_back(count.num_bytes);
+        type_allocs.push_back(count.num_allocs);
     }
 }
 
@@ -3,11 +3,18 @@
 #include <algorithm>
 #include <ankerl/unordered_dense.h>
 #include <cpptrace/cpptrace.hpp>
+#include <dlfcn.h>
 #include <fmt/format.h>
 #include <glaze/glaze.hpp>
 #include <mem_profile/allocator.h>
 #include <mem_profile/containers.h>
 #include <mem_profile/counters.h>
+#include <mem_profile/json_writer.h>
+#include <mem_profile/module_map.h>
+#include <mem_profile/peak.h>
+#include <mem_profile/spool.h>
+#include <mp_format/mpb_writer.h>
+#include <mem_profile/stack_trie.h>
 #include <mp_error/error.h>
 #include <mp_types/types.h>
 #include <span>
@@ -15,15 +22,6 @@
 
 
 namespace mp {
-template <class T>
-struct view : std::span<T const> {
-    using std::span<T const>::span;
-};
-
-template <class Range>
-view(Range const&)->view<typename Range::value_type>;
-
-
 inline std::string_view _safe_sv(char const* cstr) {
     if (cstr == nullptr) {
         return std::string_view();
@@ -33,6 +31,18 @@ inline std::string_view _safe_sv(char const* cstr) {
 using ankerl::unordered_dense::map;
 using ankerl::unordered_dense::set;
 
+/// Map each value to its index
+template <class T>
+auto compute_lookup(view<T> values) -> map<T, size_t> {
+    auto lookup = map<T, size_t>(values.size() * 2);
+
+    for (size_t i = 0; i < values.size(); i++) {
+        lookup[values[i]] = i;
+    }
+
+    return lookup;
+}
+
 struct string_table {
     sv_store& store;
 
@@ -93,37 +103,39 @@ struct string_table {
 };
 
 
-struct output_object_info {
-    // Index into event stacktrace
-    std::vector<size_t>      trace_index;
-    // id of object being destroyed (unique over lifetime of program)
-    std::vector<u64>         object_id;
-    // address of the object at time of destruction(`this` pointer)
-    std::vector<addr_t>      addr;
-    // size of object being destroyed
-    std::vector<size_t>      size;
-    /// Index into string table - name of the object's type
-    std::vector<str_index_t> type;
-
+/// Objects found on the call stacks of events, in CSR layout. Each column other
+/// than `object_off` holds one entry per object, for every event in order.
+///
+/// An object's size and typename are those of its entry in the type data table.
+struct output_object_table {
+    /// The objects of the i-th event span `object_off[i]..object_off[i + 1]`
+    std::vector<size_t> object_off{0};
+    /// Index into the event's call stack
+    std::vector<size_t> trace_index;
+    /// id of the object (unique over lifetime of program)
+    std::vector<u64>    object_id;
+    /// Address of the object at the time of the event (`this` pointer)
+    std::vector<addr_t> addr;
     /// Index into type data table
     std::vector<size_t> type_data;
 
-    output_object_info(string_table&                            strtab,
-                       view<event_info>                         object_trace,
-                       map<_mp_type_data const*, size_t> const& type_data_lookup);
+    /// Add the objects of the next event. Objects whose type isn't in the
+    /// lookup (see collect_type_data) are left out
+    void append(view<spool_object>                objects,
+                map<type_id_t, size_t> const& type_data_lookup);
 };
 
 
 struct output_event {
-    /// A unique 64-bit stamp that can be used to order events
-    /// chronologically. Also uniquely identifies an event.
-    /// The first event should have an id of 0
+    /// Position of the event in the chronological order of all events. Also
+    /// uniquely identifies an event. The first event has an id of 0
     u64 id;
 
     /// Event type
     event_type type;
 
-    /// Size of allocation (if applicable, 0 for free)
+    /// Size of allocation. For a free, this is the size of the allocation it
+    /// releases (or 0, if the allocation wasn't recorded)
     size_t alloc_size;
 
     /// Allocated pointer (or pointer passed  to free)
@@ -132,10 +144,18 @@ struct output_event {
     /// Pointer passed as input (eg to realloc())
     u64 alloc_hint;
 
-    // Call stack, expressed as a vector of program counter ids
-    std::vector<size_t> pc_id;
+    /// Number of events this event stands for. 1 unless sampling is enabled.
+    /// Byte and event totals should be scaled by this weight.
+    float weight;
+
+    /// Index of the event's call stack in the stack table
+    size_t stack_id;
 
-    std::optional<output_object_info> object_info;
+    /// id of the event which allocated the memory this event releases. Only
+    /// frees release anything (a realloc is recorded as a free of its hint,
+    /// followed by an allocation). Equal to `id` if the event doesn't release
+    /// anything, or if that allocation wasn't recorded.
+    u64 origin_id;
 };
 
 
@@ -176,6 +196,7 @@ struct output_type_data {
     std::vector<size_t>      base_sizes;
     std::vector<size_t>      base_offsets;
 
+    output_type_data() = default;
     output_type_data(string_table& strtab, view<_mp_type_data const*> type_data);
 };
 
@@ -190,7 +211,7 @@ struct output_frame_table {
     /// Address within the object
     std::vector<addr_t> object_address;
 
-    /// Symbol name within the object (value returned by dladdr)
+    /// Symbol name within the object (as dladdr would return it)
     std::vector<str_index_t> object_symbol;
 
 
@@ -228,14 +249,114 @@ struct output_frame_table {
     size_t frame_count(size_t i) { return offsets[i + 1] - offsets[i]; }
 
     output_frame_table() = default;
-    output_frame_table(string_table&                               strtab,
-                       std::vector<addr_t>                         pcs,
+
+    /// Frame table which only holds program counters, for deferred
+    /// symbolization. Every other column is empty.
+    explicit output_frame_table(std::vector<addr_t> pcs) : pc(std::move(pcs)) {}
+
+    /// true if the program counters have been symbolized
+    bool is_symbolized() const noexcept { return offsets.size() == pc.size() + 1; }
+    /// Build the frame table from the symbolized program counters.
+    /// `dl_info[i]` describes the module and symbol containing `pcs[i]`, as
+    /// returned by dladdr or module_index (or nulls, if it wasn't found)
+    output_frame_table(string_table&                    strtab,
+                       std::vector<addr_t>              pcs,
                        view<cpptrace::object_frame>     object_frames,
-                       view<cpptrace::stacktrace_frame> stack_frames);
+                       view<cpptrace::stacktrace_frame> stack_frames,
+                       view<Dl_info>                    dl_info);
+};
+
+
+
+/// Distinct call stacks of every event, in CSR layout. Events refer to their
+/// stack by index, so each stack is only written once.
+struct output_stack_table {
+    /// The stack with index i spans `stack_pcs[stack_offsets[i]..stack_offsets[i + 1]]`
+    std::vector<size_t> stack_offsets{0};
+
+    /// Program counter ids of every stack, innermost call first
+    std::vector<size_t> stack_pcs;
+
+    output_stack_table() = default;
+
+    /// Build the table from the given nodes of the trie, in order.
+    /// `node_pc_ids` comes from compute_node_pc_ids.
+    output_stack_table(stack_trie const& stacks, view<stack_id_t> ids, view<u32> node_pc_ids);
+};
+
+
+/// Calling-context tree recorded in aggregate mode.
+///
+/// Node 0 is the root (an empty call stack). Every other node i is a call to
+/// `pc_id[i]` made from the call path `parent[i]`, and counts the allocations
+/// made with exactly that call path. Parents always come before their
+/// children.
+struct output_call_graph {
+    /// Index of the calling node
+    std::vector<u32>    parent;
+    /// Program counter id of the call (unused for the root)
+    std::vector<size_t> pc_id;
+    /// Number of bytes allocated with exactly this call path
+    std::vector<u64>    num_bytes;
+    /// Number of allocations made with exactly this call path
+    std::vector<u64>    num_allocs;
+
+    output_call_graph() = default;
+    output_call_graph(call_graph const& graph, map<addr_t, size_t> const& pc_ids_lookup);
 };
 
 
+/// Heap usage at its peak, recorded in peak mode. In that case, the call graph
+/// counts the allocations which were live when the snapshot was taken, rather
+/// than every allocation.
+///
+/// Live allocations are also grouped by the type of the innermost object on
+/// the call stack when they were made. Allocations made with no object on the
+/// stack aren't in the type columns, so they account for the difference
+/// between `num_bytes` and the sum of `type_bytes`.
+struct output_peak {
+    /// Highest number of live bytes seen while the program ran
+    u64 max_bytes  = 0;
+    /// Live bytes and allocations when the snapshot was taken. This is within
+    /// MEM_PROFILE_PEAK_RATIO of `max_bytes`
+    u64 num_bytes  = 0;
+    u64 num_allocs = 0;
+
+    /// Index of each type in the type data table
+    std::vector<size_t> type_data;
+    /// Live bytes and allocations attributed to each type
+    std::vector<u64>    type_bytes;
+    std::vector<u64>    type_allocs;
+
+    output_peak() = default;
+    output_peak(live_snapshot const& peak, map<type_id_t, size_t> const& type_data_lookup);
+};
 
+
+/// Modules (the executable, and shared libraries) which were loaded while the
+/// program ran. Used to symbolize program counters after the program exits.
+struct output_module_table {
+    /// Path to the object file (index into strtab)
+    std::vector<str_index_t> path;
+    /// GNU build-id of the object file as a hex string (index into strtab)
+    std::vector<str_index_t> build_id;
+    /// Difference between addresses in the object file and addresses in memory
+    std::vector<addr_t>      load_base;
+    /// Range of addresses occupied by the module: begin[i]..end[i]
+    std::vector<addr_t>      begin;
+    std::vector<addr_t>      end;
+
+    output_module_table() = default;
+    output_module_table(string_table& strtab, view<module_info> modules);
+};
+
+
+/// Layout of a report.
+///
+/// The runtime never builds an output_record: reports are streamed to the
+/// output file section by section, in the order of the fields below (see
+/// write_event_report). This type describes the result, so that a report can
+/// be read back with glaze.
 struct output_record {
     /// Holds entries in the stacktrace.
     output_frame_table frame_table;
@@ -243,11 +364,27 @@ struct output_record {
     /// Holds type information: type names, type sizes, fields, etc
     output_type_data type_data_table;
 
+    /// Call stacks of the events in the event table
+    output_stack_table stack_table;
+
     /// Vector of events
     std::vector<output_event> event_table;
 
+    /// Objects found on the call stack of each event in the event table
+    output_object_table object_table;
+
+    /// Calling-context tree. Only populated in aggregate and peak mode, in
+    /// which case the event table is empty
+    output_call_graph call_graph;
+
+    /// Snapshot of heap usage at its peak. Only populated in peak mode
+    output_peak peak;
+
+    /// Modules loaded while the program ran
+    output_module_table module_table;
+
     /// String table
-    std::vector<std::string_view> strtab;
+    std::vector<std::string> strtab;
 };
 
 /// Sanity check: we expect that the number of non-inline frames should match
@@ -255,28 +392,185 @@ struct output_record {
 auto run_sanity_check_on_frames(size_t pc_count, view<cpptrace::stacktrace_frame> frames)
     -> void;
 
-/// Given an event_record, compute an ordering that sequences the event record,
-/// such that events are ordered by their id.
-auto compute_event_ordering(view<event_record> events) -> std::vector<size_t>;
+/// Computes a sorted list of all program counters that appear in the given stacks.
+/// This is linear in the number of unique stacks, rather than the number of events.
+auto collect_pcs(stack_trie const& stacks) -> std::vector<addr_t>;
+
+/// Computes a sorted list of the ids of all the types of objects found on the
+/// call stack of any event in the spool. `types[id - 1]` is the descriptor of
+/// each type (see type_registry::snapshot). Ids without a descriptor (including
+/// 0) are left out.
+auto collect_type_data(spool_reader const& spool, view<_mp_type_data const*> types)
+    -> std::vector<type_id_t>;
+
+/// Computes a sorted list of the ids of the types that live allocations were
+/// grouped by in a peak snapshot. Ids without a descriptor (including 0) are
+/// left out.
+auto collect_type_data(live_snapshot const& peak, view<_mp_type_data const*> types)
+    -> std::vector<type_id_t>;
+
+/// Get the descriptor of each of the given types, from the descriptors
+/// indexed by id - 1
+auto resolve_type_data(view<type_id_t> ids, view<_mp_type_data const*> types)
+    -> std::vector<_mp_type_data const*>;
+
+/// Program counters are only symbolized on another thread if there are at
+/// least this many for each thread
+constexpr size_t MIN_PCS_PER_THREAD = 512;
+
+/// Symbolize the given program counters, producing a frame table. The work is
+/// split across threads (see mem_profile_symbolize_threads). Frames found in
+/// the persistent symbol cache for `modules` aren't resolved again, and
+/// anything newly resolved is added to the cache.
+auto resolve_frames(string_table& strtab, std::vector<addr_t> pcs, view<module_info> modules)
+    -> output_frame_table;
+
+/// Produce the frame table for a report. Program counters are symbolized now,
+/// unless symbolization is deferred (see mem_profile_symbolize), in which case
+/// the table only holds the program counters.
+auto make_frame_table(string_table& strtab, std::vector<addr_t> pcs, view<module_info> modules)
+    -> output_frame_table;
+
+/// Compute the program counter id of the call made by each node in the trie,
+/// given the table of program counters. The pc ids of a stack can then be
+/// found by walking up the trie.
+auto compute_node_pc_ids(stack_trie const& stacks, view<addr_t> pcs) -> std::vector<u32>;
+
+/// Compute the index in the stack table of each node in the trie, given the
+/// nodes in the table (see collect_stacks). Nodes which aren't in the table
+/// map to 0.
+auto compute_node_stack_ids(view<stack_id_t> ids, size_t node_count) -> std::vector<u32>;
+
+/// Computes a sorted list of the call stacks of every event in the spool, as
+/// node ids in the merged trie (which has `node_count` nodes)
+auto collect_stacks(spool_reader const& spool, view<_vec<stack_id_t>> remaps, size_t node_count)
+    -> std::vector<stack_id_t>;
+
+/// An event read back from the spool, as it appears in a report
+struct report_event {
+    /// Position of the event in chronological order
+    u64              id;
+    event_type       type;
+    /// Size of the allocation. For a free, this is the size of the allocation
+    /// it releases (or 0, if the allocation wasn't recorded)
+    size_t           alloc_size;
+    u64              alloc_addr;
+    u64              alloc_hint;
+    float            weight;
+    /// Call stack of the event, in the merged stack trie
+    stack_id_t       stack_id;
+    view<spool_object> objects;
+    /// id of the event which made the allocation this event releases. Equal
+    /// to `id` if there is none (see output_event::origin_id)
+    u64              origin_id;
+};
+
+/// Identifies an event in the spool by the id it was recorded with, and the
+/// thread which recorded it
+struct spool_event_key {
+    u64 id;
+    u64 thread;
 
-// Check if the vector of output events is sorted
-auto is_events_sorted(view<output_event> events) -> bool;
+    bool operator==(spool_event_key const&) const = default;
+};
 
-/// Fill in the size of 'FREE' events, based on the size of the corresponding allocation
-auto compute_free_sizes(std::vector<output_event>& output_events) -> void;
+struct spool_event_key_hash {
+    using is_avalanching = void;
 
-auto compute_output_events(string_table&                            strtab,
-                           view<event_record>            events,
-                           map<addr_t, size_t> const&               pc_ids_lookup,
-                           map<_mp_type_data const*, size_t> const& type_data_lookup)
-    -> std::vector<output_event>;
+    u64 operator()(spool_event_key const& key) const noexcept {
+        return ankerl::unordered_dense::detail::wyhash::hash(&key, sizeof(key));
+    }
+};
 
-/// Computes a sorted list of all program counters that appear in the event records
-auto collect_pcs(view<event_record> events) -> std::vector<addr_t>;
+/// Invoke `func(report_event)` on each event in the spool, in chronological
+/// order. `remaps[thread]` maps the stack ids recorded by each thread to stack
+/// ids in the merged trie.
+template <class F>
+void for_each_report_event(spool_reader const& spool, view<_vec<stack_id_t>> remaps, F&& func) {
+    // Because events are visited in order, every free is sequenced after the
+    // allocation it releases. This maps each allocation which hasn't been
+    // released yet to its id in the output.
+    auto live = map<spool_event_key, u64, spool_event_key_hash>();
+
+    // Events are renumbered in order, so that ids in the output are dense
+    u64 id = 0;
+
+    spool.for_each_record_in_order([&](spool_record const& rec) {
+        auto const& e         = *rec.event;
+        auto        type      = event_type(e.type);
+        u64         origin_id = id;
+
+        // Sizes and origins are filled in when an event is recorded, so only
+        // the output ids need to be looked up
+        if (e.origin_id != 0) {
+            auto it = live.find(spool_event_key{e.origin_id, e.origin_thread});
+            if (it != live.end()) {
+                origin_id = it->second;
+                live.erase(it);
+            }
+        }
+        if (type != event_type::FREE) {
+            live.emplace(spool_event_key{e.id, rec.thread}, id);
+        }
 
-auto collect_type_data(view<event_record> events) -> std::vector<_mp_type_data const*>;
+        func(report_event{
+            id++,
+            type,
+            e.alloc_size,
+            e.alloc_ptr,
+            e.alloc_hint,
+            e.weight,
+            remaps[rec.thread][e.stack_id],
+            view<spool_object>(rec.objects, e.object_count),
+            origin_id,
+        });
+    });
+}
 
-/// Given the allocations that have occurred over the lifetime of the program,
-/// produce an `output_record` - a compact serializable representation of that data
-auto make_output_record(alloc_counter const& source, sv_store& store) -> output_record;
+/// Returns the name of an event type, as written to a report
+auto event_type_name(event_type type) -> std::string_view;
+
+/// Stream a report on the events in the spool to `out`.
+///
+/// `stacks` holds the call stack of every event, and `remaps[thread]` maps
+/// the stack ids recorded by each thread to stack ids in `stacks`. Events are
+/// visited in chronological order and written as they're read from the spool,
+/// so memory use is proportional to the number of unique stacks, types and
+/// live allocations, rather than the number of events. `modules` is written to
+/// the module table, so that the report can be symbolized later. `types` holds
+/// the descriptor of each type, indexed by id - 1 (see type_registry::snapshot).
+void write_event_report(json_writer&               out,
+                        spool_reader const&        spool,
+                        stack_trie const&          stacks,
+                        view<_vec<stack_id_t>>     remaps,
+                        view<module_info>          modules,
+                        view<_mp_type_data const*> types,
+                        sv_store&                  store);
+
+/// Stream a report on a calling-context tree recorded in aggregate or peak
+/// mode to `out`. `peak` is empty, except in peak mode.
+void write_call_graph_report(json_writer&               out,
+                             call_graph const&          graph,
+                             live_snapshot const&       peak,
+                             view<module_info>          modules,
+                             view<_mp_type_data const*> types,
+                             sv_store&                  store);
+
+/// Write a report on the events in the spool in the binary format (see
+/// mp_format/mpb.h). Events are streamed in blocks, as with the JSON report.
+void write_event_report(mpb::writer&               out,
+                        spool_reader const&        spool,
+                        stack_trie const&          stacks,
+                        view<_vec<stack_id_t>>     remaps,
+                        view<module_info>          modules,
+                        view<_mp_type_data const*> types,
+                        sv_store&                  store);
+
+/// Write a report on a calling-context tree in the binary format
+void write_call_graph_report(mpb::writer&               out,
+                             call_graph const&          graph,
+                             live_snapshot const&       peak,
+                             view<module_info>          modules,
+                             view<_mp_type_data const*> types,
+                             sv_store&                  store);
 } // namespace mp
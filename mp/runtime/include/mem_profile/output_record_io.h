@@ -10,16 +10,15 @@ template <> struct glz::meta<mp::event_type> {
     static constexpr auto value = enumerate(FREE, ALLOC, REALLOC);
 };
 
-template <> struct glz::meta<mp::output_object_info> {
-    using T                     = mp::output_object_info;
+template <> struct glz::meta<mp::output_object_table> {
+    using T                     = mp::output_object_table;
     constexpr static auto value = object(
         //
-        MP_GLZ_ENTRY(mp::output_object_info, trace_index),
-        MP_GLZ_ENTRY(mp::output_object_info, object_id),
-        MP_GLZ_ENTRY(mp::output_object_info, addr),
-        MP_GLZ_ENTRY(mp::output_object_info, size),
-        MP_GLZ_ENTRY(mp::output_object_info, type),
-        MP_GLZ_ENTRY(mp::output_object_info, type_data)
+        MP_GLZ_ENTRY(mp::output_object_table, object_off),
+        MP_GLZ_ENTRY(mp::output_object_table, trace_index),
+        MP_GLZ_ENTRY(mp::output_object_table, object_id),
+        MP_GLZ_ENTRY(mp::output_object_table, addr),
+        MP_GLZ_ENTRY(mp::output_object_table, type_data)
         //
     );
 };
@@ -33,8 +32,9 @@ template <> struct glz::meta<mp::output_event> {
         MP_GLZ_ENTRY(mp::output_event, alloc_size),
         MP_GLZ_ENTRY(mp::output_event, alloc_addr),
         MP_GLZ_ENTRY(mp::output_event, alloc_hint),
-        MP_GLZ_ENTRY(mp::output_event, pc_id),
-        MP_GLZ_ENTRY(mp::output_event, object_info)
+        MP_GLZ_ENTRY(mp::output_event, weight),
+        MP_GLZ_ENTRY(mp::output_event, stack_id),
+        MP_GLZ_ENTRY(mp::output_event, origin_id)
         //
     );
 };
@@ -78,13 +78,71 @@ template <> struct glz::meta<mp::output_frame_table> {
 };
 
 
+template <> struct glz::meta<mp::output_stack_table> {
+    using T                     = mp::output_stack_table;
+    constexpr static auto value = object(
+        //
+        MP_GLZ_ENTRY(mp::output_stack_table, stack_offsets),
+        MP_GLZ_ENTRY(mp::output_stack_table, stack_pcs)
+        //
+    );
+};
+
+
+template <> struct glz::meta<mp::output_call_graph> {
+    using T                     = mp::output_call_graph;
+    constexpr static auto value = object(
+        //
+        MP_GLZ_ENTRY(mp::output_call_graph, parent),
+        MP_GLZ_ENTRY(mp::output_call_graph, pc_id),
+        MP_GLZ_ENTRY(mp::output_call_graph, num_bytes),
+        MP_GLZ_ENTRY(mp::output_call_graph, num_allocs)
+        //
+    );
+};
+
+
+template <> struct glz::meta<mp::output_peak> {
+    using T                     = mp::output_peak;
+    constexpr static auto value = object(
+        //
+        MP_GLZ_ENTRY(mp::output_peak, max_bytes),
+        MP_GLZ_ENTRY(mp::output_peak, num_bytes),
+        MP_GLZ_ENTRY(mp::output_peak, num_allocs),
+        MP_GLZ_ENTRY(mp::output_peak, type_data),
+        MP_GLZ_ENTRY(mp::output_peak, type_bytes),
+        MP_GLZ_ENTRY(mp::output_peak, type_allocs)
+        //
+    );
+};
+
+
+template <> struct glz::meta<mp::output_module_table> {
+    using T                     = mp::output_module_table;
+    constexpr static auto value = object(
+        //
+        MP_GLZ_ENTRY(mp::output_module_table, path),
+        MP_GLZ_ENTRY(mp::output_module_table, build_id),
+        MP_GLZ_ENTRY(mp::output_module_table, load_base),
+        MP_GLZ_ENTRY(mp::output_module_table, begin),
+        MP_GLZ_ENTRY(mp::output_module_table, end)
+        //
+    );
+};
+
+
 template <> struct glz::meta<mp::output_record> {
     using T                     = mp::output_record;
     static constexpr auto value = glz::object(
         //
         MP_GLZ_ENTRY(mp::output_record, frame_table),
         MP_GLZ_ENTRY(mp::output_record, type_data_table),
+        MP_GLZ_ENTRY(mp::output_record, stack_table),
         MP_GLZ_ENTRY(mp::output_record, event_table),
+        MP_GLZ_ENTRY(mp::output_record, object_table),
+        MP_GLZ_ENTRY(mp::output_record, call_graph),
+        MP_GLZ_ENTRY(mp::output_record, peak),
+        MP_GLZ_ENTRY(mp::output_record, module_table),
         MP_GLZ_ENTRY(mp::output_record, strtab)
         //
     );
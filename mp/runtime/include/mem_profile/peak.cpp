@@ -0,0 +1,46 @@
+#include <mem_profile/peak.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace mp {
+void peak_tracker::on_alloc(live_alloc const& alloc, live_alloc_table& table) {
+    u64 bytes = weighted_count(alloc.size, alloc.weight).num_bytes;
+    u64 live  = live_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+    u64 max = max_bytes_.load(std::memory_order_relaxed);
+    while (live > max && !max_bytes_.compare_exchange_weak(max, live, std::memory_order_relaxed)) {
+    }
+
+    if (live >= next_snapshot_.load(std::memory_order_relaxed)) [[unlikely]] {
+        take_snapshot(table);
+    }
+}
+
+void peak_tracker::on_free(live_alloc const& alloc) noexcept {
+    live_bytes_.fetch_sub(weighted_count(alloc.size, alloc.weight).num_bytes,
+                          std::memory_order_relaxed);
+}
+
+void peak_tracker::take_snapshot(live_alloc_table& table) {
+    // If another thread is already taking a snapshot, it will see (roughly)
+    // the same live set, so there's no need to wait for it
+    auto lock = std::unique_lock(snapshot_lock_, std::try_to_lock);
+    if (!lock.owns_lock()) return;
+    if (live_bytes_.load(std::memory_order_relaxed) < next_snapshot_.load()) return;
+
+    scratch_.take(table);
+    std::swap(snapshot_, scratch_);
+
+    u64 live = snapshot_.live.num_bytes;
+    next_snapshot_.store(std::max(live + 1, u64(double(live) * ratio_)));
+}
+
+live_snapshot peak_tracker::snapshot() {
+    auto lock = std::lock_guard(snapshot_lock_);
+
+    auto result      = snapshot_;
+    result.max_bytes = max_bytes_.load();
+    return result;
+}
+} // namespace mp
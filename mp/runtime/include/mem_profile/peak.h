@@ -0,0 +1,127 @@
+#pragma once
+
+#include <ankerl/unordered_dense.h>
+#include <atomic>
+#include <mutex>
+
+#include <mem_profile/allocator.h>
+#include <mem_profile/counters.h>
+#include <mem_profile/live_table.h>
+#include <mp_types/types.h>
+
+namespace mp {
+/// Identifies a call stack by the thread which recorded it, and its id in
+/// that thread's stack_trie
+struct thread_stack_key {
+    u32        thread;
+    stack_id_t stack_id;
+
+    bool operator==(thread_stack_key const&) const = default;
+};
+
+struct thread_stack_key_hash {
+    using is_avalanching = void;
+
+    u64 operator()(thread_stack_key const& key) const noexcept {
+        u64 bits = u64(key.thread) << 32 | key.stack_id;
+        return ankerl::unordered_dense::detail::wyhash::hash(bits);
+    }
+};
+
+/// Bytes and allocations that an allocation of the given size stands for,
+/// scaled by its weight
+inline alloc_count weighted_count(u64 size, float weight) noexcept {
+    if (weight == 1) return alloc_count{size, 1};
+    return alloc_count{u64(double(size) * weight + 0.5), u64(weight + 0.5f)};
+}
+
+/// The live allocations at some point in time, grouped by call stack and by
+/// type. Counts are scaled by the weight of each allocation (see
+/// mem_profile_sample_interval).
+struct live_snapshot {
+    template <class K, class Hash = ankerl::unordered_dense::hash<K>>
+    using count_map = ankerl::unordered_dense::
+        map<K, alloc_count, Hash, std::equal_to<K>, allocator<std::pair<K, alloc_count>>>;
+
+    /// Highest number of live bytes seen while the program ran. Only filled
+    /// in by peak_tracker::snapshot()
+    u64                                                 max_bytes = 0;
+    /// Live bytes and allocations when the snapshot was taken
+    alloc_count                                         live;
+    /// Live allocations, grouped by the call stack they were made with
+    count_map<thread_stack_key, thread_stack_key_hash> by_stack;
+    /// Live allocations, grouped by the type of the innermost object on the
+    /// call stack when they were made. Allocations made while there was no
+    /// object on the stack (or whose type wasn't recorded) are grouped under
+    /// 0.
+    count_map<type_id_t>                                by_type;
+
+    void clear() noexcept {
+        live = {};
+        by_stack.clear();
+        by_type.clear();
+    }
+
+    /// Replace the contents of the snapshot with the allocations in `table`.
+    /// The table is walked one shard at a time, so other threads only wait
+    /// if they touch the shard being read. Since they keep allocating, the
+    /// snapshot is only approximately consistent. The maps use mp::allocator,
+    /// so this never re-enters the allocation hooks.
+    void take(live_alloc_table& table) {
+        clear();
+        table.for_each([&](addr_t, live_alloc const& alloc) {
+            auto count = weighted_count(alloc.size, alloc.weight);
+            live += count;
+            by_stack[thread_stack_key{alloc.thread, alloc.stack_id}] += count;
+            by_type[alloc.type] += count;
+        });
+    }
+};
+
+/// Keeps a running count of live bytes, and snapshots the live allocations as
+/// heap usage reaches new peaks. Used in peak mode (see mem_profile_mode).
+///
+/// A snapshot walks the whole live table, so rather than taking one at every
+/// new peak, one is only taken once live bytes exceed the last snapshot by a
+/// given ratio. The snapshot which is kept is therefore within that ratio of
+/// the true peak, and the number of snapshots only grows logarithmically with
+/// peak usage. Only the latest snapshot is kept, so memory use is bounded by
+/// the number of distinct stacks and types, no matter how long the program
+/// runs.
+class peak_tracker {
+    double           ratio_;
+    std::atomic<u64> live_bytes_{0};
+    std::atomic<u64> max_bytes_{0};
+    /// Number of live bytes at which the next snapshot is taken
+    std::atomic<u64> next_snapshot_{0};
+    /// Held while a snapshot is taken. Guards snapshot_ and scratch_
+    std::mutex       snapshot_lock_;
+    live_snapshot    snapshot_;
+    /// Snapshots are built here, then swapped into snapshot_, so the maps of
+    /// the previous snapshot are reused
+    live_snapshot    scratch_;
+
+    void take_snapshot(live_alloc_table& table);
+
+  public:
+    /// `ratio` is clamped to at least 1, in which case a snapshot is taken at
+    /// every new peak
+    explicit peak_tracker(double ratio) noexcept : ratio_(ratio < 1 ? 1 : ratio) {}
+    peak_tracker(peak_tracker const&) = delete;
+
+    /// Count a new live allocation, which must already be in `table`. If
+    /// usage has grown past the threshold, the live allocations in `table`
+    /// are snapshotted. If another thread is taking a snapshot, this doesn't
+    /// wait for it.
+    void on_alloc(live_alloc const& alloc, live_alloc_table& table);
+
+    /// Count the release of a live allocation
+    void on_free(live_alloc const& alloc) noexcept;
+
+    /// Get a copy of the latest snapshot, with max_bytes filled in. This may
+    /// be called while allocations are still being tracked: threads which
+    /// reach a new peak meanwhile skip their snapshot rather than waiting.
+    live_snapshot snapshot();
+};
+
+} // namespace mp
@@ -49,5 +49,7 @@ extern alloc_hook_table ALLOC_HOOK_TABLE;
 constexpr size_t BACKTRACE_BUFFER_SIZE = 1024;
 
 
-constexpr size_t OBJECT_BUFFER_SIZE = 1024;
+/// Objects are only found in the current thread's shadow stack, so an event
+/// never has more than `_mp_shadow_stack::capacity`
+constexpr size_t OBJECT_BUFFER_SIZE = _mp_shadow_stack::capacity;
 } // namespace mp
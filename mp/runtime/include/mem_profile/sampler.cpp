@@ -0,0 +1,47 @@
+#include <mem_profile/sampler.h>
+
+#include <cmath>
+#include <ctime>
+
+namespace mp {
+namespace {
+/// splitmix64. See: https://prng.di.unimi.it/splitmix64.c
+u64 splitmix64(u64& state) noexcept {
+    u64 z = (state += 0x9e3779b97f4a7c15);
+    z     = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z     = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+} // namespace
+
+i64 byte_sampler::next_interval(size_t interval) noexcept {
+    // Uniform in (0, 1]. Uses the top 53 bits, so every value is exact
+    double u = double((splitmix64(rng_state) >> 11) + 1) * 0x1.0p-53;
+
+    // Distances between sample points are exponentially distributed
+    return i64(-std::log(u) * double(interval));
+}
+
+float byte_sampler::take_sample(size_t size, size_t interval) noexcept {
+    if (rng_state == 0) [[unlikely]] {
+        // First allocation on this thread. Seed from the address of the
+        // sampler (unique per thread) and the clock, then place the first
+        // sample point relative to the start of this allocation.
+        timespec ts{};
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        rng_state = u64(uintptr_t(this)) ^ u64(ts.tv_nsec) ^ (u64(ts.tv_sec) << 32) ^ 1;
+
+        bytes_until_sample += next_interval(interval);
+        if (bytes_until_sample >= 0) {
+            return 0;
+        }
+    }
+
+    bytes_until_sample = next_interval(interval);
+
+    // The allocation is sampled if it contains at least one sample point,
+    // which happens with probability 1 - exp(-size / interval)
+    double p = -std::expm1(-double(size) / double(interval));
+    return float(1.0 / p);
+}
+} // namespace mp
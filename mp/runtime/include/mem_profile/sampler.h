@@ -0,0 +1,41 @@
+#pragma once
+
+#include <mp_types/types.h>
+
+namespace mp {
+/// Decides which allocations are recorded when byte-interval sampling is
+/// enabled (see `mem_profile_sample_interval`).
+///
+/// This works the same way as tcmalloc's heap profiler: sample points are
+/// scattered at random through the stream of allocated bytes, `interval` bytes
+/// apart on average, and an allocation is recorded if it contains a sample
+/// point. Each recorded allocation carries a weight - the inverse of the
+/// probability that it was sampled - so totals scaled by the weights are
+/// unbiased estimates of the true totals.
+///
+/// This is a POD, so that it can be a constinit thread_local. Checking an
+/// allocation which isn't sampled costs a single decrement of a thread-local
+/// counter.
+struct byte_sampler {
+    /// Bytes remaining until the next sample point. An allocation is sampled
+    /// if it drives this below zero.
+    i64 bytes_until_sample;
+    /// State of the random number generator. 0 if it hasn't been seeded yet
+    u64 rng_state;
+
+    /// Fast path. Returns true if the allocation may be sampled, in which case
+    /// take_sample() makes the final decision.
+    bool countdown(size_t size) noexcept {
+        bytes_until_sample -= i64(size);
+        return bytes_until_sample < 0;
+    }
+
+    /// Slow path. Returns the weight of the allocation if it's sampled, or 0
+    /// if it's not. Draws the distance to the next sample point.
+    float take_sample(size_t size, size_t interval) noexcept;
+
+  private:
+    /// Draw the number of bytes until the next sample point
+    i64 next_interval(size_t interval) noexcept;
+};
+} // namespace mp
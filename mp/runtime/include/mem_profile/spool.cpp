@@ -0,0 +1,109 @@
+#include <mem_profile/spool.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <mp_error/error.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace mp {
+namespace {
+/// Write every buffer in `iov` to the file, starting at `offset`, retrying
+/// on partial writes. Doesn't use (or move) the file offset
+bool pwrite_all(int fd, iovec* iov, int count, u64 offset) noexcept {
+    while (count > 0) {
+        ssize_t n = ::pwritev(fd, iov, count, off_t(offset));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) {
+            return false;
+        }
+        offset += u64(n);
+
+        // Skip past the buffers which were written in full
+        size_t written = size_t(n);
+        while (count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+} // namespace
+
+spool_file::~spool_file() {
+    if (fd_ >= 0) ::close(fd_);
+}
+
+bool spool_file::open(char const* output_path) noexcept {
+    // Format into a fixed buffer: this may run before the allocator is usable
+    char path[PATH_MAX];
+    int  len = std::snprintf(path, sizeof(path), "%s.spool.XXXXXX", output_path);
+    if (len < 0 || size_t(len) >= sizeof(path)) {
+        return false;
+    }
+
+    int fd = ::mkostemp(path, O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    // The file only needs to live as long as we hold the descriptor
+    ::unlink(path);
+
+    fd_     = fd;
+    size_   = 0;
+    failed_ = false;
+    return true;
+}
+
+bool spool_file::append(u32 thread, byte_view first, byte_view second) noexcept {
+    if (failed_) return false;
+
+    auto header = spool_chunk{thread, 0, first.size() + second.size()};
+
+    iovec iov[3] = {
+        {&header, sizeof(header)},
+        {(void*)first.data(), first.size()},
+        {(void*)second.data(), second.size()},
+    };
+    if (!pwrite_all(fd_, iov, 3, size_)) {
+        // A partial chunk would be read as garbage, so it's cut off, and
+        // nothing more is appended
+        (void)!::ftruncate(fd_, off_t(size_));
+        failed_ = true;
+        return false;
+    }
+
+    size_ += sizeof(header) + header.size;
+    return true;
+}
+
+
+spool_reader::spool_reader(spool_file const& spool) : size_(spool.size()) {
+    if (size_ == 0) {
+        return;
+    }
+
+    void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, spool.fd(), 0);
+    if (data == MAP_FAILED) {
+        throw ERR("Unable to map event spool ({} bytes). {}", size_, c_errcode{errno});
+    }
+    ::madvise(data, size_, MADV_SEQUENTIAL);
+    data_ = (char const*)data;
+}
+
+spool_reader::~spool_reader() {
+    if (data_) ::munmap((void*)data_, size_);
+}
+} // namespace mp
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <mem_profile/event_ring.h>
+#include <mem_profile/stack_trie.h>
+#include <mem_profile/type_registry.h>
+#include <mp_types/types.h>
+#include <mp_unwind/mp_unwind.h>
+
+namespace mp {
+/// Header for an event record, as it's encoded in an event_ring or in the
+/// spool. It's immediately followed by `object_count` spool_object entries
+/// (the object trace).
+///
+/// The call stack is stored as an id in the recording thread's stack_trie.
+///
+/// A free refers to the event which recorded the allocation it releases by its
+/// id and thread. The lookup is made when the free is recorded (see
+/// live_alloc_table), and `origin_id` is 0 if the allocation wasn't recorded.
+/// realloc is recorded as a free of its hint followed by an allocation, so only
+/// frees have an origin.
+///
+/// Every part of a record is a multiple of 8 bytes, so records stay aligned
+/// when they're read back out of the spool.
+struct spool_event {
+    u64        id;
+    u64        alloc_size;
+    u64        alloc_ptr;
+    u64        alloc_hint;
+    u32        type;
+    stack_id_t stack_id;
+    u32        object_count;
+    /// Number of events this event stands for. 1 unless sampling is enabled
+    float      weight;
+    /// id of the event which recorded the allocation this free releases
+    u64        origin_id;
+    /// Thread which recorded the allocation this free releases
+    u32        origin_thread;
+    u32        reserved;
+};
+static_assert(sizeof(spool_event) == 64);
+
+/// An object found on the call stack of an event, as it's stored in the spool.
+/// Its type is stored by id (see type_registry)
+struct spool_object {
+    u64       event_id;
+    u64       object_ptr;
+    u32       trace_index;
+    type_id_t type;
+};
+static_assert(sizeof(spool_object) == 24);
+
+/// Preceeds each block of bytes drained from an event_ring into the spool
+struct spool_chunk {
+    /// Index of the thread whose ring the chunk was drained from
+    u32 thread;
+    u32 reserved;
+    /// Number of bytes of event records following the chunk header
+    u64 size;
+};
+static_assert(sizeof(spool_chunk) == 16);
+
+/// The largest record which can be pushed into an event ring. Rings must be at
+/// least this large.
+constexpr size_t MAX_SPOOL_EVENT_SIZE = sizeof(spool_event)
+                                      + OBJECT_BUFFER_SIZE * sizeof(spool_object);
+
+/// Append-only file that event rings are drained into. The file is unlinked as
+/// soon as it's created, so it disappears when the process exits.
+///
+/// Not thread-safe: writers are serialized by `global_context::spool_lock`
+class spool_file {
+    int  fd_     = -1;
+    u64  size_   = 0;
+    /// Set once a write fails. The spool stops growing from then on
+    bool failed_ = false;
+
+  public:
+    spool_file() = default;
+    spool_file(spool_file const&) = delete;
+    ~spool_file();
+
+    /// Create the spool file in the same directory as `output_path`. Returns
+    /// false if the file could not be created.
+    bool open(char const* output_path) noexcept;
+
+    bool is_open() const noexcept { return fd_ >= 0; }
+
+    /// Number of bytes written so far
+    u64 size() const noexcept { return size_; }
+
+    int fd() const noexcept { return fd_; }
+
+    /// Append a chunk holding the bytes `first`, followed by `second`. The
+    /// chunk is written at `size()`, so the file stays readable up to
+    /// `size()` even if a write fails. Returns false if the write failed, or
+    /// an earlier one did, in which case the chunk is dropped.
+    bool append(u32 thread, byte_view first, byte_view second) noexcept;
+};
+
+/// Event record read back from the spool. Points directly into the mapped spool
+struct spool_record {
+    u32                 thread;
+    spool_event const*  event;
+    spool_object const* objects;
+};
+
+/// Decode the record starting at `rec`, recorded by the given thread. Returns
+/// a pointer just past the end of the record.
+inline char const* decode_record(char const* rec, u32 thread, spool_record& out) noexcept {
+    auto const* event   = (spool_event const*)rec;
+    auto const* objects = (spool_object const*)(rec + sizeof(spool_event));
+
+    out = spool_record{thread, event, objects};
+    return (char const*)(objects + event->object_count);
+}
+
+/// Read-only view of the first `size` bytes of a spool file
+class spool_reader {
+    char const* data_ = nullptr;
+    size_t      size_ = 0;
+
+    /// The records of a single thread, visited in the order they were recorded
+    struct thread_stream {
+        /// Chunks of records recorded by the thread, as [begin, end) ranges
+        std::vector<std::pair<char const*, char const*>> chunks;
+
+        size_t       chunk = 0;
+        char const*  pos   = nullptr;
+        spool_record current{};
+
+        /// Move to the next record. Returns false if there are no more records
+        bool advance() noexcept {
+            while (chunk < chunks.size() && pos == chunks[chunk].second) {
+                if (++chunk < chunks.size()) {
+                    pos = chunks[chunk].first;
+                }
+            }
+            if (chunk == chunks.size()) {
+                return false;
+            }
+            pos = decode_record(pos, current.thread, current);
+            return true;
+        }
+    };
+
+  public:
+    /// Map the contents of the spool which have been written so far
+    explicit spool_reader(spool_file const& spool);
+    spool_reader(spool_reader const&) = delete;
+    ~spool_reader();
+
+    size_t size() const noexcept { return size_; }
+
+    /// Invoke `func(thread, begin, end)` on every chunk in the spool, where
+    /// [begin, end) holds the encoded records of the chunk
+    template <class F>
+    void for_each_chunk(F&& func) const {
+        char const* p   = data_;
+        char const* end = data_ + size_;
+        while (p < end) {
+            auto const* chunk = (spool_chunk const*)p;
+            char const* rec   = p + sizeof(spool_chunk);
+            char const* stop  = rec + chunk->size;
+
+            func(chunk->thread, rec, stop);
+            p = stop;
+        }
+    }
+
+    /// Invoke `func(spool_record)` on every record in the spool, in the order
+    /// they were written. Records from the same thread are always visited in
+    /// the order they were recorded.
+    template <class F>
+    void for_each_record(F&& func) const {
+        for_each_chunk([&](u32 thread, char const* rec, char const* stop) {
+            spool_record record;
+            while (rec < stop) {
+                rec = decode_record(rec, thread, record);
+                func(record);
+            }
+        });
+    }
+
+    /// Invoke `func(spool_record)` on every record in the spool, in
+    /// chronological order: ordered by event id, with ties broken by thread.
+    ///
+    /// The records of each thread are already in order, so the per-thread
+    /// streams are merged, rather than sorting every record. Memory use is
+    /// proportional to the number of chunks, not the number of records.
+    template <class F>
+    void for_each_record_in_order(F&& func) const {
+        std::vector<thread_stream> streams;
+        for_each_chunk([&](u32 thread, char const* rec, char const* stop) {
+            if (rec == stop) return;
+            if (thread >= streams.size()) {
+                streams.resize(thread + 1);
+            }
+            streams[thread].chunks.emplace_back(rec, stop);
+        });
+
+        auto key = [&](u32 thread) {
+            return std::pair(streams[thread].current.event->id, thread);
+        };
+        // std::*_heap build a max-heap, so invert the comparison to get the
+        // earliest record at the front
+        auto later = [&](u32 a, u32 b) { return key(b) < key(a); };
+
+        std::vector<u32> heap;
+        for (u32 i = 0; i < streams.size(); i++) {
+            auto& stream = streams[i];
+            if (stream.chunks.empty()) continue;
+
+            stream.pos            = stream.chunks[0].first;
+            stream.current.thread = i;
+            stream.advance();
+            heap.push_back(i);
+        }
+        std::make_heap(heap.begin(), heap.end(), later);
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            auto& stream = streams[heap.back()];
+            func(stream.current);
+
+            if (stream.advance()) {
+                std::push_heap(heap.begin(), heap.end(), later);
+            } else {
+                heap.pop_back();
+            }
+        }
+    }
+};
+} // namespace mp
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <new>
+#include <utility>
+
+#include <mem_profile/alloc.h>
+#include <mp_types/types.h>
+
+namespace mp {
+/// Append-only array whose elements never move.
+///
+/// Elements are stored in segments of doubling size, and the element count is
+/// published with release semantics. This means another thread may safely
+/// read any element below `size()` while the owning thread keeps appending.
+///
+/// Storage is obtained from the underlying malloc, so growing the array is
+/// never recorded as an allocation. `T` must be trivially copyable.
+template <class T>
+class stable_vector {
+    /// Segment k holds `FIRST_SEGMENT_SIZE << k` elements
+    constexpr static size_t FIRST_SEGMENT_BITS = 10;
+    constexpr static size_t FIRST_SEGMENT_SIZE = size_t(1) << FIRST_SEGMENT_BITS;
+    constexpr static size_t SEGMENT_COUNT      = 32;
+
+    T*               segments_[SEGMENT_COUNT]{};
+    std::atomic<u32> size_{0};
+
+    /// Returns the index of the segment holding element `i`, and the offset of
+    /// the element within that segment
+    constexpr static auto locate(size_t i) noexcept -> std::pair<size_t, size_t> {
+        size_t k = std::bit_width((i >> FIRST_SEGMENT_BITS) + 1) - 1;
+        return {k, i - ((size_t(1) << k) - 1) * FIRST_SEGMENT_SIZE};
+    }
+
+  public:
+    stable_vector() = default;
+    stable_vector(stable_vector const&) = delete;
+
+    ~stable_vector() {
+        for (T* segment : segments_) {
+            mperf_free(segment);
+        }
+    }
+
+    /// Number of elements. Elements below this count may be read from any thread.
+    size_t size() const noexcept { return size_.load(std::memory_order_acquire); }
+
+    T const& operator[](size_t i) const noexcept {
+        auto [k, offset] = locate(i);
+        return segments_[k][offset];
+    }
+
+    T& operator[](size_t i) noexcept {
+        auto [k, offset] = locate(i);
+        return segments_[k][offset];
+    }
+
+    /// Append an element, returning its index. Only the owning thread may append.
+    u32 push_back(T const& value) {
+        u32  i           = size_.load(std::memory_order_relaxed);
+        auto [k, offset] = locate(i);
+        if (segments_[k] == nullptr) {
+            segments_[k] = (T*)mperf_malloc((FIRST_SEGMENT_SIZE << k) * sizeof(T));
+            if (segments_[k] == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        segments_[k][offset] = value;
+        size_.store(i + 1, std::memory_order_release);
+        return i;
+    }
+};
+} // namespace mp
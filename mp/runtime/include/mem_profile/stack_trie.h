@@ -0,0 +1,115 @@
+#pragma once
+
+#include <ankerl/unordered_dense.h>
+
+#include <mem_profile/allocator.h>
+#include <mem_profile/stable_vector.h>
+#include <mp_types/types.h>
+
+namespace mp {
+/// Identifies a call stack within a stack_trie. 0 is the root (an empty stack)
+using stack_id_t = u32;
+
+/// Calling-context trie, used to intern call stacks.
+///
+/// Each node represents a call stack, stored as `(parent, pc)`: the node's
+/// stack is its parent's stack, plus a call to `pc` on top. Stacks are keyed on
+/// their sequence of program counters starting from the root (the outermost
+/// frame), so stacks with a common prefix share nodes, and each distinct stack
+/// is stored exactly once.
+///
+/// Nodes are stored in a stable_vector, so another thread may safely read any
+/// node below `size()` while the owning thread keeps adding nodes.
+class stack_trie {
+  public:
+    struct node {
+        /// Stack this node was called from
+        stack_id_t parent;
+        /// Number of frames in this stack
+        u32        depth;
+        /// Program counter at the top of this stack
+        addr_t     pc;
+    };
+
+  private:
+    struct key {
+        stack_id_t parent;
+        addr_t     pc;
+
+        bool operator==(key const&) const = default;
+    };
+
+    struct key_hash {
+        using is_avalanching = void;
+
+        u64 operator()(key const& k) const noexcept {
+            return ankerl::unordered_dense::detail::wyhash::mix(k.pc, k.parent);
+        }
+    };
+
+    using lookup_map = ankerl::unordered_dense::
+        map<key, stack_id_t, key_hash, std::equal_to<key>, allocator<std::pair<key, stack_id_t>>>;
+
+    stable_vector<node> nodes_;
+    lookup_map          lookup_;
+
+  public:
+    stack_trie() { nodes_.push_back(node{0, 0, 0}); }
+    stack_trie(stack_trie const&) = delete;
+
+    /// Number of nodes in the trie (including the root). Nodes below this
+    /// count may be read from any thread.
+    size_t size() const noexcept { return nodes_.size(); }
+
+    node const& operator[](stack_id_t id) const noexcept { return nodes_[id]; }
+
+    /// Get the stack for `pc` called from the given parent stack, adding it if necessary
+    stack_id_t child(stack_id_t parent, addr_t pc) {
+        auto [it, is_new] = lookup_.try_emplace(key{parent, pc}, 0);
+        if (is_new) {
+            it->second = nodes_.push_back(node{parent, (*this)[parent].depth + 1, pc});
+        }
+        return it->second;
+    }
+
+    /// Intern a trace, returning the id of its stack. Traces are ordered from
+    /// the innermost frame to the outermost frame, as produced by mp_unwind.
+    stack_id_t intern(addr_t const* trace, size_t count) {
+        stack_id_t id = 0;
+        for (size_t i = count; i-- > 0;) {
+            id = child(id, trace[i]);
+        }
+        return id;
+    }
+
+    /// Append the program counters of the given stack to `out`, from the
+    /// innermost frame to the outermost frame (the same order as the trace it
+    /// was interned from)
+    template <class Vec>
+    void expand(stack_id_t id, Vec& out) const {
+        while (id != 0) {
+            auto const& n = (*this)[id];
+            out.push_back(n.pc);
+            id = n.parent;
+        }
+    }
+
+    /// Add every stack from `other` to this trie. Returns a table mapping the
+    /// ids of nodes in `other` to ids in this trie.
+    ///
+    /// Only nodes which were published when the merge began are merged, so it
+    /// is safe for another thread to keep adding nodes to `other`.
+    _vec<stack_id_t> merge(stack_trie const& other) {
+        size_t           count = other.size();
+        _vec<stack_id_t> remap(count);
+
+        // Parents are always added before their children, so the parent of
+        // each node has already been remapped by the time we see the node
+        for (size_t i = 1; i < count; i++) {
+            auto const& n = other[stack_id_t(i)];
+            remap[i]      = child(remap[n.parent], n.pc);
+        }
+        return remap;
+    }
+};
+} // namespace mp
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <mp_types/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+namespace mp {
+/// Read a cheap timestamp, used to order events.
+///
+/// On x86 this is the TSC, and on aarch64 it's the virtual counter. Both are
+/// invariant and synchronized across cores on the platforms we support, so
+/// stamps taken on different threads can be compared. Elsewhere, this falls
+/// back to the monotonic clock.
+inline u64 read_stamp() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    u64 value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000000ull + u64(ts.tv_nsec);
+#endif
+}
+} // namespace mp
@@ -0,0 +1,309 @@
+#include <mem_profile/symbol_cache.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <mem_profile/env.h>
+#include <mp_error/error.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace mp {
+namespace {
+/// Directory holding the cache files, or an empty string if the cache is
+/// disabled
+std::string cache_dir() {
+    std::string_view dir = mem_profile_symbol_cache();
+    if (dir == "off") return {};
+    if (!dir.empty()) return std::string(dir);
+
+    if (char const* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return fmt::format("{}/mem_profile/symbols", xdg);
+    }
+    if (char const* home = std::getenv("HOME"); home && *home) {
+        return fmt::format("{}/.cache/mem_profile/symbols", home);
+    }
+    return {};
+}
+
+/// Build-ids are used as filenames, so they must only hold hex digits
+bool is_valid_build_id(std::string_view build_id) {
+    return !build_id.empty() && std::ranges::all_of(build_id, [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+}
+
+void write_bytes(std::FILE* file, void const* data, size_t size) {
+    if (size != 0 && std::fwrite(data, 1, size, file) != size) {
+        throw ERR("Error when writing symbol cache. {}", c_errcode{errno});
+    }
+}
+} // namespace
+
+
+symbol_cache::mapped_file::mapped_file(mapped_file&& other) noexcept
+  : data(std::exchange(other.data, nullptr))
+  , size(std::exchange(other.size, 0))
+  , entries(other.entries)
+  , entry_count(other.entry_count)
+  , frames(other.frames)
+  , frame_count(other.frame_count)
+  , strings(other.strings)
+  , strings_size(other.strings_size) {}
+
+symbol_cache::mapped_file::~mapped_file() {
+    if (data) ::munmap(const_cast<void*>(data), size);
+}
+
+bool symbol_cache::mapped_file::open(char const* path) noexcept {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st {};
+    void*       mapping = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(header)) {
+        mapping = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping stays valid after the descriptor is closed, and after the
+    // file is replaced by another process
+    ::close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    auto const* base = (char const*)mapping;
+    auto        h    = header();
+    std::memcpy(&h, base, sizeof(h));
+
+    // Sizes come from the file, so they're checked without overflowing
+    size_t file_size = size_t(st.st_size);
+    size_t available = file_size - sizeof(header);
+    bool   valid     = std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 && h.version == VERSION
+                  && h.entry_count <= available / sizeof(entry)
+                  && h.frame_count <= (available - h.entry_count * sizeof(entry)) / sizeof(frame)
+                  && h.strings_size
+                         == available - h.entry_count * sizeof(entry)
+                                - h.frame_count * sizeof(frame)
+                  && (h.strings_size == 0 || base[file_size - 1] == '\0');
+    if (!valid) {
+        ::munmap(mapping, file_size);
+        return false;
+    }
+
+    data         = mapping;
+    size         = file_size;
+    entries      = (entry const*)(base + sizeof(header));
+    entry_count  = h.entry_count;
+    frames       = (frame const*)(entries + entry_count);
+    frame_count  = h.frame_count;
+    strings      = (char const*)(frames + frame_count);
+    strings_size = h.strings_size;
+    return true;
+}
+
+auto symbol_cache::mapped_file::find(u64 object_address) const noexcept -> entry const* {
+    auto const* end = entries + entry_count;
+    auto const* it  = std::lower_bound(entries, end, object_address, [](entry const& e, u64 a) {
+        return e.object_address < a;
+    });
+    if (it == end || it->object_address != object_address) return nullptr;
+    if (it->frame_begin > frame_count || it->frame_count > frame_count - it->frame_begin) {
+        return nullptr;
+    }
+    return it;
+}
+
+std::string_view symbol_cache::mapped_file::string(u32 offset) const noexcept {
+    // The string section ends with a nul, so this never reads past it
+    return offset < strings_size ? std::string_view(strings + offset) : std::string_view();
+}
+
+
+u32 symbol_cache::pending_file::add_string(std::string_view str) {
+    auto [it, is_new] = string_offsets.try_emplace(std::string(str), u32(strings.size()));
+    if (is_new) {
+        strings.append(str);
+        strings.push_back('\0');
+    }
+    return it->second;
+}
+
+
+symbol_cache::symbol_cache(view<module_info> modules) : dir_(cache_dir()) {
+    if (dir_.empty()) return;
+
+    for (auto const& m : modules) {
+        if (!is_valid_build_id(m.build_id)) continue;
+
+        auto& obj     = objects_.emplace_back();
+        obj.build_id  = std::string(m.build_id);
+        obj.load_base = m.load_base;
+        obj.begin     = m.begin;
+        obj.end       = m.end;
+        // A missing or invalid file just means every lookup misses
+        obj.file.open(file_path(obj).c_str());
+    }
+}
+
+auto symbol_cache::find_object(addr_t pc) const noexcept -> object const* {
+    // Later modules take precedence, matching module_map
+    for (size_t i = objects_.size(); i-- > 0;) {
+        auto const& obj = objects_[i];
+        if (obj.begin <= pc && pc < obj.end) return &obj;
+    }
+    return nullptr;
+}
+
+auto symbol_cache::find_object(addr_t pc) noexcept -> object* {
+    return const_cast<object*>(std::as_const(*this).find_object(pc));
+}
+
+std::string symbol_cache::file_path(object const& obj) const {
+    return fmt::format("{}/{}.v{}", dir_, obj.build_id, VERSION);
+}
+
+bool symbol_cache::lookup(addr_t pc, std::vector<cpptrace::stacktrace_frame>& out) const {
+    auto const* obj = find_object(pc);
+    if (obj == nullptr) return false;
+
+    auto const& file = obj->file;
+    auto const* e    = file.find(pc - obj->load_base);
+    if (e == nullptr) return false;
+
+    for (u32 i = 0; i < e->frame_count; i++) {
+        auto const& f      = file.frames[e->frame_begin + i];
+        auto&       result = out.emplace_back();
+        result.raw_address    = pc;
+        result.object_address = pc - obj->load_base;
+        if (f.line != 0) result.line = f.line;
+        if (f.column != 0) result.column = f.column;
+        result.filename  = file.string(f.file);
+        result.symbol    = file.string(f.func);
+        result.is_inline = f.is_inline != 0;
+    }
+    return true;
+}
+
+void symbol_cache::insert(addr_t pc, view<cpptrace::stacktrace_frame> frames) {
+    auto* obj = find_object(pc);
+    if (obj == nullptr) return;
+
+    auto& pending = obj->pending;
+    pending.entries.push_back(
+        entry{pc - obj->load_base, u32(pending.frames.size()), u32(frames.size())});
+    for (auto const& f : frames) {
+        pending.frames.push_back(frame{
+            pending.add_string(f.filename),
+            pending.add_string(f.symbol),
+            f.line.value_or(0),
+            f.column.value_or(0),
+            f.is_inline,
+            0,
+        });
+    }
+}
+
+void symbol_cache::save() {
+    if (dir_.empty()) return;
+
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+
+    for (auto& obj : objects_) {
+        if (obj.pending.entries.empty()) continue;
+        try {
+            save(obj);
+        } catch (mp_error const& err) {
+            fmt::println(stderr, "mem_profile: Unable to update symbol cache. {}", err.msg);
+        }
+        obj.pending = pending_file();
+    }
+}
+
+void symbol_cache::save(object& obj) {
+    // Another process may have updated the file since it was opened, so its
+    // entries are merged with the latest version
+    auto path   = file_path(obj);
+    auto latest = mapped_file();
+    latest.open(path.c_str());
+
+    auto& pending = obj.pending;
+    auto  by_addr = [](entry const& a, entry const& b) {
+        return a.object_address < b.object_address;
+    };
+    std::stable_sort(pending.entries.begin(), pending.entries.end(), by_addr);
+
+    // Entries from the latest file are copied into the pending tables, and
+    // then everything is written out in order
+    auto entries = std::vector<entry>();
+    entries.reserve(latest.entry_count + pending.entries.size());
+    auto copy_latest = [&](entry const& e) {
+        auto copy = entry{e.object_address, u32(pending.frames.size()), e.frame_count};
+        for (u32 i = 0; i < e.frame_count; i++) {
+            auto f = latest.frames[e.frame_begin + i];
+            f.file = pending.add_string(latest.string(f.file));
+            f.func = pending.add_string(latest.string(f.func));
+            pending.frames.push_back(f);
+        }
+        entries.push_back(copy);
+    };
+
+    size_t i = 0;
+    for (auto const& e : pending.entries) {
+        for (; i < latest.entry_count && latest.entries[i].object_address <= e.object_address;
+             i++) {
+            if (latest.find(latest.entries[i].object_address)) copy_latest(latest.entries[i]);
+        }
+        if (entries.empty() || entries.back().object_address != e.object_address) {
+            entries.push_back(e);
+        }
+    }
+    for (; i < latest.entry_count; i++) {
+        if (latest.find(latest.entries[i].object_address)) copy_latest(latest.entries[i]);
+    }
+
+    // Written to a temporary file, then renamed into place, so that readers
+    // never see a partially written file
+    auto tmp_path = fmt::format("{}.XXXXXX", path);
+    int  fd       = ::mkostemp(tmp_path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        throw ERR("Unable to create '{}'. {}", tmp_path, c_errcode{errno});
+    }
+    std::FILE* file = ::fdopen(fd, "wb");
+    if (file == nullptr) {
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        throw ERR("Unable to open '{}'. {}", tmp_path, c_errcode{errno});
+    }
+
+    auto h = header{};
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version      = VERSION;
+    h.entry_count  = entries.size();
+    h.frame_count  = pending.frames.size();
+    h.strings_size = pending.strings.size();
+
+    try {
+        write_bytes(file, &h, sizeof(h));
+        write_bytes(file, entries.data(), entries.size() * sizeof(entry));
+        write_bytes(file, pending.frames.data(), pending.frames.size() * sizeof(frame));
+        write_bytes(file, pending.strings.data(), pending.strings.size());
+    } catch (...) {
+        std::fclose(file);
+        ::unlink(tmp_path.c_str());
+        throw;
+    }
+
+    if (std::fclose(file) != 0 || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        int err = errno;
+        ::unlink(tmp_path.c_str());
+        throw ERR("Unable to write '{}'. {}", path, c_errcode{err});
+    }
+}
+} // namespace mp
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <ankerl/unordered_dense.h>
+#include <cpptrace/cpptrace.hpp>
+#include <mem_profile/counters.h>
+#include <mem_profile/module_map.h>
+#include <mp_types/types.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Persistent cache of symbolized frames.
+///
+/// Resolving a program counter with cpptrace means parsing DWARF, which is
+/// the slowest part of writing a report, and the same binaries get profiled
+/// over and over. The cache holds one file per object, named after its
+/// build-id, mapping addresses within the object to the frames they resolve
+/// to. An object without a build-id is never cached. Since a build-id
+/// identifies the exact contents of an object, entries never go stale.
+///
+/// Cache files are written to a temporary file and renamed into place, so a
+/// reader always sees a complete file, and files can be shared by any number
+/// of processes. If two processes update the same file at once, the entries
+/// added by one of them are lost, which only means they're resolved again
+/// next time.
+///
+/// File layout (integers are stored in native byte order):
+///
+/// ```
+/// header
+/// entry[entry_count]    (sorted by address)
+/// frame[frame_count]    (frames for an entry are innermost call first)
+/// strings               (nul-terminated)
+/// ```
+namespace mp {
+class symbol_cache {
+  public:
+    static constexpr char MAGIC[8] = {'M', 'P', 'S', 'Y', 'M', 'C', 'A', 'C'};
+    static constexpr u32  VERSION  = 1;
+
+    struct header {
+        char magic[8];
+        u32  version;
+        u32  reserved;
+        u64  entry_count;
+        u64  frame_count;
+        u64  strings_size;
+    };
+    static_assert(sizeof(header) == 40);
+
+    struct entry {
+        /// Address within the object
+        u64 object_address;
+        /// Index of the first frame for this address
+        u32 frame_begin;
+        u32 frame_count;
+    };
+    static_assert(sizeof(entry) == 16);
+
+    struct frame {
+        /// Offsets of the file and function names in the string section
+        u32 file;
+        u32 func;
+        /// 0 if missing
+        u32 line;
+        u32 column;
+        u32 is_inline;
+        u32 reserved;
+    };
+    static_assert(sizeof(frame) == 24);
+
+  private:
+    /// A cache file mapped into memory. Files are mapped read-only, and never
+    /// modified once mapped.
+    struct mapped_file {
+        void const*  data         = nullptr;
+        size_t       size         = 0;
+        entry const* entries      = nullptr;
+        size_t       entry_count  = 0;
+        frame const* frames       = nullptr;
+        size_t       frame_count  = 0;
+        char const*  strings      = nullptr;
+        size_t       strings_size = 0;
+
+        mapped_file() = default;
+        mapped_file(mapped_file&& other) noexcept;
+        ~mapped_file();
+
+        /// Map the given file. Returns false if it doesn't exist, or isn't a
+        /// valid cache file.
+        bool open(char const* path) noexcept;
+
+        /// Find the entry for an address. Returns null if there is none
+        entry const* find(u64 object_address) const noexcept;
+
+        std::string_view string(u32 offset) const noexcept;
+    };
+
+    /// Entries to be added to a cache file
+    struct pending_file {
+        std::vector<entry>                             entries;
+        std::vector<frame>                             frames;
+        std::string                                    strings;
+        ankerl::unordered_dense::map<std::string, u32> string_offsets;
+
+        /// Get the offset of a string, adding it if it's new
+        u32 add_string(std::string_view str);
+    };
+
+    /// A module with a build-id, and its cache file
+    struct object {
+        std::string  build_id;
+        addr_t       load_base = 0;
+        addr_t       begin     = 0;
+        addr_t       end       = 0;
+        mapped_file  file;
+        pending_file pending;
+    };
+
+    /// Directory holding the cache files. Empty if the cache is disabled
+    std::string         dir_;
+    std::vector<object> objects_;
+
+    /// Find the object containing the given program counter. Returns null if
+    /// it isn't in a module with a build-id.
+    object const* find_object(addr_t pc) const noexcept;
+    object*       find_object(addr_t pc) noexcept;
+
+    std::string file_path(object const& obj) const;
+
+    void save(object& obj);
+
+  public:
+    /// Open the cache files for the given modules. If the cache directory
+    /// can't be determined, or the cache is disabled (see
+    /// mem_profile_symbol_cache), every lookup misses and nothing is saved.
+    explicit symbol_cache(view<module_info> modules);
+
+    /// Look up the frames for a program counter, appending them to `out`.
+    /// Returns false on a cache miss. Safe to call from multiple threads.
+    bool lookup(addr_t pc, std::vector<cpptrace::stacktrace_frame>& out) const;
+
+    /// Record the frames a program counter resolved to. Only the last frame
+    /// may be a non-inline frame. Takes effect once save() is called.
+    void insert(addr_t pc, view<cpptrace::stacktrace_frame> frames);
+
+    /// Write any entries that were inserted to the cache directory. Failures
+    /// are reported as warnings, since the cache is only an optimization.
+    void save();
+};
+} // namespace mp
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <new>
+#include <utility>
+
+#include <mem_profile/alloc.h>
+#include <mp_types/types.h>
+
+namespace mp {
+struct local_context;
+
+/// The local_context of every thread, indexed by thread.
+///
+/// Registering a thread is lock-free: ids are handed out by an atomic counter,
+/// and each context is published into a segmented array of atomic pointers.
+/// Segments are allocated on demand with the underlying malloc, and never
+/// move, so threads can register while others read the registry.
+///
+/// A slot holds null until the thread's context is published, and again once
+/// the thread has exited and its context has been retired (see
+/// global_context::retire_local_context). Readers which dereference a context
+/// must hold `global_context::context_lock`, so that it can't be retired out
+/// from under them. The registry doesn't own the contexts.
+class thread_registry {
+    using slot = std::atomic<local_context*>;
+
+    /// Segment k holds `FIRST_SEGMENT_SIZE << k` slots. 27 segments are
+    /// enough to cover every u32 thread id
+    constexpr static size_t FIRST_SEGMENT_BITS = 6;
+    constexpr static size_t FIRST_SEGMENT_SIZE = size_t(1) << FIRST_SEGMENT_BITS;
+    constexpr static size_t SEGMENT_COUNT      = 27;
+
+    std::atomic<slot*> segments_[SEGMENT_COUNT]{};
+    std::atomic<u32>   count_{0};
+
+    /// Returns the index of the segment holding slot `i`, and the offset of
+    /// the slot within that segment
+    constexpr static auto locate(size_t i) noexcept -> std::pair<size_t, size_t> {
+        size_t k = std::bit_width((i >> FIRST_SEGMENT_BITS) + 1) - 1;
+        return {k, i - ((size_t(1) << k) - 1) * FIRST_SEGMENT_SIZE};
+    }
+
+    /// Get the slot for a thread, or null if its segment hasn't been allocated
+    slot* find(u32 thread) const noexcept {
+        auto [k, offset] = locate(thread);
+        slot* segment    = segments_[k].load(std::memory_order_acquire);
+        return segment ? segment + offset : nullptr;
+    }
+
+  public:
+    thread_registry() = default;
+    thread_registry(thread_registry const&) = delete;
+
+    ~thread_registry() {
+        for (auto& segment : segments_) {
+            mperf_free(segment.load());
+        }
+    }
+
+    /// Number of thread ids handed out so far
+    u32 size() const noexcept { return count_.load(std::memory_order_acquire); }
+
+    /// Hand out the id of a new thread
+    u32 reserve() noexcept { return count_.fetch_add(1, std::memory_order_acq_rel); }
+
+    /// Publish the context of a thread, whose id was obtained from reserve()
+    void publish(u32 thread, local_context* context) {
+        auto [k, offset] = locate(thread);
+        slot* segment    = segments_[k].load(std::memory_order_acquire);
+        if (segment == nullptr) {
+            // Zeroed memory is a null pointer. If another thread allocated the
+            // segment first, use theirs.
+            auto* fresh = (slot*)mperf_calloc(FIRST_SEGMENT_SIZE << k, sizeof(slot));
+            if (fresh == nullptr) {
+                throw std::bad_alloc();
+            }
+            if (segments_[k].compare_exchange_strong(segment, fresh)) {
+                segment = fresh;
+            } else {
+                mperf_free(fresh);
+            }
+        }
+        segment[offset].store(context, std::memory_order_release);
+    }
+
+    /// Remove the context of a thread from the registry, returning it
+    local_context* take(u32 thread) noexcept {
+        slot* s = find(thread);
+        return s ? s->exchange(nullptr, std::memory_order_acq_rel) : nullptr;
+    }
+
+    /// Get the context of a thread. Null if it hasn't been published yet, or
+    /// if it's been retired.
+    local_context* operator[](u32 thread) const noexcept {
+        slot* s = find(thread);
+        return s ? s->load(std::memory_order_acquire) : nullptr;
+    }
+
+    /// Invoke `func(local_context*)` on the context of every registered thread
+    template <class F>
+    void for_each(F&& func) const {
+        u32 count = size();
+        for (u32 i = 0; i < count; i++) {
+            if (auto* context = (*this)[i]) {
+                func(context);
+            }
+        }
+    }
+};
+} // namespace mp
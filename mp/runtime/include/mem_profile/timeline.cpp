@@ -0,0 +1,127 @@
+#include <mem_profile/timeline.h>
+
+#include <fmt/format.h>
+#include <mp_error/error.h>
+#include <string>
+
+namespace mp {
+bool timeline_writer::open(char const* output_path) {
+    auto path = std::string(output_path) + ".timeline.jsonl";
+    try {
+        out_ = std::make_unique<json_writer>(path.c_str());
+    } catch (mp_error const& err) {
+        fmt::println(stderr, "mem_profile: Unable to create timeline. {}", err.msg);
+        return false;
+    }
+    return true;
+}
+
+u32 timeline_writer::stack_id(thread_stack_key key, global_context& context) {
+    auto [it, is_new] = stack_ids_.try_emplace(key, u32(stack_ids_.size()));
+    if (is_new) {
+        pcs_.clear();
+        {
+            auto guard = std::lock_guard(context.context_lock);
+            context.expand_stack(key.thread, key.stack_id, pcs_);
+        }
+
+        auto& out = *out_;
+        out.put('{');
+        out.key("stack", true);
+        out.number(it->second);
+        out.key("pcs");
+        out.number_array(pcs_.size(), [&](size_t i) { return pcs_[i]; });
+        out.raw("}\n");
+    }
+    return it->second;
+}
+
+bool timeline_writer::write_snapshot(live_alloc_table& table,
+                                     global_context&   context,
+                                     u64               time_ms) {
+    try {
+        write_snapshot_unchecked(table, context, time_ms);
+    } catch (mp_error const& err) {
+        fmt::println(stderr, "mem_profile: Unable to write timeline. {}", err.msg);
+        return false;
+    }
+    return true;
+}
+
+void timeline_writer::write_snapshot_unchecked(live_alloc_table& table,
+                                               global_context&   context,
+                                               u64               time_ms) {
+    std::swap(current_, previous_);
+    current_.take(table);
+
+    // Stacks are defined before the snapshot which refers to them, so deltas
+    // are computed first
+    struct delta {
+        u32 id;
+        i64 bytes;
+        i64 allocs;
+    };
+    auto deltas = _vec<delta>();
+    auto diff   = [&](thread_stack_key key, alloc_count now, alloc_count before) {
+        if (now.num_bytes == before.num_bytes && now.num_allocs == before.num_allocs) return;
+        deltas.push_back(delta{
+            stack_id(key, context),
+            i64(now.num_bytes - before.num_bytes),
+            i64(now.num_allocs - before.num_allocs),
+        });
+    };
+    for (auto const& [key, count] : current_.by_stack) {
+        auto it = previous_.by_stack.find(key);
+        diff(key, count, it == previous_.by_stack.end() ? alloc_count{} : it->second);
+    }
+    for (auto const& [key, count] : previous_.by_stack) {
+        if (!current_.by_stack.contains(key)) diff(key, alloc_count{}, count);
+    }
+
+    auto& out = *out_;
+    out.put('{');
+    out.key("snapshot", true);
+    out.number(snapshot_count_++);
+    out.key("time_ms");
+    out.number(time_ms);
+    out.key("live_bytes");
+    out.number(current_.live.num_bytes);
+    out.key("live_allocs");
+    out.number(current_.live.num_allocs);
+
+    out.key("stacks");
+    out.put('[');
+    for (size_t i = 0; i < deltas.size(); i++) {
+        if (i != 0) out.put(',');
+        out.put('[');
+        out.number(deltas[i].id);
+        out.put(',');
+        out.number(deltas[i].bytes);
+        out.put(',');
+        out.number(deltas[i].allocs);
+        out.put(']');
+    }
+    out.put(']');
+
+    out.key("types");
+    out.put('[');
+    bool first = true;
+    for (auto const& [type, count] : current_.by_type) {
+        auto const* type_data = TYPES[type];
+        if (type_data == nullptr) continue;
+        if (!std::exchange(first, false)) out.put(',');
+        out.put('{');
+        out.key("type", true);
+        out.string(type_data->type);
+        out.key("bytes");
+        out.number(count.num_bytes);
+        out.key("allocs");
+        out.number(count.num_allocs);
+        out.put('}');
+    }
+    out.put(']');
+    out.raw("}\n");
+
+    out.flush();
+}
+} // namespace mp
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <ankerl/unordered_dense.h>
+#include <memory>
+
+#include <mem_profile/allocator.h>
+#include <mem_profile/counters.h>
+#include <mem_profile/json_writer.h>
+#include <mem_profile/peak.h>
+#include <mp_types/types.h>
+
+namespace mp {
+/// Appends periodic snapshots of the live allocations to a file, so that heap
+/// growth can be followed over the course of a run (see
+/// mem_profile_interval_ms).
+///
+/// The file holds one JSON object per line, and is flushed after every
+/// snapshot, so it can be read while the program is still running. A stack is
+/// defined the first time it appears, by the program counters of its frames
+/// (innermost first). Snapshots then refer to it by id:
+///
+/// ```
+/// {"stack":0,"pcs":[...]}
+/// {"snapshot":0,"time_ms":1000,"live_bytes":4096,"live_allocs":3,
+///  "stacks":[[0,4096,3]],"types":[{"type":"my_type","bytes":1024,"allocs":1}]}
+/// ```
+///
+/// Each entry in `stacks` is `[id, bytes, allocs]`: the change in live bytes
+/// and allocations made with that stack since the previous snapshot. Only
+/// stacks which changed are listed. `types` holds the totals for each type
+/// found on the stack when allocations were made (see live_snapshot).
+class timeline_writer {
+    template <class V>
+    using stack_map = ankerl::unordered_dense::map<thread_stack_key,
+                                                   V,
+                                                   thread_stack_key_hash,
+                                                   std::equal_to<thread_stack_key>,
+                                                   allocator<std::pair<thread_stack_key, V>>>;
+
+    std::unique_ptr<json_writer> out_;
+    /// Id of each stack which has been written to the file
+    stack_map<u32>               stack_ids_;
+    /// The live allocations at the last two snapshots
+    live_snapshot                current_;
+    live_snapshot                previous_;
+    u64                          snapshot_count_ = 0;
+    _vec<addr_t>                 pcs_;
+
+    /// Get the id of a stack, writing its definition if it's new
+    u32 stack_id(thread_stack_key key, global_context& context);
+
+    void write_snapshot_unchecked(live_alloc_table& table, global_context& context, u64 time_ms);
+
+  public:
+    /// Create the file next to `output_path`. Returns false (after printing a
+    /// warning) if it couldn't be created.
+    bool open(char const* output_path);
+
+    /// Snapshot the live allocations in `table`, and append the snapshot to
+    /// the file. New stacks are looked up in `context`, which only holds its
+    /// context_lock while they're expanded. Returns false (after printing a
+    /// warning) if the file couldn't be written.
+    bool write_snapshot(live_alloc_table& table, global_context& context, u64 time_ms);
+};
+} // namespace mp
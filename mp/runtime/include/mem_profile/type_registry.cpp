@@ -0,0 +1,113 @@
+#include <mem_profile/type_registry.h>
+
+#include <algorithm>
+#include <mem_profile/alloc.h>
+#include <mp_types/export.h>
+
+namespace mp {
+constinit type_registry TYPES{};
+
+namespace {
+/// Make room for at least `needed` elements in an array allocated with the
+/// underlying malloc. Returns false if it couldn't be grown
+template <class T>
+bool reserve(T*& data, size_t& capacity, size_t needed) noexcept {
+    if (needed <= capacity) return true;
+
+    size_t new_capacity = std::max<size_t>({needed, capacity * 2, 64});
+    auto*  new_data     = (T*)mperf_realloc(data, new_capacity * sizeof(T));
+    if (new_data == nullptr) return false;
+
+    data     = new_data;
+    capacity = new_capacity;
+    return true;
+}
+} // namespace
+
+type_id_t type_registry::push_types_locked(_mp_type_data const* first, size_t count) noexcept {
+    if (!reserve(types_, type_capacity_, type_count_ + count)) return 0;
+
+    auto first_id = type_id_t(type_count_ + 1);
+    for (size_t i = 0; i < count; i++) {
+        types_[type_count_++] = first + i;
+    }
+    return first_id;
+}
+
+void type_registry::add_section(_mp_type_data const* begin, _mp_type_data const* end) noexcept {
+    if (begin == nullptr || end <= begin) return;
+
+    auto   guard = std::lock_guard(lock_);
+    size_t count = section_count_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        if (sections_[i].begin == uintptr_t(begin)) return;
+    }
+    // Past the limit, the section's types are looked up one by one instead
+    if (count == MAX_SECTIONS) return;
+
+    type_id_t first_id = push_types_locked(begin, size_t(end - begin));
+    if (first_id == 0) return;
+
+    sections_[count] = section{uintptr_t(begin), uintptr_t(end), first_id};
+    section_count_.store(count + 1, std::memory_order_release);
+}
+
+type_id_t type_registry::id(_mp_type_data const* type) noexcept {
+    if (type == nullptr) return 0;
+
+    auto   addr  = uintptr_t(type);
+    size_t count = section_count_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        auto const& s = sections_[i];
+        if (s.begin <= addr && addr < s.end) {
+            size_t offset = addr - s.begin;
+            // A descriptor which isn't on a boundary means the section wasn't
+            // laid out as an array. Fall back on looking it up by address
+            if (offset % sizeof(_mp_type_data) != 0) break;
+            return s.first_id + type_id_t(offset / sizeof(_mp_type_data));
+        }
+    }
+    return loose_id(type);
+}
+
+type_id_t type_registry::loose_id(_mp_type_data const* type) noexcept {
+    auto guard = std::lock_guard(lock_);
+
+    auto* end = loose_ + loose_count_;
+    auto* it  = std::lower_bound(loose_, end, type, [](loose_entry const& e, auto* t) {
+        return std::less<>()(e.type, t);
+    });
+    if (it != end && it->type == type) return it->id;
+
+    size_t index = size_t(it - loose_);
+    if (!reserve(loose_, loose_capacity_, loose_count_ + 1)) return 0;
+
+    type_id_t id = push_types_locked(type, 1);
+    if (id == 0) return 0;
+
+    std::move_backward(loose_ + index, loose_ + loose_count_, loose_ + loose_count_ + 1);
+    loose_[index] = loose_entry{type, id};
+    loose_count_++;
+    return id;
+}
+
+_mp_type_data const* type_registry::operator[](type_id_t id) const noexcept {
+    auto guard = std::lock_guard(lock_);
+    return id != 0 && id <= type_count_ ? types_[id - 1] : nullptr;
+}
+
+size_t type_registry::size() const noexcept {
+    auto guard = std::lock_guard(lock_);
+    return type_count_;
+}
+
+auto type_registry::snapshot() const -> std::vector<_mp_type_data const*> {
+    auto guard = std::lock_guard(lock_);
+    return std::vector<_mp_type_data const*>(types_, types_ + type_count_);
+}
+} // namespace mp
+
+extern "C" MP_EXPORT void _mp_register_types(_mp_type_data const* begin,
+                                             _mp_type_data const* end) {
+    mp::TYPES.add_section(begin, end);
+}
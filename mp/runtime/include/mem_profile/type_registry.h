@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <mp_hook_prelude.h>
+#include <mp_types/types.h>
+
+namespace mp {
+/// Dense id of an instrumented type. 0 stands for no type
+using type_id_t = u32;
+
+/// Gives every instrumented type a dense id, so that events and live
+/// allocations can refer to a type with 4 bytes instead of a pointer to its
+/// descriptor.
+///
+/// The plugin emits a single descriptor per type into the `mp_types` section,
+/// and each instrumented module hands its section to the registry when it's
+/// loaded (see _mp_register_types). The descriptors in a section are given
+/// consecutive ids, so looking up the id of a type is a lock-free scan over
+/// the registered sections. Descriptors outside of any section (eg, from
+/// targets without named sections) are given an id the first time they're
+/// looked up, under a lock.
+///
+/// The registry is constant-initialized, and its storage is allocated with the
+/// underlying malloc and never released, so that modules can register types
+/// before the runtime's constructors run, and frees made while the runtime's
+/// globals are destroyed can still look up types.
+class type_registry {
+    struct section {
+        uintptr_t begin;
+        uintptr_t end;
+        /// id of the first descriptor in the section
+        type_id_t first_id;
+    };
+
+    constexpr static size_t MAX_SECTIONS = 256;
+
+    struct loose_entry {
+        _mp_type_data const* type;
+        type_id_t            id;
+    };
+
+    /// Sections are only written under `lock_`, before `section_count_` is
+    /// incremented, so readers can scan the first `section_count_` without
+    /// locking
+    section             sections_[MAX_SECTIONS]{};
+    std::atomic<size_t> section_count_{0};
+
+    mutable std::mutex    lock_;
+    /// Descriptor of each type, indexed by id - 1
+    _mp_type_data const** types_          = nullptr;
+    size_t                type_count_     = 0;
+    size_t                type_capacity_  = 0;
+    /// Types found outside of any section, sorted by address
+    loose_entry*          loose_          = nullptr;
+    size_t                loose_count_    = 0;
+    size_t                loose_capacity_ = 0;
+
+    /// Add ids for `count` descriptors starting at `first`. Returns the id of
+    /// the first one, or 0 if there wasn't enough memory. Requires `lock_`
+    type_id_t push_types_locked(_mp_type_data const* first, size_t count) noexcept;
+
+    /// Get (or assign) the id of a descriptor outside of any section
+    type_id_t loose_id(_mp_type_data const* type) noexcept;
+
+  public:
+    constexpr type_registry() = default;
+    type_registry(type_registry const&) = delete;
+
+    /// Assign ids to every descriptor in `begin..end`. Registering the same
+    /// section twice has no effect
+    void add_section(_mp_type_data const* begin, _mp_type_data const* end) noexcept;
+
+    /// Get the id of a type. Returns 0 if `type` is null, or if an id couldn't
+    /// be assigned
+    type_id_t id(_mp_type_data const* type) noexcept;
+
+    /// Get the descriptor of a type, or null if `id` is 0 or out of range
+    _mp_type_data const* operator[](type_id_t id) const noexcept;
+
+    /// Number of ids handed out so far
+    size_t size() const noexcept;
+
+    /// Copy the descriptor of every type, indexed by id - 1. Reports are
+    /// written from the copy, so that they don't depend on the registry
+    auto snapshot() const -> std::vector<_mp_type_data const*>;
+};
+
+/// Every type instrumented in the program
+extern type_registry TYPES;
+} // namespace mp
@@ -5,8 +5,10 @@
 #include <mp_types/types.h>
 
 #include <libunwind.h>
+#include <pthread.h>
 
 //#include <fmt/core.h>
+#include <atomic>
 #include <bit>
 #include <cstdio>
 #include <fmt/format.h>
@@ -55,9 +57,14 @@ void dec_ipp(uintptr_t* ipp, size_t count) {
     }
 }
 
-} // namespace
 
-size_t mp_unwind(size_t max_frames, uintptr_t* ipp, uintptr_t* spp) {
+std::atomic<unwind_backend> UNWIND_BACKEND = unwind_backend::LIBUNWIND;
+
+/// Unwind the stack with libunwind. This is always inlined into mp_unwind, so
+/// that the first frame is mp_unwind itself regardless of the backend.
+[[gnu::always_inline]] inline size_t unwind_libunwind(size_t     max_frames,
+                                                     uintptr_t* ipp,
+                                                     uintptr_t* spp) {
     unw_cursor_t  cursor;
     unw_context_t uc;
 
@@ -67,7 +74,9 @@ size_t mp_unwind(size_t max_frames, uintptr_t* ipp, uintptr_t* spp) {
     size_t i = 0;
     for (; i < max_frames; i++) {
         unw_get_reg(&cursor, UNW_REG_IP, ipp + i) | check("mp_unwind: Cannot read UNW_REG_IP");
-        unw_get_reg(&cursor, UNW_REG_SP, spp + i) | check("mp_unwind: Cannot read UNW_REG_SP");
+        if (spp) {
+            unw_get_reg(&cursor, UNW_REG_SP, spp + i) | check("mp_unwind: Cannot read UNW_REG_SP");
+        }
         int step_result = unw_step(&cursor) | check("mp_unwind: unable to step");
         // We reached the final frame
         if (step_result == 0) break;
@@ -77,67 +86,305 @@ size_t mp_unwind(size_t max_frames, uintptr_t* ipp, uintptr_t* spp) {
     return i;
 }
 
-size_t mp_unwind(size_t max_frames, uintptr_t* ipp) {
+
+#if MP_HAS_FP_UNWIND
+#if defined(__x86_64__)
+constexpr int FP_REGISTER = UNW_X86_64_RBP;
+#elif defined(__APPLE__)
+constexpr int FP_REGISTER = UNW_ARM64_FP;
+#else
+constexpr int FP_REGISTER = UNW_AARCH64_X29;
+#endif
+
+/// Frame records are `{ caller's frame pointer, return address }`, and the
+/// caller's stack pointer is just past the end of the record
+constexpr uintptr_t FRAME_RECORD_SIZE = 2 * sizeof(uintptr_t);
+
+/// Bounds of the current thread's stack. Frame pointers outside these bounds
+/// are never dereferenced.
+struct stack_bounds {
+    uintptr_t lo = 0;
+    uintptr_t hi = UINTPTR_MAX;
+};
+
+stack_bounds get_stack_bounds() noexcept {
+    stack_bounds bounds;
+#if defined(__APPLE__)
+    pthread_t self = pthread_self();
+    bounds.hi      = uintptr_t(pthread_get_stackaddr_np(self));
+    bounds.lo      = bounds.hi - pthread_get_stacksize_np(self);
+#else
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void*  addr = nullptr;
+        size_t size = 0;
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            bounds.lo = uintptr_t(addr);
+            bounds.hi = uintptr_t(addr) + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+#endif
+    return bounds;
+}
+
+stack_bounds const& current_stack_bounds() noexcept {
+    thread_local stack_bounds const bounds = get_stack_bounds();
+    return bounds;
+}
+
+/// Returns an address inside the calling function
+[[gnu::noinline]] uintptr_t current_pc() noexcept {
+    return uintptr_t(__builtin_return_address(0));
+}
+
+/// Check that a frame record at `fp` could belong to a frame whose stack
+/// pointer is `sp`: it's aligned, it lies within the stack, and it's at or
+/// above `sp` (the stack grows down)
+bool is_valid_record(uintptr_t fp, uintptr_t sp, stack_bounds const& bounds) noexcept {
+    return fp % sizeof(uintptr_t) == 0        //
+        && fp >= sp                           //
+        && fp >= bounds.lo                    //
+        && fp <= bounds.hi - FRAME_RECORD_SIZE;
+}
+
+/// Point a context at a frame the frame pointer walk already found, so that
+/// libunwind can start there rather than at the current frame. Only the
+/// registers needed to step out of the frame are set. Returns false if this
+/// isn't supported on the current platform.
+bool seed_context(unw_context_t& uc, uintptr_t ip, uintptr_t sp, uintptr_t fp) noexcept {
+#if defined(__linux__) && defined(__x86_64__)
+    uc.uc_mcontext.gregs[REG_RIP] = greg_t(ip);
+    uc.uc_mcontext.gregs[REG_RSP] = greg_t(sp);
+    uc.uc_mcontext.gregs[REG_RBP] = greg_t(fp);
+    return true;
+#else
+    (void)uc, (void)ip, (void)sp, (void)fp;
+    return false;
+#endif
+}
+
+/// Returned by resync_with_libunwind if the frame where the chain broke
+/// couldn't be found
+constexpr size_t RESYNC_FAILED = ~size_t();
+
+/// Continues an unwind after the frame pointer chain broke at frame `i - 1`,
+/// which has already been recorded, and whose stack pointer is `sp`.
+///
+/// libunwind is started at frame `i - 1` where possible (see seed_context).
+/// Otherwise it has to walk down from the current frame to find it again,
+/// which costs as much as a full libunwind unwind. From there, libunwind steps
+/// past the broken frames one at a time. Each frame libunwind finds is checked to see if its frame
+/// pointer can be trusted (its frame record agrees with libunwind about the
+/// next frame). As soon as one can, the frame pointer walk resumes from there.
+///
+/// Returns the number of frames recorded, and updates `sp` and `fp` to the
+/// stack pointer of the last frame recorded, and the frame pointer to resume
+/// from (0 if the unwind is finished). Returns RESYNC_FAILED if libunwind
+/// couldn't find frame `i - 1`.
+[[gnu::always_inline]] inline size_t resync_with_libunwind(size_t              max_frames,
+                                                          uintptr_t*          ipp,
+                                                          uintptr_t*          spp,
+                                                          size_t              i,
+                                                          uintptr_t&          last_sp,
+                                                          uintptr_t&          fp,
+                                                          stack_bounds const& bounds) {
     unw_cursor_t  cursor;
     unw_context_t uc;
 
     unw_getcontext(&uc) | check("mp_unwind: Unable to get context");
+    // The stack pointer of the first frame is only an estimate, so libunwind
+    // can't be started there
+    if (i > 1) seed_context(uc, ipp[i - 1], last_sp, fp);
     unw_init_local(&cursor, &uc) | check("mp_unwind: Unable to initialize cursor.");
 
-    size_t i = 0;
-    for (; i < max_frames; i++) {
-        unw_get_reg(&cursor, UNW_REG_IP, ipp + i) | check("mp_unwind: Cannot read UNW_REG_IP");
-        int step_result = unw_step(&cursor) | check("mp_unwind: unable to step");
-        // We reached the final frame
-        if (step_result == 0) break;
+    fp = 0;
+
+    // Find the last frame the frame pointer walk recorded. Frames are ordered
+    // by stack pointer, so we can stop as soon as we've passed it.
+    unw_word_t ip = 0, sp = 0;
+    for (;;) {
+        unw_get_reg(&cursor, UNW_REG_IP, &ip) | check("mp_unwind: Cannot read UNW_REG_IP");
+        unw_get_reg(&cursor, UNW_REG_SP, &sp) | check("mp_unwind: Cannot read UNW_REG_SP");
+        if (sp >= last_sp) break;
+        if ((unw_step(&cursor) | check("mp_unwind: unable to step")) == 0) break;
+    }
+
+    if (sp != last_sp || ip != ipp[i - 1]) {
+        return RESYNC_FAILED;
+    }
+
+    while (i < max_frames) {
+        // Frame pointer of the frame we're currently at, as seen by libunwind
+        unw_word_t frame_fp = 0;
+        unw_get_reg(&cursor, FP_REGISTER, &frame_fp) | check("mp_unwind: Cannot read FP");
+
+        if ((unw_step(&cursor) | check("mp_unwind: unable to step")) == 0) break;
+        unw_get_reg(&cursor, UNW_REG_IP, &ip) | check("mp_unwind: Cannot read UNW_REG_IP");
+        unw_get_reg(&cursor, UNW_REG_SP, &sp) | check("mp_unwind: Cannot read UNW_REG_SP");
+
+        ipp[i] = ip;
+        if (spp) spp[i] = sp;
+        i++;
+
+        // If the frame record agrees with libunwind about where the next frame
+        // is, the chain is intact again
+        bool resume = is_valid_record(frame_fp, last_sp, bounds)
+                   && frame_fp + FRAME_RECORD_SIZE == sp
+                   && ((uintptr_t const*)frame_fp)[1] == ip;
+
+        last_sp = sp;
+        if (resume) {
+            fp = ((uintptr_t const*)frame_fp)[0];
+            break;
+        }
     }
 
-    dec_ipp(ipp, i);
     return i;
 }
 
+/// Unwind the stack by following the chain of frame pointers. This is only
+/// accurate for code compiled with `-fno-omit-frame-pointer`. If the chain
+/// looks broken, libunwind takes over until it can be picked up again.
+///
+/// This is always inlined into mp_unwind, so that the first frame is mp_unwind
+/// itself regardless of the backend.
+[[gnu::always_inline]] inline size_t unwind_fp(size_t     max_frames,
+                                              uintptr_t* ipp,
+                                              uintptr_t* spp) {
+    if (max_frames == 0) return 0;
+
+    auto const& bounds = current_stack_bounds();
+
+    uintptr_t fp = uintptr_t(__builtin_frame_address(0));
+
+    // The first frame is the current function. We don't know its exact stack
+    // pointer, but the frame pointer is a close upper bound.
+    uintptr_t sp = fp;
+    ipp[0]       = current_pc();
+    if (spp) spp[0] = sp;
+
+    size_t i = 1;
+    while (i < max_frames && fp != 0) {
+        if (!is_valid_record(fp, sp, bounds)) {
+            i = resync_with_libunwind(max_frames, ipp, spp, i, sp, fp, bounds);
+            if (i == RESYNC_FAILED) {
+                return unwind_libunwind(max_frames, ipp, spp);
+            }
+            continue;
+        }
 
+        auto const* record = (uintptr_t const*)fp;
+        uintptr_t   ret    = record[1];
 
-size_t mp_extract_events(size_t           max_events,
-                         event_info*      event_buffer,
-                         size_t           spp_count,
-                         const uintptr_t* spp) {
-    constexpr size_t _mp_frame_information_elem_count
-        = sizeof(_mp_frame_information) / sizeof(ull_t);
+        // The outermost frame has no return address
+        if (ret == 0) break;
 
-    size_t event_i = 0;
-    for (size_t spp_i = 0; spp_i < spp_count - 1; spp_i++) {
-        unw_word_t frame_end   = spp[spp_i + 1];
-        unw_word_t frame_start = spp[spp_i];
+        sp     = fp + FRAME_RECORD_SIZE;
+        ipp[i] = ret;
+        if (spp) spp[i] = sp;
+        i++;
 
-        ull_t const* frame_start_ptr = (ull_t const*)frame_start;
-        ull_t const* frame_end_ptr   = (ull_t const*)frame_end;
+        fp = record[0];
+    }
 
+    dec_ipp(ipp, i);
+    return i;
+}
+#endif
+} // namespace
 
-        int64_t search_limit
-            = (frame_end_ptr - frame_start_ptr) - _mp_frame_information_elem_count + 1;
 
-        int search_size = std::min(search_limit, int64_t(16));
+bool set_unwind_backend(unwind_backend backend) noexcept {
+#if !MP_HAS_FP_UNWIND
+    if (backend == unwind_backend::FRAME_POINTER) return false;
+#endif
+    UNWIND_BACKEND.store(backend, std::memory_order_relaxed);
+    return true;
+}
 
-        for (int i = 0; i < search_size; i++) {
-            if (frame_start_ptr[i] == _mp_frame_tag) {
-                _mp_frame_information info;
-                __builtin_memcpy(&info, frame_start_ptr + i, sizeof(info));
+unwind_backend get_unwind_backend() noexcept {
+    return UNWIND_BACKEND.load(std::memory_order_relaxed);
+}
 
-                bool check_good = mp::check_frame(frame_start_ptr + i);
-                if (check_good) {
-                    if (event_i == max_events) return event_i;
+size_t mp_unwind(size_t max_frames, uintptr_t* ipp, uintptr_t* spp) {
+#if MP_HAS_FP_UNWIND
+    if (get_unwind_backend() == unwind_backend::FRAME_POINTER) {
+        return unwind_fp(max_frames, ipp, spp);
+    }
+#endif
+    return unwind_libunwind(max_frames, ipp, spp);
+}
 
-                    event_buffer[event_i++] = {
-                        spp_i,
-                        info.call_count,
-                        (uintptr_t)info.this_ptr,
-                        info.type_data,
-                    };
-                }
-                break;
-            }
-        }
+size_t mp_unwind(size_t max_frames, uintptr_t* ipp) {
+#if MP_HAS_FP_UNWIND
+    if (get_unwind_backend() == unwind_backend::FRAME_POINTER) {
+        return unwind_fp(max_frames, ipp, nullptr);
+    }
+#endif
+    return unwind_libunwind(max_frames, ipp, nullptr);
+}
+
+
+
+namespace {
+/// Shadow stack of the current thread, shared by every instrumented module
+/// (see _mp_get_shadow_stack)
+constinit thread_local _mp_shadow_stack LOCAL_SHADOW_STACK
+    [[gnu::tls_model("initial-exec")]]{};
+
+/// Index of the frame which called the function that pushed `entry`, if it's
+/// in `ipp[first..trace_size)`. Otherwise the function has returned (or its
+/// caller is past the end of the trace), and `trace_size` is returned.
+///
+/// A returned function's frame may still hold its old contents, so the frame
+/// itself can't be trusted. Its return address, however, is only on the call
+/// stack for as long as the function is running.
+size_t find_caller(_mp_shadow_entry const& entry,
+                   size_t                  first,
+                   size_t                  trace_size,
+                   uintptr_t const*        ipp) noexcept {
+    // Instruction pointers in the trace point into the call instruction
+    auto pc = uintptr_t(entry.return_address) - 1;
+    for (size_t i = first; i < trace_size; i++) {
+        if (ipp[i] == pc) return i;
+    }
+    return trace_size;
+}
+} // namespace
+
+size_t mp_extract_events(size_t           max_events,
+                         event_info*      event_buffer,
+                         size_t           trace_size,
+                         uintptr_t const* ipp,
+                         bool             include_members) {
+    auto const& stack = LOCAL_SHADOW_STACK;
+    // Any function which is still running is above this frame
+    auto        sp    = uintptr_t(__builtin_frame_address(0));
+
+    // The stack is ordered from the outermost object to the innermost, so
+    // it's visited from the top down, and the innermost object comes first.
+    // The trace is also innermost first, so each object's caller is found past
+    // the caller of the previous object.
+    size_t cursor  = stack.size;
+    size_t trace_i = 0;
+    size_t event_i = 0;
+    while (event_i < max_events && cursor > 0) {
+        auto const* next = &stack.entries[--cursor];
+        if (next->frame <= sp) continue;
+        if (!next->destroying && !include_members) continue;
+
+        size_t caller = find_caller(*next, trace_i, trace_size, ipp);
+        if (caller == trace_size) continue;
+
+        trace_i                 = caller + 1;
+        event_buffer[event_i++] = {
+            // The function's own frame is just before its caller
+            caller > 0 ? caller - 1 : 0,
+            next->event_id,
+            (uintptr_t)next->this_ptr,
+            next->type_data,
+        };
     }
 
     return event_i;
@@ -161,10 +408,8 @@ void mp_unwind_show_trace() {
 #define s_frame_end MP_COLOR_BB "frame_end:" MP_COLOR_Re
 #define s_frame_size MP_COLOR_BB "frame_size:" MP_COLOR_Re
 #define s_frame_info MP_COLOR_BB "frame_info:" MP_COLOR_Re
-#define s_tag MP_COLOR_BB "tag:" MP_COLOR_Re
-#define s_call_count MP_COLOR_BB "call_count:" MP_COLOR_Re
+#define s_event_id MP_COLOR_BB "event_id:" MP_COLOR_Re
 #define s_this_ptr MP_COLOR_BB "this_ptr:" MP_COLOR_Re
-#define s_checksum MP_COLOR_BB "checksum:" MP_COLOR_Re
 #define s_type_data MP_COLOR_BB "type_data:" MP_COLOR_Re
 #define s_size MP_COLOR_BB "size:" MP_COLOR_Re
 #define s_type MP_COLOR_BB "type:" MP_COLOR_Re
@@ -180,9 +425,6 @@ void mp_unwind_show_trace() {
     unw_word_t    ip, sp, offset;
     using namespace colors;
 
-    constexpr size_t _mp_frame_information_elem_count
-        = sizeof(_mp_frame_information) / sizeof(ull_t);
-
     unw_getcontext(&uc);
     unw_init_local(&cursor, &uc);
 
@@ -204,6 +446,15 @@ void mp_unwind_show_trace() {
         count++;
     } while (unw_step(&cursor) > 0);
 
+    // mp_extract_events expects instruction pointers inside the call, as
+    // returned by mp_unwind
+    uintptr_t pcs[1024];
+    for (size_t i = 0; i < count; i++) {
+        pcs[i] = ipp[i] - 1;
+    }
+    event_info objects[64];
+    size_t     object_count = mp_extract_events(64, objects, count, pcs, true);
+
     for (size_t i = 0; i < count - 1; i++) {
         unw_word_t  frame_end   = spp[i + 1];
         unw_word_t  frame_start = spp[i];
@@ -224,91 +475,66 @@ void mp_unwind_show_trace() {
                frame_size,
                frame_size);
 
-        ull_t const* frame_start_ptr = (ull_t const*)frame_start;
-        ull_t const* frame_end_ptr   = (ull_t const*)frame_end;
-
+        bool has_frame_info = false;
+        for (size_t obj_i = 0; obj_i < object_count; obj_i++) {
+            auto const& info = objects[obj_i];
+            if (info.trace_index != i) continue;
+
+            auto const& type_data = *info.type_data;
+            printf("└── " s_frame_info "\n" //
+                   "    ├── " s_event_id "   %llu\n"
+                   "    ├── " s_this_ptr "   %p\n"
+                   "    └── " s_type_data "\n"
+                   "        ├── " s_type "         " MP_COLOR_M "%s" MP_COLOR_Re "\n"
+                   "        ├── " s_size "         %zu\n"
+                   "        ├── " s_base_count "   %zu\n"
+                   "        ├── " s_bases "\n",
+                   info.event_id,
+                   (void const*)info.object_ptr,
+                   type_data.type,
+                   type_data.size,
+                   type_data.base_count);
+
+            for (size_t i = 0; i < type_data.base_count; i++) {
+                char const* joiner = "├── ";
+                if (i == type_data.base_count - 1) {
+                    joiner = "└── ";
+                }
 
-        int64_t search_limit
-            = (frame_end_ptr - frame_start_ptr) - _mp_frame_information_elem_count + 1;
+                size_t      off0 = type_data.base_offsets[i];
+                size_t      off1 = off0 + type_data.base_sizes[i];
+                char const* ty   = type_data.base_types[i];
+                printf("        │   %s       " MP_COLOR_BY "%4zu..%4zu" MP_COLOR_Re
+                       ": " MP_COLOR_M "%s" MP_COLOR_Re "\n",
+                       joiner,
+                       off0,
+                       off1,
+                       ty);
+            }
 
-        int search_size = std::min(search_limit, int64_t(16));
+            printf("        ├── " s_field_count "  %zu\n"
+                   "        └── " s_fields "\n",
+                   type_data.field_count);
 
-        bool has_frame_info = false;
-        for (int i = 0; i < search_size; i++) {
-            if (frame_start_ptr[i] == _mp_frame_tag) {
-                _mp_frame_information info;
-                __builtin_memcpy(&info, frame_start_ptr + i, sizeof(info));
-
-                bool check_good = mp::check_frame(frame_start_ptr + i);
-                auto type_data  = *info.type_data;
-                if (check_good) {
-                    printf("└── " s_frame_info MP_COLOR_GRAY
-                           "  # (at stack[%d] in frame)\n" MP_COLOR_Re //
-                           "    ├── " s_tag "        %llu\n"
-                           "    ├── " s_call_count " %llu\n"
-                           "    ├── " s_this_ptr "   %p\n"
-                           "    ├── " s_type_data "\n"
-                           "    │   ├── " s_type "         " MP_COLOR_M "%s" MP_COLOR_Re "\n"
-                           "    │   ├── " s_size "         %zu\n"
-                           "    │   ├── " s_base_count "   %zu\n"
-                           "    │   ├── " s_bases "\n",
-                           i,
-                           info.tag,
-                           info.call_count,
-                           info.this_ptr,
-                           type_data.type,
-                           type_data.size,
-                           type_data.base_count);
-
-                    for (size_t i = 0; i < type_data.base_count; i++) {
-                        char const* joiner = "├── ";
-                        if (i == type_data.base_count - 1) {
-                            joiner = "└── ";
-                        }
-
-                        size_t      off0 = type_data.base_offsets[i];
-                        size_t      off1 = off0 + type_data.base_sizes[i];
-                        char const* ty   = type_data.base_types[i];
-                        printf("    │   │   %s       " MP_COLOR_BY "%4zu..%4zu" MP_COLOR_Re
-                               ": " MP_COLOR_M "%s" MP_COLOR_Re "\n",
-                               joiner,
-                               off0,
-                               off1,
-                               ty);
-                    }
-
-                    printf("    │   ├── " s_field_count "  %zu\n"
-                           "    │   └── " s_fields "\n",
-                           type_data.field_count);
-
-                    for (size_t i = 0; i < type_data.field_count; i++) {
-                        char const* joiner = "├── ";
-                        if (i == type_data.field_count - 1) {
-                            joiner = "└── ";
-                        }
-
-                        size_t      off0 = type_data.field_offsets[i];
-                        size_t      off1 = off0 + type_data.field_sizes[i];
-                        char const* ty   = type_data.field_types[i];
-                        char const* name = type_data.field_names[i];
-                        printf("    │       %s       " MP_COLOR_BY "%4zu..%4zu" MP_COLOR_Re
-                               ": " MP_COLOR_M "%s " MP_COLOR_BG "%s" MP_COLOR_Re " \n",
-                               joiner,
-                               off0,
-                               off1,
-                               ty,
-                               name);
-                    }
-
-                    printf("    └── " s_checksum "   %llu  " MP_COLOR_GRAY
-                           "# (checksum good)\n" MP_COLOR_Re,
-                           info.checksum);
-                } else {
-                    printf("└── " s_frame_info "  <found frame with bad checksum>\n");
+            for (size_t i = 0; i < type_data.field_count; i++) {
+                char const* joiner = "├── ";
+                if (i == type_data.field_count - 1) {
+                    joiner = "└── ";
                 }
-                has_frame_info = true;
-                break;
+
+                size_t      off0 = type_data.field_offsets[i];
+                size_t      off1 = off0 + type_data.field_sizes[i];
+                char const* ty   = type_data.field_types[i];
+                char const* name = type_data.field_names[i];
+                printf("                %s   " MP_COLOR_BY "%4zu..%4zu" MP_COLOR_Re
+                       ": " MP_COLOR_M "%s " MP_COLOR_BG "%s" MP_COLOR_Re " \n",
+                       joiner,
+                       off0,
+                       off1,
+                       ty,
+                       name);
             }
+            has_frame_info = true;
         }
         if (!has_frame_info) {
             printf("└── " s_frame_info "  <none>\n");
@@ -318,3 +544,7 @@ void mp_unwind_show_trace() {
     puts("End backtrace");
 }
 } // namespace mp
+
+extern "C" MP_EXPORT mp::_mp_shadow_stack* _mp_get_shadow_stack() {
+    return &mp::LOCAL_SHADOW_STACK;
+}
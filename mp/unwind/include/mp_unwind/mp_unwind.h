@@ -28,18 +28,51 @@ struct stack_counts {
     size_t event_count;
 };
 
+#if defined(__x86_64__) || defined(__aarch64__)
+#define MP_HAS_FP_UNWIND 1
+#else
+#define MP_HAS_FP_UNWIND 0
+#endif
+
+/// Strategy used by mp_unwind to walk the stack
+enum class unwind_backend {
+    /// Use libunwind, which reads DWARF call frame information. Works with any
+    /// code, but is comparatively slow.
+    LIBUNWIND,
+    /// Follow the chain of frame pointers. Much faster, but only accurate for
+    /// code compiled with `-fno-omit-frame-pointer`. If the chain looks broken,
+    /// libunwind is used to step past the broken frames.
+    FRAME_POINTER,
+};
+
+/// Select the backend used by mp_unwind. Returns false (and leaves the backend
+/// unchanged) if the backend isn't supported on this platform.
+bool set_unwind_backend(unwind_backend backend) noexcept;
+
+/// Get the backend currently used by mp_unwind. Defaults to libunwind
+unwind_backend get_unwind_backend() noexcept;
+
 /// Unwind the stack. Only record instruction pointers, not stack pointers
 size_t mp_unwind(size_t max_frames, uintptr_t* ipp);
 
 /// Performs stack unwind. Unwinds up to max_frames. Returns the number of frames unwound.
 size_t mp_unwind(size_t max_frames, uintptr_t* ipp, uintptr_t* spp);
 
-/// Scan the stack for event info. `spp` is an array of stack locations
-/// delimiting each stack framej
+/// Get the objects whose destructors are running on the current thread, from
+/// the innermost to the outermost, by reading the shadow stacks pushed by
+/// instrumented destructors (see save_state). The stack itself isn't scanned.
+/// If `include_members` is set, objects whose instrumented constructors or
+/// member functions are running are included too (see save_member_state).
+///
+/// `ipp` is the trace of the current thread, as produced by mp_unwind. An
+/// object is only reported if the return address of its function is found in
+/// the trace, which filters out functions that have already returned. The
+/// `trace_index` of each object is the index of its function's frame.
 size_t mp_extract_events(size_t           max_events,
                          event_info*      event_buffer,
-                         size_t           spp_count,
-                         uintptr_t const* spp);
+                         size_t           trace_size,
+                         uintptr_t const* ipp,
+                         bool             include_members = false);
 
 
 /// Print a trace to standard out
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+/// Fail the test if the condition is false, printing where, and what was
+/// checked. Tests are plain executables, which ctest runs and checks the exit
+/// code of. Variadic, so conditions may contain unparenthesized commas
+#define CHECK(...)                                                                                 \
+    do {                                                                                           \
+        if (!(__VA_ARGS__)) {                                                                      \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #__VA_ARGS__);   \
+            std::exit(1);                                                                          \
+        }                                                                                          \
+    } while (0)
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+
+/// Instrumented by both translation units of test_plugin_types, since its
+/// destructor is inline. Its descriptor must still only be emitted once.
+struct shared_widget {
+    std::vector<int> values;
+
+    ~shared_widget() { values.clear(); }
+};
+
+/// Defined in plugin_types_other.cpp
+void destroy_widgets_in_other_tu();
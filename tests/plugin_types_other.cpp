@@ -0,0 +1,17 @@
+/// Second translation unit of test_plugin_types
+#include <plugin_types.h>
+
+namespace {
+/// Has the same name as the type in test_plugin_types.cpp, but no linkage, so
+/// each translation unit has its own descriptor
+struct local_widget {
+    std::vector<int> values;
+
+    ~local_widget() { values.clear(); }
+};
+} // namespace
+
+void destroy_widgets_in_other_tu() {
+    auto shared = shared_widget{{1, 2, 3}};
+    auto local  = local_widget{{1, 2, 3}};
+}
@@ -0,0 +1,82 @@
+/// Preloaded after the runtime by test_realloc_order, so that it sits between
+/// the runtime and the C library. Once armed, the next realloc on the arming
+/// thread moves the allocation, and hands the old address to the next malloc
+/// on the target thread before it returns. This reproduces a realloc racing
+/// with an allocation on another thread which is given the same address.
+#include <mp_types/export.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+
+namespace {
+using malloc_fn  = void* (*)(size_t);
+using realloc_fn = void* (*)(void*, size_t);
+
+std::atomic<void (*)()> armed_callback = nullptr;
+std::atomic<void*>      handoff        = nullptr;
+pthread_t               armed_thread;
+pthread_t               handoff_thread;
+
+/// Allocations made while the real functions are being looked up (dlsym may
+/// allocate) come from here
+alignas(16) char bootstrap_buffer[4096];
+std::atomic<size_t> bootstrap_used = 0;
+thread_local bool   resolving      = false;
+
+template <class F>
+F resolve(std::atomic<F>& fn, char const* name) {
+    auto result = fn.load(std::memory_order_acquire);
+    if (result == nullptr) {
+        resolving = true;
+        result    = (F)dlsym(RTLD_NEXT, name);
+        resolving = false;
+        fn.store(result, std::memory_order_release);
+    }
+    return result;
+}
+
+std::atomic<malloc_fn>  real_malloc  = nullptr;
+std::atomic<realloc_fn> real_realloc = nullptr;
+} // namespace
+
+extern "C" {
+/// The next realloc on the calling thread calls `callback` after the old
+/// address is handed off, and the next malloc on `thread` returns that address
+MP_EXPORT void mp_test_arm_realloc(pthread_t thread, void (*callback)()) {
+    armed_thread   = pthread_self();
+    handoff_thread = thread;
+    armed_callback.store(callback);
+}
+
+MP_EXPORT void* __libc_malloc(size_t n) {
+    if (resolving) {
+        size_t off = bootstrap_used.fetch_add((n + 15) & ~size_t(15));
+        return off + n <= sizeof(bootstrap_buffer) ? bootstrap_buffer + off : nullptr;
+    }
+    if (handoff.load() != nullptr && pthread_equal(pthread_self(), handoff_thread)) {
+        return handoff.exchange(nullptr);
+    }
+    return resolve(real_malloc, "__libc_malloc")(n);
+}
+
+MP_EXPORT void* __libc_realloc(void* hint, size_t n) {
+    auto callback = armed_callback.load();
+    if (callback == nullptr || hint == nullptr || !pthread_equal(pthread_self(), armed_thread)) {
+        return resolve(real_realloc, "__libc_realloc")(hint, n);
+    }
+
+    armed_callback.store(nullptr);
+
+    // Move the allocation, and give the old address to the target thread
+    // rather than freeing it, as if the C library had reused it
+    void* result = resolve(real_malloc, "__libc_malloc")(n);
+    std::memcpy(result, hint, malloc_usable_size(hint) < n ? malloc_usable_size(hint) : n);
+    handoff.store(hint);
+    callback();
+    return result;
+}
+}
@@ -0,0 +1,216 @@
+/// Tests for the plugin's instrument_filter: parsing rules and config files,
+/// and deciding which types in a translation unit are instrumented
+#include <check.h>
+
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Tooling/Tooling.h>
+#include <mp_ast/instrument_filter.h>
+
+using namespace mp;
+
+namespace {
+bool matches(char const* pattern, char const* name) {
+    auto p = name_pattern();
+    CHECK(name_pattern::parse(pattern, p).empty());
+    return p.matches(name);
+}
+
+auto make_filter(std::initializer_list<char const*> rules) -> instrument_filter {
+    auto filter = instrument_filter();
+    for (char const* rule : rules) {
+        CHECK(filter.add_rule(rule).empty());
+    }
+    return filter;
+}
+
+void test_patterns() {
+    // Globs match the whole name
+    CHECK(matches("std::*", "std::vector<int>"));
+    CHECK(!matches("std::*", "mystd::vector"));
+    CHECK(matches("app::Widget", "app::Widget"));
+    CHECK(!matches("app::Widget", "app::Widget2"));
+
+    // Regular expressions match anywhere, unless they're anchored
+    CHECK(matches("re:Node", "mylib::NodeList"));
+    CHECK(matches("re:^mylib::.*Node$", "mylib::TreeNode"));
+    CHECK(!matches("re:^mylib::.*Node$", "mylib::TreeNodeList"));
+    CHECK(!matches("re:^mylib::.*Node$", "other::mylib::TreeNode"));
+
+    auto p = name_pattern();
+    CHECK(!name_pattern::parse("re:(", p).empty());
+    CHECK(!name_pattern::parse("[", p).empty());
+}
+
+void test_rules() {
+    auto filter = instrument_filter();
+    CHECK(filter.empty());
+    CHECK(!filter.add_rule("allow-types=app::*").empty());
+    CHECK(!filter.add_rule("deny-type=").empty());
+    CHECK(!filter.add_rule("deny-type=re:(").empty());
+    CHECK(filter.empty());
+
+    CHECK(filter.add_rule(" deny-namespace=std ").empty());
+    CHECK(!filter.empty());
+    CHECK(!make_filter({"main-file-only"}).empty());
+
+    // instrument-methods doesn't filter any types
+    CHECK(!filter.instruments_methods());
+    auto methods = make_filter({"instrument-methods"});
+    CHECK(methods.instruments_methods());
+    CHECK(methods.empty());
+
+    // Config files can only be named by plugin arguments
+    auto error = filter.add_rule("config=/nonexistent", false);
+    CHECK(error == "config files can't name other config files");
+    CHECK(!filter.add_rule("config=/nonexistent").empty());
+}
+
+void test_config_file() {
+    auto path  = std::filesystem::temp_directory_path() / "mp_test_filter.cfg";
+    auto write = [&](char const* contents) { std::ofstream(path) << contents; };
+
+    write("# Instrument the app, but not its internals\n"
+          "\n"
+          "allow-namespace=app\n"
+          "  deny-type=re:Internal$  \n"
+          "instrument-methods\n");
+    auto filter = instrument_filter();
+    CHECK(filter.add_config_file(path.string()).empty());
+    CHECK(!filter.empty());
+    CHECK(filter.instruments_methods());
+
+    // Errors name the file and line. A config file can't name another
+    write("allow-type=app::*\n"
+          "config=other.cfg\n");
+    auto error = filter.add_config_file(path.string());
+    CHECK(error == path.string() + ":2: config files can't name other config files");
+
+    write("allow-type=app::*\n"
+          "bogus\n");
+    CHECK(filter.add_config_file(path.string()) == path.string() + ":2: unrecognized rule 'bogus'");
+
+    std::filesystem::remove(path);
+    CHECK(!filter.add_config_file(path.string()).empty());
+}
+
+/// Records defined in a translation unit, by qualified name. Inline namespaces
+/// are spelled out (eg, `std::__cxx11::basic_string`)
+struct test_tu {
+    std::unique_ptr<ASTUnit>                    ast;
+    PrintingPolicy                              pol;
+    std::map<std::string, CXXRecordDecl const*> records;
+
+    test_tu(std::unique_ptr<ASTUnit> unit)
+      : ast(std::move(unit))
+      , pol(ast->getASTContext().getPrintingPolicy()) {
+        // Types are named the same way as in the plugin (see ast_tools)
+        pol.adjustForCPlusPlus();
+        collect(ast->getASTContext().getTranslationUnitDecl(), "");
+    }
+
+    void collect(DeclContext const* dc, std::string const& prefix) {
+        for (auto const* decl : dc->decls()) {
+            auto const* record = dyn_cast<CXXRecordDecl>(decl);
+            if (auto const* tmpl = dyn_cast<ClassTemplateDecl>(decl)) {
+                record = tmpl->getTemplatedDecl();
+            }
+            if (record != nullptr && record->isThisDeclarationADefinition()) {
+                records[prefix + record->getNameAsString()] = record;
+            }
+            if (auto const* ns = dyn_cast<NamespaceDecl>(decl)) {
+                collect(ns, prefix + ns->getNameAsString() + "::");
+            }
+        }
+    }
+
+    bool instrumented(instrument_filter& filter, std::string const& name) {
+        auto it = records.find(name);
+        CHECK(it != records.end());
+        return filter.should_instrument(it->second, ast->getASTContext(), pol);
+    }
+};
+
+auto build_tu() -> test_tu {
+    auto header = std::string("namespace lib { struct Buffer {}; }\n");
+    // Declared the way libstdc++ declares it, in an inline namespace
+    auto string = std::string("namespace std {\n"
+                              "inline namespace __cxx11 {\n"
+                              "    template <class CharT> class basic_string {};\n"
+                              "}\n"
+                              "}\n");
+    auto code   = std::string("#include \"lib/buffer.h\"\n"
+                              "#include \"lib/string.h\"\n"
+                              "struct Global {};\n"
+                              "namespace app {\n"
+                              "    struct Widget {};\n"
+                              "    struct WidgetInternal {};\n"
+                              "    namespace detail { struct Node {}; }\n"
+                              "}\n");
+    auto unit   = tooling::buildASTFromCodeWithArgs(
+        code,
+        {"-std=c++17"},
+        "/mp_test/main.cpp",
+        "test_instrument_filter",
+        std::make_shared<PCHContainerOperations>(),
+        tooling::getClangStripDependencyFileAdjuster(),
+        {{"/mp_test/lib/buffer.h", header}, {"/mp_test/lib/string.h", string}});
+    CHECK(unit != nullptr);
+    CHECK(!unit->getDiagnostics().hasErrorOccurred());
+    return test_tu(std::move(unit));
+}
+
+void test_decisions() {
+    auto tu = build_tu();
+
+    // No rules: everything is instrumented
+    auto all = instrument_filter();
+    CHECK(tu.instrumented(all, "Global"));
+    CHECK(tu.instrumented(all, "lib::Buffer"));
+
+    // Deny rules take precedence over allow rules
+    auto app = make_filter({"allow-namespace=app", "deny-type=re:Internal$"});
+    CHECK(tu.instrumented(app, "app::Widget"));
+    CHECK(!tu.instrumented(app, "app::WidgetInternal"));
+    CHECK(!tu.instrumented(app, "Global"));
+    CHECK(!tu.instrumented(app, "lib::Buffer"));
+    // A namespace also covers the namespaces nested inside it
+    CHECK(tu.instrumented(app, "app::detail::Node"));
+    auto detail = make_filter({"allow-namespace=app::detail"});
+    CHECK(tu.instrumented(detail, "app::detail::Node"));
+    CHECK(!tu.instrumented(detail, "app::Widget"));
+
+    // Inline namespaces are skipped
+    auto std_ns = make_filter({"deny-namespace=std"});
+    CHECK(!tu.instrumented(std_ns, "std::__cxx11::basic_string"));
+    CHECK(tu.instrumented(std_ns, "app::Widget"));
+    auto cxx11 = make_filter({"deny-namespace=std::__cxx11"});
+    CHECK(tu.instrumented(cxx11, "std::__cxx11::basic_string"));
+
+    // With only deny rules, everything else is instrumented
+    auto deny = make_filter({"deny-type=app::*"});
+    CHECK(!tu.instrumented(deny, "app::Widget"));
+    CHECK(tu.instrumented(deny, "Global"));
+
+    // Types are matched by the path of the file that defines them
+    auto paths = make_filter({"deny-path=*/lib/*"});
+    CHECK(!tu.instrumented(paths, "lib::Buffer"));
+    CHECK(tu.instrumented(paths, "app::Widget"));
+    auto main_file = make_filter({"main-file-only"});
+    CHECK(!tu.instrumented(main_file, "lib::Buffer"));
+    CHECK(tu.instrumented(main_file, "Global"));
+}
+} // namespace
+
+int main() {
+    test_patterns();
+    test_rules();
+    test_config_file();
+    test_decisions();
+}
@@ -0,0 +1,109 @@
+/// Tests for the live allocation table, checked against a std::map
+#include <check.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <mem_profile/live_table.h>
+
+using namespace mp;
+
+namespace {
+/// The table is large, so tests share one, and leave it empty when they're done
+live_alloc_table TABLE;
+
+void* as_ptr(addr_t addr) { return (void*)addr; }
+
+/// Check that the table holds exactly the allocations in `expected`
+void check_contents(std::map<addr_t, u64> const& expected) {
+    u64 bytes = 0;
+    for (auto const& [ptr, size] : expected) bytes += size;
+    CHECK(TABLE.live_bytes() == bytes);
+
+    size_t count = 0;
+    TABLE.for_each([&](addr_t ptr, live_alloc const& alloc) {
+        auto it = expected.find(ptr);
+        CHECK(it != expected.end());
+        CHECK(alloc.size == it->second);
+        count++;
+    });
+    CHECK(count == expected.size());
+}
+
+void test_grow() {
+    // Enough pointers that every shard grows several times
+    auto expected = std::map<addr_t, u64>();
+    for (addr_t i = 1; i <= 100000; i++) {
+        TABLE.insert(as_ptr(i * 16), live_alloc{i, i, stack_id_t(i), 0, 1, 0});
+        expected[i * 16] = i;
+    }
+    check_contents(expected);
+
+    for (addr_t i = 1; i <= 100000; i++) {
+        auto alloc = live_alloc();
+        CHECK(TABLE.erase(as_ptr(i * 16), alloc));
+        CHECK(alloc.size == i);
+        CHECK(alloc.alloc_id == i);
+        CHECK(alloc.stack_id == stack_id_t(i));
+    }
+    check_contents({});
+}
+
+void test_replace() {
+    // Inserting a pointer twice (eg, if its free wasn't seen) replaces it
+    TABLE.insert(as_ptr(0x1000), live_alloc{100});
+    TABLE.insert(as_ptr(0x1000), live_alloc{30});
+    check_contents({{0x1000, 30}});
+
+    auto alloc = live_alloc();
+    CHECK(TABLE.erase(as_ptr(0x1000), alloc));
+    CHECK(alloc.size == 30);
+    CHECK(!TABLE.erase(as_ptr(0x1000), alloc));
+    check_contents({});
+}
+
+void test_random_churn() {
+    // A small range of pointers, so that probe sequences collide and wrap
+    // around the end of the slots. Every erase moves later entries back
+    // (backward-shift deletion), and entries must stay reachable afterwards
+    auto rng      = std::mt19937_64(1);
+    auto expected = std::map<addr_t, u64>();
+    for (size_t i = 0; i < 2000000; i++) {
+        addr_t ptr = (rng() % 20000 + 1) * 16;
+        if (rng() % 2) {
+            u64 size = rng() % 1000;
+            TABLE.insert(as_ptr(ptr), live_alloc{size});
+            expected[ptr] = size;
+        } else {
+            auto alloc = live_alloc();
+            bool found = TABLE.erase(as_ptr(ptr), alloc);
+            auto it    = expected.find(ptr);
+            CHECK(found == (it != expected.end()));
+            if (found) {
+                CHECK(alloc.size == it->second);
+                expected.erase(it);
+            }
+        }
+    }
+    check_contents(expected);
+
+    // Drain the table in a random order
+    auto ptrs = std::vector<addr_t>();
+    for (auto const& [ptr, size] : expected) ptrs.push_back(ptr);
+    std::shuffle(ptrs.begin(), ptrs.end(), rng);
+    for (addr_t ptr : ptrs) {
+        auto alloc = live_alloc();
+        CHECK(TABLE.erase(as_ptr(ptr), alloc));
+        CHECK(alloc.size == expected[ptr]);
+    }
+    check_contents({});
+}
+} // namespace
+
+int main() {
+    test_grow();
+    test_replace();
+    test_random_churn();
+}
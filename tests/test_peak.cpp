@@ -0,0 +1,95 @@
+/// Tests for peak mode's snapshots of the live allocations
+#include <check.h>
+
+#include <mem_profile/peak.h>
+
+using namespace mp;
+
+namespace {
+/// The table is large, so tests share one, and leave it empty when they're done
+live_alloc_table TABLE;
+
+void* as_ptr(addr_t addr) { return (void*)addr; }
+
+void alloc(peak_tracker& peak, addr_t ptr, live_alloc const& a) {
+    TABLE.insert(as_ptr(ptr), a);
+    peak.on_alloc(a, TABLE);
+}
+
+void release(peak_tracker& peak, addr_t ptr) {
+    auto a = live_alloc();
+    CHECK(TABLE.erase(as_ptr(ptr), a));
+    peak.on_free(a);
+}
+
+void test_exact_peak() {
+    // With a ratio of 1, the snapshot is taken at the true peak
+    auto peak = peak_tracker(1.0);
+    for (addr_t i = 1; i <= 10; i++) {
+        alloc(peak, i * 16, live_alloc{100, 0, stack_id_t(i % 2 + 1), 0, 1, type_id_t(i % 2)});
+    }
+    for (addr_t i = 1; i <= 5; i++) {
+        release(peak, i * 16);
+    }
+    alloc(peak, 0x1000, live_alloc{50, 0, 3, 1, 1, 0});
+
+    auto s = peak.snapshot();
+    CHECK(s.max_bytes == 1000);
+    CHECK(s.live.num_bytes == 1000);
+    CHECK(s.live.num_allocs == 10);
+    CHECK(s.by_stack.size() == 2);
+    CHECK(s.by_stack[thread_stack_key{0, 1}].num_bytes == 500);
+    CHECK(s.by_stack[thread_stack_key{0, 2}].num_allocs == 5);
+    CHECK(s.by_type[0].num_bytes == 500);
+    CHECK(s.by_type[1].num_bytes == 500);
+
+    for (addr_t i = 6; i <= 10; i++) {
+        release(peak, i * 16);
+    }
+    release(peak, 0x1000);
+}
+
+void test_ratio() {
+    // Snapshots are only taken once usage grows by the ratio, so the one
+    // which is kept is within that ratio of the true peak
+    auto peak = peak_tracker(1.5);
+    for (addr_t i = 1; i <= 1000; i++) {
+        alloc(peak, i * 16, live_alloc{10, 0, 1, 0, 1, 0});
+    }
+    auto s = peak.snapshot();
+    CHECK(s.max_bytes == 10000);
+    CHECK(s.live.num_bytes <= s.max_bytes);
+    CHECK(double(s.live.num_bytes) * 1.5 >= double(s.max_bytes));
+
+    for (addr_t i = 1; i <= 1000; i++) {
+        release(peak, i * 16);
+    }
+    // Falling usage never replaces the snapshot of the peak
+    alloc(peak, 0x10, live_alloc{10, 0, 1, 0, 1, 0});
+    CHECK(peak.snapshot().live.num_bytes == s.live.num_bytes);
+    release(peak, 0x10);
+}
+
+void test_weights() {
+    // When sampling, an allocation stands for `weight` allocations
+    auto peak = peak_tracker(1.0);
+    alloc(peak, 0x10, live_alloc{100, 0, 1, 0, 4, 0});
+    alloc(peak, 0x20, live_alloc{1000, 0, 2, 0, 1.25f, 0});
+
+    auto s = peak.snapshot();
+    CHECK(s.max_bytes == 400 + 1250);
+    CHECK(s.live.num_bytes == 400 + 1250);
+    CHECK(s.live.num_allocs == 4 + 1);
+    CHECK(s.by_stack[thread_stack_key{0, 1}].num_allocs == 4);
+
+    release(peak, 0x10);
+    release(peak, 0x20);
+}
+} // namespace
+
+int main() {
+    test_exact_peak();
+    test_ratio();
+    test_weights();
+    CHECK(TABLE.live_bytes() == 0);
+}
@@ -0,0 +1,61 @@
+/// Built with the plugin. Checks that every instrumented type has its
+/// descriptor in the module's `mp_types` section, once per type with linkage,
+/// and that the module hands the section to _mp_register_types as it's loaded.
+#include <check.h>
+
+#include <plugin_types.h>
+
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace {
+struct local_widget {
+    std::vector<int> values;
+
+    ~local_widget() { values.clear(); }
+};
+
+/// Written during static initialization, before main runs. Zero-initialized
+/// before any constructor runs, so the order doesn't matter.
+int                  register_calls;
+_mp_type_data const* registered_begin;
+_mp_type_data const* registered_end;
+} // namespace
+
+/// Stands in for the runtime, which this test doesn't load
+extern "C" void _mp_register_types(_mp_type_data const* begin, _mp_type_data const* end) {
+    register_calls++;
+    registered_begin = begin;
+    registered_end   = end;
+}
+
+int main() {
+    destroy_widgets_in_other_tu();
+    {
+        auto shared = shared_widget{{1, 2, 3}};
+        auto local  = local_widget{{1, 2, 3}};
+    }
+
+    // The module registered its own section, once
+    CHECK(register_calls == 1);
+    CHECK(__start_mp_types != nullptr);
+    CHECK(registered_begin == __start_mp_types);
+    CHECK(registered_end == __stop_mp_types);
+
+    auto counts = std::map<std::string, int>();
+    for (auto const* type = __start_mp_types; type != __stop_mp_types; type++) {
+        CHECK(type->type != nullptr);
+        counts[type->type]++;
+    }
+
+    // Descriptors of types with linkage are merged across translation units.
+    // Types without linkage get one per translation unit
+    CHECK(counts["shared_widget"] == 1);
+    int local_count = 0;
+    for (auto const& [name, count] : counts) {
+        if (std::string_view(name).ends_with("local_widget")) local_count += count;
+        if (name.find("(anonymous namespace)") == std::string::npos) CHECK(count == 1);
+    }
+    CHECK(local_count == 2);
+}
@@ -0,0 +1,149 @@
+/// Checks that a realloc is ordered correctly against an allocation on another
+/// thread which is given the address the realloc released. The test runs
+/// itself as a workload, with the runtime and realloc_shim preloaded, and
+/// reads back the binary report it writes.
+#include <check.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <pthread.h>
+#include <semaphore>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <mem_profile/counters.h>
+#include <mp_format/mpb.h>
+
+using namespace mp;
+using mpb::column;
+
+extern "C" [[gnu::weak]] void mp_test_arm_realloc(pthread_t thread, void (*callback)());
+
+namespace {
+std::binary_semaphore b_ready(0);
+std::binary_semaphore b_go(0);
+std::binary_semaphore b_done(0);
+
+/// Called by realloc_shim once the realloc has released its hint, before it
+/// returns. Thread B allocates in the meantime.
+void on_realloc() {
+    b_go.release();
+    b_done.acquire();
+}
+
+/// A reallocs an allocation while B allocates, and B is given the address A
+/// released. Prints that address.
+int run_workload() {
+    CHECK(mp_test_arm_realloc != nullptr);
+
+    void* b_ptr = nullptr;
+    auto  b     = std::thread([&] {
+        std::free(std::malloc(16));
+        b_ready.release();
+        b_go.acquire();
+        b_ptr = std::malloc(64);
+        b_done.release();
+    });
+    b_ready.acquire();
+
+    void* a_ptr = std::malloc(64);
+    auto  addr  = uintptr_t(a_ptr);
+    mp_test_arm_realloc(b.native_handle(), on_realloc);
+    void* moved = std::realloc(a_ptr, 4096);
+    b.join();
+
+    CHECK(uintptr_t(b_ptr) == addr);
+    std::printf("%llu\n", (unsigned long long)addr);
+    std::fflush(stdout);
+
+    std::free(moved);
+    std::free(b_ptr);
+    return 0;
+}
+
+/// Every value of a column, across all of its blocks
+auto values(mpb::report_view const& r, column col) -> std::vector<u64> {
+    auto out = std::vector<u64>();
+    for (u32 block = 0; auto const* s = r.find(col, block); block++) {
+        r.for_each_value(*s, [&](u64 v) { out.push_back(v); });
+    }
+    return out;
+}
+
+void test_realloc_order(char const* self) {
+    auto path = std::filesystem::temp_directory_path() / "mp_test_realloc_order.mpb";
+    auto cmd  = std::string("LD_PRELOAD='" MP_RUNTIME_PATH " " MP_REALLOC_SHIM_PATH "' ")
+             + "MEM_PROFILE_OUT='" + path.string() + "' '" + self + "' workload";
+
+    FILE* child = popen(cmd.c_str(), "r");
+    CHECK(child != nullptr);
+    unsigned long long addr = 0;
+    CHECK(std::fscanf(child, "%llu", &addr) == 1);
+    CHECK(pclose(child) == 0);
+
+    auto file = std::ifstream(path, std::ios::binary);
+    auto data = std::string(std::istreambuf_iterator<char>(file), {});
+    std::filesystem::remove(path);
+
+    auto r = mpb::report_view();
+    CHECK(r.open(data.data(), data.size()));
+
+    auto type   = values(r, column::EVENT_TYPE);
+    auto ptr    = values(r, column::EVENT_ALLOC_ADDR);
+    auto hint   = values(r, column::EVENT_ALLOC_HINT);
+    auto origin = values(r, column::EVENT_ORIGIN_ID);
+    CHECK(type.size() == ptr.size() && type.size() == hint.size() && type.size() == origin.size());
+
+    // In report order, an address is only allocated while it isn't live, and
+    // each free refers to the allocation which is live at its address
+    auto live = std::unordered_map<u64, u64>();
+    for (u64 i = 0; i < type.size(); i++) {
+        if (ptr[i] == 0) continue;
+        if (type[i] == u64(event_type::FREE)) {
+            auto it = live.find(ptr[i]);
+            CHECK(it != live.end());
+            CHECK(it->second == origin[i]);
+            live.erase(it);
+        } else {
+            CHECK(live.emplace(ptr[i], i).second);
+        }
+    }
+
+    // At the contested address: A's allocation, the free made by its realloc,
+    // then B's allocation and its free
+    auto at_addr = std::vector<u64>();
+    for (u64 i = 0; i < type.size(); i++) {
+        if (ptr[i] == addr) at_addr.push_back(i);
+    }
+    CHECK(at_addr.size() == 4);
+    CHECK(type[at_addr[0]] == u64(event_type::ALLOC));
+    CHECK(type[at_addr[1]] == u64(event_type::FREE));
+    CHECK(origin[at_addr[1]] == at_addr[0]);
+    CHECK(type[at_addr[2]] == u64(event_type::ALLOC));
+    CHECK(type[at_addr[3]] == u64(event_type::FREE));
+    CHECK(origin[at_addr[3]] == at_addr[2]);
+
+    // The realloc's new allocation comes after its free
+    size_t moved_count = 0;
+    for (u64 i = 0; i < type.size(); i++) {
+        if (hint[i] != addr) continue;
+        CHECK(type[i] == u64(event_type::ALLOC));
+        CHECK(i > at_addr[1]);
+        moved_count++;
+    }
+    CHECK(moved_count == 1);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string_view(argv[1]) == "workload") return run_workload();
+
+    auto self = std::filesystem::read_symlink("/proc/self/exe");
+    test_realloc_order(self.c_str());
+}
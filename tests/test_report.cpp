@@ -0,0 +1,187 @@
+/// Tests for binary (.mpb) event reports: events are written from a spool, and
+/// read back with mpb::report_view
+#include <check.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <mem_profile/output_record.h>
+#include <mp_format/mpb.h>
+
+using namespace mp;
+using mpb::column;
+
+namespace {
+/// Appends records to a spool, as if they were recorded by thread 0
+struct spool_builder {
+    spool_file  spool;
+    std::string pending;
+
+    /// `origin` is the id of the event which made the allocation this event
+    /// releases, as found in the live table when the event was recorded
+    void add(event_type                       type,
+             u64                              id,
+             u64                              size,
+             u64                              ptr,
+             u64                              hint,
+             stack_id_t                       stack,
+             u64                              origin  = 0,
+             std::vector<spool_object> const& objects = {}) {
+        auto event = spool_event{
+            id,
+            size,
+            ptr,
+            hint,
+            u32(type),
+            stack,
+            u32(objects.size()),
+            1,
+            origin,
+            0,
+            0,
+        };
+        pending.append(as_bytes(event).data(), sizeof(event));
+        auto obj = as_bytes(objects.data(), objects.size());
+        pending.append(obj.data(), obj.size());
+        // Split the records into several chunks
+        if (pending.size() > 4096) flush();
+    }
+
+    void flush() {
+        CHECK(spool.append(0, byte_view(pending.data(), pending.size()), {}));
+        pending.clear();
+    }
+};
+
+/// Every value of a column, across all of its blocks
+auto values(mpb::report_view const& r, column col) -> std::vector<u64> {
+    auto out = std::vector<u64>();
+    for (u32 block = 0; auto const* s = r.find(col, block); block++) {
+        r.for_each_value(*s, [&](u64 v) { out.push_back(v); });
+    }
+    return out;
+}
+
+/// Number of blocks a column is split into
+size_t block_count(mpb::report_view const& r, column col) {
+    size_t count = 0;
+    while (r.find(col, u32(count)) != nullptr) count++;
+    return count;
+}
+
+constexpr size_t EXTRA_EVENTS = mpb::EVENTS_PER_BLOCK + 10;
+
+void test_event_report() {
+    // Frames are only symbolized when the report is read
+    ::setenv("MEM_PROFILE_SYMBOLIZE", "deferred", 1);
+
+    auto         path      = std::filesystem::temp_directory_path() / "mp_test_report.mpb";
+    static auto  type_a    = _mp_type_data{8, "A"};
+    static auto  type_b    = _mp_type_data{16, "B"};
+    auto         types     = std::vector<_mp_type_data const*>{&type_a, &type_b};
+    addr_t const trace_a[] = {0x30, 0x20, 0x10};
+    addr_t const trace_b[] = {0x40, 0x20, 0x10};
+
+    auto stacks  = stack_trie();
+    auto stack_a = stacks.intern(trace_a, 3);
+    auto stack_b = stacks.intern(trace_b, 3);
+
+    auto b = spool_builder();
+    CHECK(b.spool.open(path.c_str()));
+    b.add(event_type::ALLOC, 1, 100, 0x1000, 0, stack_a);
+    b.add(event_type::ALLOC, 2, 200, 0x2000, 0, stack_b, 0, {{7, 0x50, 1, 1}});
+    b.add(event_type::REALLOC, 3, 300, 0x3000, 0x1000, stack_a, 1);
+    // Frees are recorded with the size and origin of the allocation they
+    // release. Objects of unknown types are left out
+    auto freed_objects = std::vector<spool_object>{{9, 0x60, 0, 2}, {7, 0x50, 1, 1}, {8, 0, 0, 9}};
+    b.add(event_type::FREE, 4, 200, 0x2000, 0, stack_b, 2, freed_objects);
+    b.add(event_type::FREE, 5, 0, 0x9000, 0, stack_b);
+    b.add(event_type::FREE, 6, 300, 0x3000, 0, stack_a, 3);
+    for (size_t i = 0; i < EXTRA_EVENTS; i++) {
+        b.add(event_type::ALLOC, 7 + i, 8, 0x100000 + i * 16, 0, stack_b);
+    }
+    b.flush();
+
+    {
+        auto remaps = std::vector<_vec<stack_id_t>>(1);
+        for (size_t i = 0; i < stacks.size(); i++) remaps[0].push_back(stack_id_t(i));
+
+        auto spool = spool_reader(b.spool);
+        auto store = sv_store();
+        auto out   = mpb::writer(path.c_str());
+        write_event_report(out, spool, stacks, remaps, {}, types, store);
+        out.close();
+    }
+
+    auto file = std::ifstream(path, std::ios::binary);
+    auto data = std::string(std::istreambuf_iterator<char>(file), {});
+    std::filesystem::remove(path);
+
+    auto r = mpb::report_view();
+    CHECK(r.open(data.data(), data.size()));
+
+    size_t event_count = 6 + EXTRA_EVENTS;
+    CHECK(block_count(r, column::EVENT_TYPE) == 2);
+    CHECK(block_count(r, column::EVENT_OBJECT_OFF) == 2);
+
+    auto type   = values(r, column::EVENT_TYPE);
+    auto size   = values(r, column::EVENT_ALLOC_SIZE);
+    auto origin = values(r, column::EVENT_ORIGIN_ID);
+    CHECK(type.size() == event_count);
+    CHECK(size.size() == event_count);
+    CHECK(origin.size() == event_count);
+
+    // Ids are positions, starting from 0. Origins are mapped to the positions
+    // of the allocations they refer to
+    auto first_size   = std::vector<u64>(size.begin(), size.begin() + 6);
+    auto first_origin = std::vector<u64>(origin.begin(), origin.begin() + 6);
+    CHECK(first_size == std::vector<u64>{100, 200, 300, 200, 0, 300});
+    CHECK(first_origin == std::vector<u64>{0, 1, 0, 1, 4, 2});
+    CHECK(type[3] == u64(event_type::FREE));
+    CHECK(origin.back() == event_count - 1);
+
+    // Each stack is stored once, innermost call first
+    auto frame_pc      = values(r, column::FRAME_PC);
+    auto stack_offsets = values(r, column::STACK_OFFSETS);
+    auto stack_pcs     = values(r, column::STACK_PCS);
+    auto stack_id      = values(r, column::EVENT_STACK_ID);
+    CHECK(stack_offsets.size() == 3);
+    auto stack_of = [&](size_t event) {
+        auto pcs = std::vector<addr_t>();
+        for (u64 i = stack_offsets[stack_id[event]]; i < stack_offsets[stack_id[event] + 1]; i++) {
+            pcs.push_back(frame_pc[stack_pcs[i]]);
+        }
+        return pcs;
+    };
+    CHECK(stack_of(0) == std::vector<addr_t>(trace_a, trace_a + 3));
+    CHECK(stack_of(1) == std::vector<addr_t>(trace_b, trace_b + 3));
+    CHECK(stack_id.back() == stack_id[1]);
+
+    // Object offsets restart at 0 in each block
+    auto off = std::vector<u64>();
+    r.for_each_value(*r.find(column::EVENT_OBJECT_OFF, 0), [&](u64 v) { off.push_back(v); });
+    CHECK(off.size() == mpb::EVENTS_PER_BLOCK + 1);
+    auto first_off = std::vector<u64>(off.begin(), off.begin() + 7);
+    CHECK(first_off == std::vector<u64>{0, 0, 1, 1, 3, 3, 3});
+    CHECK(off.back() == 3);
+    CHECK(r.find(column::EVENT_OBJECT_OFF, 1)->count == event_count - mpb::EVENTS_PER_BLOCK + 1);
+
+    CHECK(values(r, column::OBJECT_ID) == std::vector<u64>{7, 9, 7});
+    CHECK(values(r, column::OBJECT_ADDR) == std::vector<u64>{0x50, 0x60, 0x50});
+    CHECK(values(r, column::OBJECT_TRACE_INDEX) == std::vector<u64>{1, 0, 1});
+
+    // Objects refer to types by their index in the type table
+    auto type_data = values(r, column::OBJECT_TYPE_DATA);
+    auto type_name = values(r, column::TYPE_TYPE);
+    CHECK(type_name.size() == 2);
+    CHECK(r.string(type_name[type_data[0]]) == "A");
+    CHECK(r.string(type_name[type_data[1]]) == "B");
+    CHECK(type_data[2] == type_data[0]);
+}
+} // namespace
+
+int main() { test_event_report(); }
@@ -0,0 +1,106 @@
+/// Tests for byte-interval sampling: scaling by the weights of sampled
+/// allocations should give unbiased estimates of the true totals
+#include <check.h>
+
+#include <cmath>
+#include <initializer_list>
+
+#include <mem_profile/sampler.h>
+
+using namespace mp;
+
+namespace {
+constexpr size_t INTERVAL = 4096;
+
+/// Totals over a run of allocations, as estimated from the samples
+struct estimate {
+    double bytes   = 0;
+    double count   = 0;
+    size_t samples = 0;
+};
+
+/// Feed allocations of the given size to the sampler, the same way the
+/// allocation hooks do (see sample_alloc in mem_profile.cpp)
+void feed(byte_sampler& sampler, size_t size, size_t count, estimate& out) {
+    for (size_t i = 0; i < count; i++) {
+        if (!sampler.countdown(size)) continue;
+        float weight = sampler.take_sample(size, INTERVAL);
+        if (weight == 0) continue;
+
+        CHECK(weight >= 1);
+        out.bytes += double(weight) * double(size);
+        out.count += double(weight);
+        out.samples++;
+    }
+}
+
+bool close_to(double estimated, double actual, double tolerance) {
+    return std::abs(estimated / actual - 1) < tolerance;
+}
+
+void test_weights() {
+    // An allocation is sampled with probability 1 - exp(-size / interval),
+    // and its weight is the inverse of that
+    for (size_t size : {1, 100, 4096, 20000}) {
+        auto   sampler  = byte_sampler{-1, 1};
+        float  weight   = sampler.take_sample(size, INTERVAL);
+        double expected = 1 / -std::expm1(-double(size) / double(INTERVAL));
+        CHECK(std::abs(weight / expected - 1) < 1e-6);
+    }
+    // Very large allocations are always sampled, and stand only for themselves
+    auto sampler = byte_sampler{-1, 1};
+    CHECK(sampler.take_sample(INTERVAL * 100, INTERVAL) == 1);
+}
+
+void test_unbiased_per_size() {
+    for (size_t size : {8, 256, 3000, 50000}) {
+        auto   sampler = byte_sampler{0, 42};
+        size_t count   = (size_t(1) << 26) / size;
+        auto   est     = estimate();
+        feed(sampler, size, count, est);
+
+        CHECK(est.samples > 1000);
+        CHECK(close_to(est.bytes, double(size * count), 0.05));
+        CHECK(close_to(est.count, double(count), 0.05));
+    }
+}
+
+void test_unbiased_mixed() {
+    // Small allocations are much less likely to be sampled than large ones,
+    // but the estimated totals should still come out right
+    auto   sampler = byte_sampler{0, 7};
+    auto   est     = estimate();
+    double bytes   = 0;
+    double count   = 0;
+    for (size_t round = 0; round < 20000; round++) {
+        for (size_t size : {16, 48, 512, 9000}) {
+            feed(sampler, size, 1, est);
+            bytes += double(size);
+            count += 1;
+        }
+    }
+    CHECK(close_to(est.bytes, bytes, 0.05));
+    CHECK(close_to(est.count, count, 0.05));
+}
+
+void test_first_sample() {
+    // Thread-local samplers start out zeroed. The first allocation seeds the
+    // generator, and places the first sample point, rather than always being
+    // sampled
+    size_t sampled = 0;
+    for (size_t i = 0; i < 1000; i++) {
+        auto sampler = byte_sampler{};
+        CHECK(sampler.countdown(16));
+        if (sampler.take_sample(16, INTERVAL) != 0) sampled++;
+        CHECK(sampler.rng_state != 0);
+    }
+    CHECK(sampled < 50);
+}
+} // namespace
+
+int main() {
+    test_weights();
+    test_unbiased_per_size();
+    test_unbiased_mixed();
+    test_first_sample();
+}
@@ -0,0 +1,152 @@
+/// Tests for event rings and the event spool they're drained into
+#include <check.h>
+
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include <mem_profile/event_ring.h>
+#include <mem_profile/spool.h>
+
+using namespace mp;
+
+namespace {
+/// Encode an event record with the given id and objects
+auto make_record(u64 id, std::vector<spool_object> const& objects = {}) -> std::string {
+    auto event = spool_event{
+        id,
+        id * 10,
+        id * 16,
+        0,
+        0,
+        stack_id_t(id),
+        u32(objects.size()),
+        1,
+        0,
+        0,
+        0,
+    };
+    auto rec = std::string(as_bytes(event).data(), sizeof(event));
+    auto obj = as_bytes(objects.data(), objects.size());
+    rec.append(obj.data(), obj.size());
+    return rec;
+}
+
+/// Path next to which the spool is created
+auto spool_path() -> std::string {
+    return (std::filesystem::temp_directory_path() / "mp_test_spool").string();
+}
+
+u64 file_size(int fd) {
+    struct stat st {};
+    CHECK(::fstat(fd, &st) == 0);
+    return u64(st.st_size);
+}
+
+void test_ring_wraparound() {
+    auto ring = event_ring(64);
+
+    auto a = std::string(40, 'a');
+    auto b = std::string(40, 'b');
+    CHECK(ring.try_push({byte_view(a.data(), 20), byte_view(a.data() + 20, 20)}));
+    // Not enough room for a second record until the first is consumed
+    CHECK(!ring.try_push({byte_view(b.data(), b.size())}));
+
+    auto out  = std::string();
+    auto sink = [&](byte_view first, byte_view second) {
+        out.append(first.data(), first.size());
+        out.append(second.data(), second.size());
+    };
+    CHECK(ring.consume(sink) == a.size());
+    CHECK(out == a);
+    CHECK(ring.consume(sink) == 0);
+
+    // This record starts at byte 40, so it wraps around the end of the buffer
+    out.clear();
+    size_t parts = 0;
+    CHECK(ring.try_push({byte_view(b.data(), b.size())}));
+    ring.consume([&](byte_view first, byte_view second) {
+        parts = second.empty() ? 1 : 2;
+        sink(first, second);
+    });
+    CHECK(parts == 2);
+    CHECK(out == b);
+}
+
+void test_spool_in_order() {
+    auto spool = spool_file();
+    CHECK(spool.open(spool_path().c_str()));
+
+    // Each thread's records are in order, but chunks from different threads
+    // are interleaved in the file
+    auto objects = std::vector<spool_object>{{4, 0x1000, 2, 7}, {4, 0x2000, 3, 8}};
+    auto t0a     = make_record(1) + make_record(4, objects);
+    auto t1a     = make_record(2) + make_record(3);
+    auto t0b     = make_record(6);
+    auto t1b     = make_record(5);
+    auto t0a_view = byte_view(t0a.data(), t0a.size());
+    CHECK(spool.append(0, t0a_view.first(20), t0a_view.subspan(20)));
+    CHECK(spool.append(1, byte_view(t1a.data(), t1a.size()), {}));
+    CHECK(spool.append(1, byte_view(t1b.data(), t1b.size()), {}));
+    CHECK(spool.append(0, byte_view(t0b.data(), t0b.size()), {}));
+    CHECK(file_size(spool.fd()) == spool.size());
+
+    auto reader  = spool_reader(spool);
+    auto ids     = std::vector<u64>();
+    auto threads = std::vector<u32>();
+    reader.for_each_record_in_order([&](spool_record const& rec) {
+        ids.push_back(rec.event->id);
+        threads.push_back(rec.thread);
+        CHECK(rec.event->alloc_size == rec.event->id * 10);
+        if (rec.event->id == 4) {
+            CHECK(rec.event->object_count == 2);
+            CHECK(rec.objects[1].object_ptr == 0x2000);
+            CHECK(rec.objects[1].type == 8);
+        }
+    });
+    CHECK(ids == std::vector<u64>{1, 2, 3, 4, 5, 6});
+    CHECK(threads == std::vector<u32>{0, 1, 1, 0, 1, 0});
+}
+
+void test_spool_failed_write() {
+    auto spool = spool_file();
+    CHECK(spool.open(spool_path().c_str()));
+
+    auto rec = make_record(1);
+    CHECK(spool.append(0, byte_view(rec.data(), rec.size()), {}));
+    u64 good_size = spool.size();
+
+    // Let the next chunk be written only in part. Exceeding the limit fails
+    // with EFBIG, rather than killing the process
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit old_limit{};
+    CHECK(::getrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+    rlimit limit   = old_limit;
+    limit.rlim_cur = good_size + 100;
+    CHECK(::setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+    auto big = std::string(4096, 'x');
+    CHECK(!spool.append(0, byte_view(big.data(), big.size()), {}));
+    CHECK(::setrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+
+    // The partial chunk is cut off, and nothing more is appended
+    CHECK(spool.size() == good_size);
+    CHECK(file_size(spool.fd()) == good_size);
+    CHECK(!spool.append(0, byte_view(rec.data(), rec.size()), {}));
+    CHECK(spool.size() == good_size);
+
+    size_t count = 0;
+    spool_reader(spool).for_each_record([&](spool_record const&) { count++; });
+    CHECK(count == 1);
+}
+} // namespace
+
+int main() {
+    test_ring_wraparound();
+    test_spool_in_order();
+    test_spool_failed_write();
+}
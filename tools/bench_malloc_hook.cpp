@@ -0,0 +1,85 @@
+/// Measures the cost of a single malloc/free pair, as seen by the program.
+///
+/// Usage: bench_malloc_hook [iterations] [threads]
+///
+/// The benchmark doesn't link the runtime. Run it once on its own for a
+/// baseline, then again with the runtime preloaded, to get the overhead of the
+/// allocation hooks:
+///
+/// ```
+/// bench_malloc_hook
+/// LD_PRELOAD=libmp_runtime.so MEM_PROFILE_SAMPLE_INTERVAL=524288 bench_malloc_hook
+/// ```
+///
+/// With sampling enabled, almost every call only takes the hooks' fast path
+/// (checking the thread's nest level and counting down to the next sample), so
+/// the difference is the per-call cost of the hooks themselves. Without
+/// sampling, every call is recorded, and the time is dominated by unwinding.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <thread>
+#include <vector>
+
+namespace {
+/// Sizes allocated by the benchmark, cycled through in order
+constexpr size_t SIZES[] = {8, 16, 24, 32, 48, 64, 128, 256, 512, 1024};
+
+/// Make a pointer opaque to the optimizer, so that malloc/free pairs aren't
+/// elided
+void* escape(void* ptr) {
+    __asm__ volatile("" : "+r"(ptr)::"memory");
+    return ptr;
+}
+
+/// Returns the average time in nanoseconds of a malloc/free pair
+[[gnu::noinline]] double run_allocs(size_t iterations) {
+    using clock = std::chrono::steady_clock;
+
+    auto start = clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        void* ptr = escape(std::malloc(SIZES[i % std::size(SIZES)]));
+        std::free(ptr);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start);
+
+    return elapsed.count() / double(iterations);
+}
+
+size_t parse_arg(int argc, char** argv, int i, size_t default_) {
+    return i < argc ? std::strtoull(argv[i], nullptr, 10) : default_;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t iterations = parse_arg(argc, argv, 1, 10000000);
+    size_t threads    = std::max<size_t>(parse_arg(argc, argv, 2, 1), 1);
+
+    char const* preload  = std::getenv("LD_PRELOAD");
+    char const* interval = std::getenv("MEM_PROFILE_SAMPLE_INTERVAL");
+    fmt::println("LD_PRELOAD: {}", preload ? preload : "(none)");
+    fmt::println("MEM_PROFILE_SAMPLE_INTERVAL: {}", interval ? interval : "(unset)");
+    fmt::println("iterations: {}, threads: {}", iterations, threads);
+
+    // Warm up the allocator (and the runtime's per-thread state)
+    run_allocs(std::max<size_t>(iterations / 10, 1));
+
+    auto results = std::vector<double>(threads);
+    auto workers = std::vector<std::thread>();
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            run_allocs(std::max<size_t>(iterations / 10, 1));
+            results[t] = run_allocs(iterations);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double total = 0;
+    for (double ns : results) {
+        total += ns;
+    }
+    fmt::println("{:<24} {:>10.2f}", "ns per malloc+free", total / double(threads));
+}
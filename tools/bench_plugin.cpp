@@ -0,0 +1,226 @@
+/// Measures how much the plugin slows down compilation.
+///
+/// Usage: bench_plugin [-n repeats] <compiler> <plugin> <prelude> [flags...] [sources...]
+///
+/// Each source is compiled (to an object file, which is discarded) three ways:
+/// on its own, with only the hook prelude included, and with the prelude and
+/// the plugin, as mp_build_with_plugin does. Arguments starting with `-` are
+/// passed on to every compile. Besides the given sources, a synthetic
+/// translation unit is compiled, which instantiates many class templates with
+/// non-trivial destructors, since that's where the plugin does the most work.
+///
+/// Times are the user + system CPU time of the compiler, and the minimum over
+/// all repeats is reported. Sources which don't compile on their own (eg,
+/// because of missing dependencies) are skipped. The compiler's output is
+/// discarded, so rerun a failing command by hand to see why it failed.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+/// Number of class templates in the synthetic translation unit. Each is
+/// instantiated with several types
+constexpr size_t SYNTHETIC_TEMPLATES = 64;
+
+/// Write the synthetic translation unit to a temporary file, and return its path
+std::string write_synthetic_tu() {
+    char path[] = "/tmp/bench_plugin_XXXXXX.cpp";
+    int  fd     = ::mkstemps(path, 4);
+    if (fd < 0) {
+        fmt::println(stderr,
+                     "bench_plugin: Unable to create synthetic source. {}",
+                     std::strerror(errno));
+        std::exit(1);
+    }
+
+    std::string src = "#include <map>\n"
+                      "#include <memory>\n"
+                      "#include <string>\n"
+                      "#include <unordered_map>\n"
+                      "#include <vector>\n\n";
+    for (size_t i = 0; i < SYNTHETIC_TEMPLATES; i++) {
+        src += fmt::format("template <class T> struct holder_{0} {{\n"
+                           "    std::vector<T>                  items;\n"
+                           "    std::map<std::string, T>        by_name;\n"
+                           "    std::unique_ptr<std::vector<T>> extra;\n"
+                           "    std::shared_ptr<T>              shared;\n"
+                           "    void add(std::string name, T value) {{\n"
+                           "        by_name.emplace(name, value);\n"
+                           "        items.push_back(std::move(value));\n"
+                           "    }}\n"
+                           "    ~holder_{0}() {{ items.clear(); }}\n"
+                           "}};\n"
+                           "void use_{0}() {{\n"
+                           "    holder_{0}<int>                              a;\n"
+                           "    holder_{0}<std::string>                      b;\n"
+                           "    holder_{0}<std::vector<double>>              c;\n"
+                           "    holder_{0}<std::unordered_map<int, std::string>> d;\n"
+                           "    a.add(\"a\", {0});\n"
+                           "    b.add(\"b\", \"{0}\");\n"
+                           "    c.add(\"c\", {{}});\n"
+                           "    d.add(\"d\", {{}});\n"
+                           "}}\n",
+                           i);
+    }
+
+    if (::write(fd, src.data(), src.size()) != ssize_t(src.size())) {
+        fmt::println(stderr,
+                     "bench_plugin: Unable to write synthetic source. {}",
+                     std::strerror(errno));
+        std::exit(1);
+    }
+    ::close(fd);
+    return path;
+}
+
+/// Run a command, returning the CPU time it took in milliseconds, or a
+/// negative value if it failed
+double run(std::vector<std::string> const& args) {
+    auto argv = std::vector<char*>();
+    for (auto const& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = ::fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        // Diagnostics would only bury the results
+        int null_fd = ::open("/dev/null", O_WRONLY);
+        ::dup2(null_fd, STDOUT_FILENO);
+        ::dup2(null_fd, STDERR_FILENO);
+        ::execvp(argv[0], argv.data());
+        std::_Exit(127);
+    }
+
+    int           status = 0;
+    struct rusage usage {};
+    if (::wait4(pid, &status, 0, &usage) < 0) return -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+
+    auto ms = [](timeval tv) { return double(tv.tv_sec) * 1e3 + double(tv.tv_usec) / 1e3; };
+    return ms(usage.ru_utime) + ms(usage.ru_stime);
+}
+
+/// Minimum time over `repeats` runs of a command, or a negative value if any
+/// run failed
+double best_of(size_t repeats, std::vector<std::string> const& args) {
+    double best = -1;
+    for (size_t i = 0; i < repeats; i++) {
+        double t = run(args);
+        if (t < 0) return -1;
+        best = best < 0 ? t : std::min(best, t);
+    }
+    return best;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t repeats = 3;
+    int    i       = 1;
+    if (i + 1 < argc && std::strcmp(argv[i], "-n") == 0) {
+        repeats = std::max<size_t>(std::strtoull(argv[i + 1], nullptr, 10), 1);
+        i += 2;
+    }
+    if (argc - i < 3) {
+        fmt::println(stderr,
+                     "Usage: bench_plugin [-n repeats] <compiler> <plugin> <prelude> "
+                     "[flags...] [sources...]");
+        return 1;
+    }
+    std::string compiler = argv[i++];
+    std::string plugin   = argv[i++];
+    std::string prelude  = argv[i++];
+
+    auto flags   = std::vector<std::string>();
+    auto sources = std::vector<std::string>();
+    for (; i < argc; i++) {
+        (argv[i][0] == '-' ? flags : sources).push_back(argv[i]);
+    }
+    std::string synthetic = write_synthetic_tu();
+    sources.push_back(synthetic);
+
+    auto command = [&](std::string const& source, bool with_prelude, bool with_plugin) {
+        auto args = std::vector<std::string>{compiler, "-c", "-o", "/dev/null"};
+        args.insert(args.end(), flags.begin(), flags.end());
+        if (with_plugin) {
+            args.insert(args.end(),
+                        {"-fplugin=" + plugin,
+                         "-Xclang",
+                         "-add-plugin",
+                         "-Xclang",
+                         "mp_instrument_dtors"});
+        }
+        if (with_prelude) {
+            args.insert(args.end(), {"--include", prelude});
+        }
+        args.push_back(source);
+        return args;
+    };
+
+    // If the plugin can't be loaded (eg, the compiler isn't clang, or isn't
+    // the clang the plugin was built with), every source would fail. Check
+    // once up front, which also warms up the file cache
+    if (run(command(synthetic, true, true)) < 0) {
+        fmt::println(stderr,
+                     "bench_plugin: Unable to compile with the plugin. Check that {} is the "
+                     "clang {} was built with",
+                     compiler,
+                     plugin);
+        ::unlink(synthetic.c_str());
+        return 1;
+    }
+
+    fmt::println("compiler: {}, repeats: {}", compiler, repeats);
+    fmt::println("{:<32} {:>10} {:>10} {:>10} {:>9}",
+                 "source",
+                 "base ms",
+                 "prelude ms",
+                 "plugin ms",
+                 "overhead");
+
+    double total_base   = 0;
+    double total_plugin = 0;
+    for (auto const& source : sources) {
+        auto name = source == synthetic ? std::string("(synthetic)")
+                                        : source.substr(source.find_last_of('/') + 1);
+
+        double base = best_of(repeats, command(source, false, false));
+        if (base < 0) {
+            fmt::println("{:<32} skipped (doesn't compile on its own)", name);
+            continue;
+        }
+        double prelude_only = best_of(repeats, command(source, true, false));
+        double with_plugin  = best_of(repeats, command(source, true, true));
+        if (prelude_only < 0 || with_plugin < 0) {
+            fmt::println("{:<32} failed with the plugin", name);
+            continue;
+        }
+
+        total_base += base;
+        total_plugin += with_plugin;
+        fmt::println("{:<32} {:>10.1f} {:>10.1f} {:>10.1f} {:>8.1f}%",
+                     name,
+                     base,
+                     prelude_only,
+                     with_plugin,
+                     (with_plugin / base - 1) * 100);
+    }
+    ::unlink(synthetic.c_str());
+
+    if (total_base > 0) {
+        fmt::println("{:<32} {:>10.1f} {:>10} {:>10.1f} {:>8.1f}%",
+                     "total",
+                     total_base,
+                     "",
+                     total_plugin,
+                     (total_plugin / total_base - 1) * 100);
+    }
+}
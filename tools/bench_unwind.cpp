@@ -0,0 +1,106 @@
+/// Measures the cost of a single call to mp_unwind with each unwind backend.
+///
+/// Usage: bench_unwind [depth] [iterations]
+///
+/// The benchmark recurses `depth` frames deep before unwinding, so that each
+/// unwind walks a realistic number of frames. It should be compiled with
+/// `-fno-omit-frame-pointer`, otherwise the frame pointer backend spends most
+/// of its time falling back to libunwind.
+#include <mp_unwind/mp_unwind.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <string_view>
+
+namespace {
+constexpr size_t MAX_FRAMES = 1024;
+
+struct bench_result {
+    double ns_per_unwind = 0;
+    size_t frames        = 0;
+    /// Program counters from the last unwind, so backends can be compared
+    uintptr_t trace[MAX_FRAMES];
+};
+
+[[gnu::noinline]] void run_unwinds(size_t iterations, bench_result& result) {
+    using clock = std::chrono::steady_clock;
+
+    uintptr_t spp[MAX_FRAMES];
+
+    auto start = clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        result.frames = mp::mp_unwind(MAX_FRAMES, result.trace, spp);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start);
+
+    result.ns_per_unwind = elapsed.count() / double(iterations);
+}
+
+/// Recurse to the given depth, then run the benchmark
+[[gnu::noinline]] void recurse(size_t depth, size_t iterations, bench_result& result) {
+    if (depth == 0) {
+        run_unwinds(iterations, result);
+    } else {
+        recurse(depth - 1, iterations, result);
+    }
+    // Prevent the recursive call from being turned into a tail call
+    __asm__ volatile("" ::: "memory");
+}
+
+size_t parse_arg(int argc, char** argv, int i, size_t default_) {
+    return i < argc ? std::strtoull(argv[i], nullptr, 10) : default_;
+}
+
+std::string_view backend_name(mp::unwind_backend backend) {
+    switch (backend) {
+    case mp::unwind_backend::LIBUNWIND:     return "libunwind";
+    case mp::unwind_backend::FRAME_POINTER: return "frame_pointer";
+    }
+    return "<unknown>";
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t depth      = parse_arg(argc, argv, 1, 32);
+    size_t iterations = parse_arg(argc, argv, 2, 100000);
+
+    constexpr mp::unwind_backend backends[] = {
+        mp::unwind_backend::LIBUNWIND,
+        mp::unwind_backend::FRAME_POINTER,
+    };
+
+    static bench_result results[std::size(backends)];
+
+    fmt::println("depth: {}, iterations: {}", depth, iterations);
+    fmt::println("{:<16} {:>8} {:>14}", "backend", "frames", "ns/unwind");
+
+    for (size_t i = 0; i < std::size(backends); i++) {
+        if (!mp::set_unwind_backend(backends[i])) {
+            fmt::println("{:<16} (not supported)", backend_name(backends[i]));
+            continue;
+        }
+
+        // Warm up caches (libunwind caches unwind info for each address)
+        recurse(depth, std::max<size_t>(iterations / 10, 1), results[i]);
+        recurse(depth, iterations, results[i]);
+
+        fmt::println("{:<16} {:>8} {:>14.1f}",
+                     backend_name(backends[i]),
+                     results[i].frames,
+                     results[i].ns_per_unwind);
+    }
+
+    // Both backends should find the same frames, at least as far as the
+    // frame pointer chain reaches. The first frame (mp_unwind itself) is
+    // skipped: each backend reports a different address within it.
+    auto const& a     = results[0];
+    auto const& b     = results[1];
+    size_t      count = std::min(a.frames, b.frames);
+    size_t      same  = std::min<size_t>(count, 1);
+    while (same < count && a.trace[same] == b.trace[same]) {
+        same++;
+    }
+    fmt::println("traces agree on the first {} of {} frames", same, count);
+}
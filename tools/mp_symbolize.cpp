@@ -0,0 +1,179 @@
+/// Symbolizes a report written with MEM_PROFILE_SYMBOLIZE=deferred.
+///
+/// Usage: mp_symbolize <report.json> [output.json]
+///
+/// Each program counter is matched to the module it was recorded in, using the
+/// report's module table, and resolved against that module's object file. The
+/// object files must still be present at the recorded paths. If an object file
+/// no longer matches the recorded build-id, a warning is printed, since its
+/// symbols are likely to be wrong.
+///
+/// The report is overwritten unless an output file is given.
+
+#include <mem_profile/output_record.h>
+#include <mem_profile/output_record_io.h>
+
+#include <cerrno>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mp {
+namespace {
+/// Read the GNU build-id of an ELF file from its notes, as a hex string.
+/// Returns an empty string if the file couldn't be read or has no build-id.
+std::string file_build_id(std::string const& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return {};
+
+    struct stat st {};
+    void*       data = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Elf64_Ehdr)) {
+        data = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED) return {};
+
+    constexpr char HEX[] = "0123456789abcdef";
+
+    auto const* base   = (char const*)data;
+    auto        size   = size_t(st.st_size);
+    auto const* ehdr   = (Elf64_Ehdr const*)base;
+    std::string result;
+
+    // Only 64-bit objects are recorded by the runtime
+    bool is_elf64 = std::memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0
+                 && ehdr->e_ident[EI_CLASS] == ELFCLASS64;
+    bool has_phdrs = ehdr->e_phoff <= size
+                  && size_t(ehdr->e_phnum) * sizeof(Elf64_Phdr) <= size - ehdr->e_phoff;
+    for (size_t i = 0; is_elf64 && has_phdrs && i < ehdr->e_phnum && result.empty(); i++) {
+        auto const& phdr = ((Elf64_Phdr const*)(base + ehdr->e_phoff))[i];
+        bool in_file     = phdr.p_offset <= size && phdr.p_filesz <= size - phdr.p_offset;
+        if (phdr.p_type != PT_NOTE || !in_file) continue;
+
+        auto const* p   = base + phdr.p_offset;
+        auto const* end = p + phdr.p_filesz;
+        while (p + sizeof(Elf64_Nhdr) <= end) {
+            auto const* note = (Elf64_Nhdr const*)p;
+            auto const* name = p + sizeof(Elf64_Nhdr);
+            auto const* desc = name + ((note->n_namesz + 3) & ~3u);
+            p                = desc + ((note->n_descsz + 3) & ~3u);
+
+            bool is_build_id = note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+                            && std::memcmp(name, "GNU", 4) == 0;
+            if (!is_build_id || p > end) continue;
+
+            for (size_t j = 0; j < note->n_descsz; j++) {
+                auto byte = u8(desc[j]);
+                result.push_back(HEX[byte >> 4]);
+                result.push_back(HEX[byte & 0xf]);
+            }
+            break;
+        }
+    }
+    ::munmap(data, size);
+    return result;
+}
+
+/// Warn about any module whose object file was rebuilt since the report was
+/// recorded
+void check_build_ids(output_record const& record) {
+    auto const& modules = record.module_table;
+    for (size_t i = 0; i < modules.path.size(); i++) {
+        auto const& expected = record.strtab[modules.build_id[i]];
+        if (expected.empty()) continue;
+
+        auto const& path   = record.strtab[modules.path[i]];
+        auto        actual = file_build_id(path);
+        if (actual != expected) {
+            fmt::println(stderr,
+                         "mp_symbolize: warning: build-id of '{}' is {}, but the report "
+                         "expects {}. Frames in this module may be symbolized incorrectly.",
+                         path,
+                         actual.empty() ? "missing" : actual,
+                         expected);
+        }
+    }
+}
+
+/// Find the module containing `pc`. Later modules take precedence, since an
+/// address range may have been reused after a module was unloaded. Returns
+/// the number of modules if none contain it.
+size_t find_module(output_module_table const& modules, addr_t pc) {
+    for (size_t i = modules.begin.size(); i-- > 0;) {
+        if (modules.begin[i] <= pc && pc < modules.end[i]) return i;
+    }
+    return modules.begin.size();
+}
+
+void symbolize(output_record& record) {
+    auto const& modules = record.module_table;
+    auto        pcs     = record.frame_table.pc;
+
+    auto object_frames = std::vector<cpptrace::object_frame>(pcs.size());
+    for (size_t i = 0; i < pcs.size(); i++) {
+        size_t m         = find_module(modules, pcs[i]);
+        object_frames[i] = m == modules.begin.size()
+                             ? cpptrace::object_frame{pcs[i], 0, {}}
+                             : cpptrace::object_frame{
+                                   pcs[i],
+                                   pcs[i] - modules.load_base[m],
+                                   record.strtab[modules.path[m]],
+                               };
+    }
+    auto stack_frames = cpptrace::object_trace{object_frames}.resolve().frames;
+
+    // Existing strings must keep their indices, since the rest of the report
+    // refers to them, so they're added without deduplication
+    sv_store     store;
+    string_table strtab{store};
+    for (auto const& str : record.strtab) {
+        strtab.lookup.try_emplace(str, str_index_t(strtab.size()));
+        strtab.strtab.emplace_back(str);
+    }
+
+    // dladdr can't be used on another process's addresses, so symbols come
+    // only from the object files
+    auto dl_info = std::vector<Dl_info>(pcs.size());
+    auto frames  = output_frame_table(strtab, pcs, object_frames, stack_frames, dl_info);
+
+    record.frame_table = std::move(frames);
+    record.strtab      = std::vector<std::string>(strtab.strtab.begin(), strtab.strtab.end());
+}
+} // namespace
+} // namespace mp
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fmt::println(stderr, "Usage: {} <report.json> [output.json]", argv[0]);
+        return 1;
+    }
+    char const* input  = argv[1];
+    char const* output = argc == 3 ? argv[2] : argv[1];
+
+    try {
+        auto record = mp::output_record();
+        auto buffer = std::string();
+        if (auto ec = glz::read_file_json(record, input, buffer)) {
+            throw ERR("Unable to read report '{}'. {}", input, glz::format_error(ec, buffer));
+        }
+
+        if (record.frame_table.is_symbolized()) {
+            fmt::println(stderr, "mp_symbolize: '{}' is already symbolized", input);
+        } else {
+            mp::check_build_ids(record);
+            mp::symbolize(record);
+        }
+
+        constexpr glz::opts opts{.skip_null_members = false};
+        if (auto ec = glz::write_file_json<opts>(record, output, std::string{})) {
+            throw ERR("Unable to write report '{}'. {}", output, glz::format_error(ec, {}));
+        }
+    } catch (mp::mp_error const& err) {
+        mp::terminate_with_error(err);
+    }
+}